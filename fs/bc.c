@@ -1,6 +1,14 @@
 
 #include "fs.h"
 
+#include <arch/thread.h>
+
+// Where bc_fetch reads a block before putting it in the cache
+#define STAGEVA		(DISKMAP - PGSIZE)
+
+// Block that bc_fetch is reading in, or 0
+static uint32_t bc_reading;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -75,6 +83,53 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
+// Make sure block 'blockno' is in the block cache.  Unlike faulting it
+// in, this lets the other server threads run while the disk works:
+// the block is read into a staging page, and only mapped into the
+// cache once it is complete.  Threads take turns reading, since the
+// drive handles one command at a time.
+void
+bc_fetch(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+	int r;
+
+	while (!va_is_mapped(addr)) {
+		if (bc_reading) {
+			thread_wait(&bc_reading, bc_reading, ~0);
+			continue;
+		}
+
+		bc_reading = blockno;
+		if ((r = sys_page_alloc(0, (void *) STAGEVA, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_fetch, sys_page_alloc: %e", r);
+		ide_start_read(blockno*BLKSECTS, (void *) STAGEVA, BLKSECTS);
+		while ((r = ide_poll()) > 0)
+			thread_yield();
+		if (r < 0)
+			panic("in bc_fetch, ide_read: %e", r);
+
+		// A page fault may have read the block in the meantime
+		if (!va_is_mapped(addr)
+		    && (r = sys_page_map(0, (void *) STAGEVA, 0, addr,
+					 PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_fetch, sys_page_map: %e", r);
+		sys_page_unmap(0, (void *) STAGEVA);
+		bc_reading = 0;
+		thread_wakeup(&bc_reading);
+
+		if (bitmap && block_is_free(blockno))
+			panic("reading free block %08x\n", blockno);
+	}
+}
+
+// Is some thread in bc_fetch reading from the disk?
+bool
+bc_fetching(void)
+{
+	return bc_reading != 0;
+}
+
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
 // If the block is not in the block cache or is not dirty, does
@@ -44,11 +44,11 @@ free_block(uint32_t blockno)
 	if (blockno == 0)
 		panic("attempt to free zero block");
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	journal_add(&bitmap[blockno/32]);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Search the bitmap for a free block and allocate it.  The changed
+// bitmap block goes to disk with the running journal transaction.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
@@ -68,10 +68,10 @@ alloc_block(void)
 	// Loop through all possible blocks, checking if there is any free
 	int blockno;
 	for (blockno = 1; blockno < super->s_nblocks; blockno++) {
-		// If find a free block, mark it used and flush the bitmap block
+		// If find a free block, mark it used and journal the bitmap block
 		if(block_is_free(blockno)) {
 			bitmap[blockno / 32] &= ~(1<<(blockno%32));
-			flush_block(&bitmap[blockno/32]);
+			journal_add(&bitmap[blockno/32]);
 			return blockno;
 		}
 	}
@@ -123,6 +123,9 @@ fs_init(void)
 	super = diskaddr(1);
 	check_super();
 
+	// Finish any metadata update a crash interrupted
+	journal_replay();
+
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
@@ -180,15 +183,18 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 
 			// Clear the allocated block
 			memset(blockno_to_va(newblkno), 0, BLKSIZE);
+			journal_add(blockno_to_va(newblkno));
 
 			// Make it the indirect block
 			f->f_indirect = newblkno;
+			journal_add(f);
 		} else {
 			return -E_NOT_FOUND;
 		}
 	}
 
-	// Access the indirect block
+	// Access the indirect block, reading it in first if needed
+	bc_fetch(f->f_indirect);
 	uint32_t *indirect_blk = (uint32_t *) blockno_to_va(f->f_indirect);
 	*ppdiskbno = &indirect_blk[filebno - NDIRECT];
 	return 0;
@@ -223,11 +229,42 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 		// Clear the allocated block
 		memset(blockno_to_va(newblkno), 0, BLKSIZE);
 
-		// Update the value
+		// Update the value, which is in f or its indirect block
 		*blockno_entry = newblkno;
+		journal_add(blockno_entry);
 	}
 
-	// Set *blk to the va where the block is mapped
+	// Set *blk to the va where the block is mapped, and make sure
+	// it is in the cache
+	bc_fetch(*blockno_entry);
+	*blk = blockno_to_va(*blockno_entry);
+	return 0;
+}
+
+// A block of zeros, which holes in files read as
+static char zero_block[BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+// Like file_get_block, but never allocates, for the requests that only
+// read: they run concurrently, so they mustn't touch the bitmap or the
+// journal.  Sets *blk to the block cache page of the filebno'th block
+// of file 'f', or, if that block is a hole, to a page of zeros.
+//
+// Returns 0 on success, -E_INVAL if filebno is out of range.
+int
+file_find_block(struct File *f, uint32_t filebno, char **blk)
+{
+	uint32_t *blockno_entry;
+	int r;
+
+	r = file_block_walk(f, filebno, &blockno_entry, 0);
+	if (r == -E_NOT_FOUND || (r == 0 && *blockno_entry == 0)) {
+		*blk = zero_block;
+		return 0;
+	}
+	if (r < 0)
+		return r;
+
+	bc_fetch(*blockno_entry);
 	*blk = blockno_to_va(*blockno_entry);
 	return 0;
 }
@@ -250,7 +287,7 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+		if ((r = file_find_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
@@ -285,6 +322,7 @@ dir_alloc_file(struct File *dir, struct File **file)
 			}
 	}
 	dir->f_size += BLKSIZE;
+	journal_add(dir);
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
 	f = (struct File*) blk;
@@ -378,8 +416,8 @@ file_create(const char *path, struct File **pf)
 		return r;
 
 	strcpy(f->f_name, name);
+	journal_add(f);
 	*pf = f;
-	file_flush(dir);
 	return 0;
 }
 
@@ -407,7 +445,7 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	count = MIN(count, f->f_size - offset);
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_find_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(buf, blk + pos % BLKSIZE, bn);
@@ -460,6 +498,7 @@ file_free_block(struct File *f, uint32_t filebno)
 	if (*ptr) {
 		free_block(*ptr);
 		*ptr = 0;
+		journal_add(ptr);
 	}
 	return 0;
 }
@@ -498,37 +537,41 @@ file_set_size(struct File *f, off_t newsize)
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
-	flush_block(f);
+	journal_add(f);
 	return 0;
 }
 
-// Flush the contents and metadata of file f out to disk.
+// Flush the contents of file f out to disk.
 // Loop over all the blocks in file.
 // Translate the file block number into a disk block number
 // and then check whether that disk block is dirty.  If so, write it out.
+// Its metadata, and the contents of directories, go to disk with the
+// journal instead.
 void
 file_flush(struct File *f)
 {
 	int i;
 	uint32_t *pdiskbno;
 
+	if (f->f_type == FTYPE_DIR)
+		return;
 	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
 		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
 		    pdiskbno == NULL || *pdiskbno == 0)
 			continue;
 		flush_block(diskaddr(*pdiskbno));
 	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
 }
 
 
 // Sync the entire file system.  A big hammer.
+// Commit the metadata first: what is dirty after that is file data.
 void
 fs_sync(void)
 {
 	int i;
+
+	journal_commit();
 	for (i = 1; i < super->s_nblocks; i++)
 		flush_block(diskaddr(i));
 }
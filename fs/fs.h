@@ -20,17 +20,35 @@ void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+void	ide_start_read(uint32_t secno, void *dst, size_t nsecs);
+int	ide_poll(void);
+void	ide_finish(void);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_fetch(uint32_t blockno);
+bool	bc_fetching(void);
 void	bc_init(void);
 
+/* journal.c */
+
+/* Most metadata blocks one request changes */
+#define JOURNAL_OPBLOCKS	8
+
+void	journal_replay(void);
+void	journal_add(void *addr);
+void	journal_reserve(void);
+uint32_t journal_pending(void);
+uint32_t journal_committed(void);
+void	journal_commit(void);
+
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_find_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
@@ -45,6 +45,7 @@ uint32_t nblocks;
 char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
+struct JournalHeader *journal;
 
 void
 panic(const char *fmt, ...)
@@ -117,6 +118,11 @@ opendisk(const char *name)
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	journal = alloc(JOURNALSIZE * BLKSIZE);
+	journal->jh_magic = JOURNAL_MAGIC;
+	super->s_journal = blockof(journal);
+	super->s_njournal = JOURNALSIZE;
 }
 
 void
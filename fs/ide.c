@@ -14,6 +14,13 @@
 
 static int diskno = 1;
 
+// The read started by ide_start_read, if it hasn't finished yet
+static struct {
+	void *dst;		// where the next sector goes
+	size_t nsecs;		// sectors still to come
+	int error;		// result, once nsecs reaches 0
+} pending;
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -60,6 +67,65 @@ ide_set_disk(int d)
 }
 
 
+static void
+ide_command(uint32_t secno, size_t nsecs, uint8_t cmd)
+{
+	outb(0x1F2, nsecs);
+	outb(0x1F3, secno & 0xFF);
+	outb(0x1F4, (secno >> 8) & 0xFF);
+	outb(0x1F5, (secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+	outb(0x1F7, cmd);
+}
+
+// Start reading 'nsecs' sectors into 'dst' without waiting for them,
+// and let ide_poll bring them in while the caller does other things.
+// Only one read can be in progress at a time.
+void
+ide_start_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	assert(nsecs > 0 && nsecs <= 256);
+	ide_finish();
+
+	ide_wait_ready(0);
+	ide_command(secno, nsecs, 0x20);	// CMD 0x20 means read sector
+	pending.dst = dst;
+	pending.nsecs = nsecs;
+	pending.error = 0;
+}
+
+// Copy in the sectors of the pending read that the drive has ready.
+// Returns 1 if the read is still in progress, otherwise its result:
+// 0 on success, < 0 on error.
+int
+ide_poll(void)
+{
+	int r;
+
+	while (pending.nsecs > 0) {
+		r = inb(0x1F7);
+		if ((r & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+			return 1;
+		if (r & (IDE_DF|IDE_ERR)) {
+			pending.nsecs = 0;
+			pending.error = -1;
+			break;
+		}
+		insl(0x1F0, pending.dst, SECTSIZE/4);
+		pending.dst += SECTSIZE;
+		pending.nsecs--;
+	}
+	return pending.error;
+}
+
+// Wait for the pending read, if any, so the drive can take a new command
+void
+ide_finish(void)
+{
+	while (ide_poll() > 0)
+		/* do nothing */;
+}
+
 int
 ide_read(uint32_t secno, void *dst, size_t nsecs)
 {
@@ -67,14 +133,10 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	ide_finish();
 	ide_wait_ready(0);
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	ide_command(secno, nsecs, 0x20);	// CMD 0x20 means read sector
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
@@ -92,14 +154,10 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	ide_finish();
 	ide_wait_ready(0);
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	ide_command(secno, nsecs, 0x30);	// CMD 0x30 means write sector
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
@@ -0,0 +1,147 @@
+#include <inc/string.h>
+
+#include "fs.h"
+
+/*
+ * Metadata journal.
+ *
+ * Changes to metadata -- the bitmap, File structures, directory and
+ * indirect blocks -- are not written in place as they happen.  Instead
+ * journal_add records the block in the running transaction, and
+ * journal_commit later writes all the blocks of the transaction to the
+ * log with a single disk command, writes the header to commit them,
+ * and only then copies them to their homes.  A crash leaves either the
+ * old or the new version of every block of a transaction: if the
+ * header says a transaction committed, fs_init copies it home again
+ * with journal_replay.
+ *
+ * Blocks in the running transaction must never be flushed in place.
+ * File data isn't journaled, and is still written with flush_block.
+ */
+
+// Where the blocks of a transaction are mapped to write them to the
+// log in one go
+#define LOGVA		0x0ff00000
+
+// Most blocks a transaction can hold.  A disk command transfers at
+// most 256 sectors.
+#define MAXTXBLOCKS	MIN(JOURNALSIZE - 1, 256 / BLKSECTS)
+
+static struct JournalHeader *header;
+static uint32_t txblocks[JOURNALSIZE - 1];	// blocks in the transaction
+static uint32_t ntxblocks;
+static uint32_t txseq;		// number of the running transaction
+static uint32_t committed;	// number of the last one committed
+
+// Copy a committed transaction left in the journal by a crash to its
+// home locations, then check the journal.
+void
+journal_replay(void)
+{
+	uint32_t i;
+
+	if (super->s_journal == 0 || super->s_njournal != JOURNALSIZE)
+		panic("file system has no journal");
+	header = diskaddr(super->s_journal);
+	if (header->jh_magic != JOURNAL_MAGIC)
+		panic("bad journal magic number");
+	if (header->jh_nblocks > MAXTXBLOCKS)
+		panic("journal transaction too large");
+
+	if (header->jh_nblocks) {
+		cprintf("journal: replaying %d blocks\n", header->jh_nblocks);
+		for (i = 0; i < header->jh_nblocks; i++) {
+			memmove(diskaddr(header->jh_blocks[i]),
+				diskaddr(super->s_journal + 1 + i), BLKSIZE);
+			flush_block(diskaddr(header->jh_blocks[i]));
+			sys_page_unmap(0, diskaddr(super->s_journal + 1 + i));
+		}
+		header->jh_nblocks = 0;
+		flush_block(header);
+	}
+
+	committed = header->jh_seq;
+	txseq = committed + 1;
+	cprintf("journal is good\n");
+}
+
+// Add the block holding 'addr' to the running transaction.  Call it
+// after changing the block.
+void
+journal_add(void *addr)
+{
+	uint32_t blockno = ((uint32_t) addr - DISKMAP) / BLKSIZE, i;
+
+	for (i = 0; i < ntxblocks; i++)
+		if (txblocks[i] == blockno)
+			return;
+	if (ntxblocks == MAXTXBLOCKS)
+		panic("journal transaction full");
+	txblocks[ntxblocks++] = blockno;
+}
+
+// Make sure the running transaction has room for the changes of one
+// more request, committing it first if not.  The caller must be
+// allowed to commit (see journal_commit).
+void
+journal_reserve(void)
+{
+	if (ntxblocks + JOURNAL_OPBLOCKS > MAXTXBLOCKS)
+		journal_commit();
+}
+
+// Return the number of the running transaction if it holds any
+// changes, 0 otherwise.
+uint32_t
+journal_pending(void)
+{
+	return ntxblocks ? txseq : 0;
+}
+
+// Return the number of the last transaction that is on disk.
+uint32_t
+journal_committed(void)
+{
+	return committed;
+}
+
+// Write the running transaction to disk.  Nothing may be half way
+// through changing metadata when this is called, since it would commit
+// the half that is done.  It doesn't yield, so the blocks don't change
+// under it.
+void
+journal_commit(void)
+{
+	uint32_t i;
+	int r;
+
+	if (ntxblocks == 0)
+		return;
+
+	// Write the log, straight from the block cache
+	for (i = 0; i < ntxblocks; i++)
+		if ((r = sys_page_map(0, diskaddr(txblocks[i]),
+				      0, (void *) (LOGVA + i * BLKSIZE),
+				      PTE_P|PTE_U)) < 0)
+			panic("in journal_commit, sys_page_map: %e", r);
+	if ((r = ide_write((super->s_journal + 1) * BLKSECTS, (void *) LOGVA,
+			   ntxblocks * BLKSECTS)) < 0)
+		panic("in journal_commit, ide_write: %e", r);
+	for (i = 0; i < ntxblocks; i++)
+		sys_page_unmap(0, (void *) (LOGVA + i * BLKSIZE));
+
+	// Commit
+	header->jh_seq = txseq;
+	header->jh_nblocks = ntxblocks;
+	memmove(header->jh_blocks, txblocks, ntxblocks * sizeof(uint32_t));
+	flush_block(header);
+
+	// Install the blocks, which also leaves them clean in the cache
+	for (i = 0; i < ntxblocks; i++)
+		flush_block(diskaddr(txblocks[i]));
+	header->jh_nblocks = 0;
+	flush_block(header);
+
+	committed = txseq++;
+	ntxblocks = 0;
+}
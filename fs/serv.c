@@ -1,11 +1,23 @@
 /*
  * File system server main loop -
  * serves IPC requests from other environments.
+ *
+ * Every request runs in a thread of its own (see net/lwip/jos/arch), so
+ * a request that has to wait for the disk doesn't hold up the ones
+ * that find their blocks in the cache.  Threads only switch while
+ * waiting in bc_fetch, for the locks below, or for a journal commit.
+ *
+ * Requests that change metadata reply once their changes are in the
+ * journal on disk.  Rather than commit after every one of them, the
+ * first to finish waits a little for others to finish too, and then
+ * commits all their changes at once (group commit).
  */
 
 #include <inc/x86.h>
 #include <inc/string.h>
 
+#include <arch/thread.h>
+
 #include "fs.h"
 
 
@@ -34,6 +46,7 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	uint32_t o_reading;	// a serve_read is using o_fd's offset
 };
 
 // Max number of open files in the file system at once
@@ -45,8 +58,39 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Requests being served.  Each one gets its own page at REQVA to
+// receive the client's arguments in.
+#define MAXREQ		16
+#define REQVA		0x0ffe0000
+
+struct Request {
+	bool r_busy;		// in use by a serving thread
+	uint32_t r_req;		// request type
+	envid_t r_whom;		// client
+	union Fsipc *r_ipc;	// argument page
+};
+
+static struct Request requests[MAXREQ];
+static uint32_t nrequests;	// number of busy requests
+
+// Where a request waiting for a commit keeps a reference to the page
+// it will reply with, one page per request
+#define HOLDVA		0x0ffc0000
+
+// How often the main thread comes back to poll the disk, while some
+// thread is waiting for it
+#define IOPOLL_NSEC	100000
+
+// Requests that change the file system run alone, the others side by
+// side.  A waiting writer keeps new readers out.
+static uint32_t fs_readers;	// number of read-only requests running
+static uint32_t fs_writer;	// a request that writes is running or waiting
+
+// How many times the committing thread yields before it commits,
+// letting the main thread take in more requests that write
+#define COMMIT_ROUNDS	2
+
+static uint32_t committing;	// some thread is about to commit
 
 void
 serve_init(void)
@@ -58,6 +102,58 @@ serve_init(void)
 		opentab[i].o_fd = (struct Fd*) va;
 		va += PGSIZE;
 	}
+	for (i = 0; i < MAXREQ; i++)
+		requests[i].r_ipc = (union Fsipc *) (REQVA + i * PGSIZE);
+}
+
+static void
+fs_lock(bool write)
+{
+	while (fs_writer)
+		thread_wait(&fs_writer, fs_writer, ~0);
+	if (!write) {
+		fs_readers++;
+		return;
+	}
+	fs_writer = 1;
+	while (fs_readers)
+		thread_wait(&fs_readers, fs_readers, ~0);
+}
+
+static void
+fs_unlock(bool write)
+{
+	if (write) {
+		fs_writer = 0;
+		thread_wakeup(&fs_writer);
+	} else {
+		fs_readers--;
+		thread_wakeup(&fs_readers);
+	}
+}
+
+// Wait until journal transaction 'seq' is on disk, committing it if
+// no other thread is about to.
+static void
+commit_wait(uint32_t seq)
+{
+	int i;
+
+	while (journal_committed() < seq) {
+		if (committing) {
+			thread_wait(&committing, 1, ~0);
+			continue;
+		}
+
+		committing = 1;
+		for (i = 0; i < COMMIT_ROUNDS; i++)
+			thread_yield();
+		fs_lock(1);
+		journal_commit();
+		fs_unlock(1);
+		committing = 0;
+		thread_wakeup(&committing);
+	}
 }
 
 // Allocate an open file.
@@ -116,15 +212,8 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	memmove(path, req->req_path, MAXPATHLEN);
 	path[MAXPATHLEN-1] = 0;
 
-	// Find an open file ID
-	if ((r = openfile_alloc(&o)) < 0) {
-		if (debug)
-			cprintf("openfile_alloc failed: %e", r);
-		return r;
-	}
-	fileid = r;
-
-	// Open the file
+	// Open the file.  This may wait for the disk, which lets other
+	// requests run, so we only take an open file ID afterwards.
 	if (req->req_omode & O_CREAT) {
 		if ((r = file_create(path, &f)) < 0) {
 			if (!(req->req_omode & O_EXCL) && r == -E_FILE_EXISTS)
@@ -156,6 +245,14 @@ try_open:
 		return r;
 	}
 
+	// Find an open file ID
+	if ((r = openfile_alloc(&o)) < 0) {
+		if (debug)
+			cprintf("openfile_alloc failed: %e", r);
+		return r;
+	}
+	fileid = r;
+
 	// Save the file pointer
 	o->o_file = f;
 
@@ -220,6 +317,14 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
+	// Reads run concurrently, and file_read can yield to another
+	// thread while it waits for the disk.  Environments sharing the Fd
+	// (after fork, say) would then read at the same offset, so reads
+	// of one open file take turns.
+	while (o->o_reading)
+		thread_wait(&o->o_reading, 1, ~0);
+	o->o_reading = 1;
+
 	// Second: Call the relevant file system function, in this case file_read.
 	// We put the data in ret (&ipc->readRet), which is in the shared page,
 	// so the client has access to the data read.
@@ -228,15 +333,14 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	off_t offset = o->o_fd->fd_offset;
 	r = file_read(file_to_read, ret, count, offset);
 
-	// On failure, return the error code to the client.
-	if (r < 0) {
-		return r;
 	// On success, update the seek position and return the number of bytes read
-	} else {
-		uint32_t bytes_read = r;
-		o->o_fd->fd_offset += bytes_read;
-		return bytes_read;
-	}
+	if (r >= 0)
+		o->o_fd->fd_offset += r;
+	o->o_reading = 0;
+	thread_wakeup(&o->o_reading);
+
+	// On failure, return the error code to the client.
+	return r;
 }
 
 
@@ -312,6 +416,40 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 	return 0;
 }
 
+// Share the block cache page holding byte req->req_offset of
+// req->req_fileid with the caller, read-only, by setting *pg_store and
+// *perm_store.  Returns the number of bytes of the file in that block
+// from req->req_offset on, or 0 at the end of the file.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	struct File *f;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	f = o->o_file;
+	if (req->req_offset < 0)
+		return -E_INVAL;
+	if (req->req_offset >= f->f_size)
+		return 0;
+	// This brings the block in from disk, since we can only share
+	// mapped pages.  A hole is shared as a page of zeros, which
+	// doesn't see later writes there the way a cache page would.
+	if ((r = file_find_block(f, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	return MIN(BLKSIZE - req->req_offset % BLKSIZE,
+		   f->f_size - req->req_offset);
+}
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -334,19 +472,117 @@ fshandler handlers[] = {
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Does request 'rq' change the file system?
+static bool
+request_writes(struct Request *rq)
+{
+	switch (rq->r_req) {
+	case FSREQ_OPEN:
+		return (rq->r_ipc->open.req_omode & (O_CREAT|O_TRUNC)) != 0;
+	case FSREQ_READ:
+	case FSREQ_STAT:
+	case FSREQ_MAP:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+// Serve requests[i] and send the reply
+static void
+serve_thread(uint32_t i)
+{
+	struct Request *rq = &requests[i];
+	union Fsipc *fsreq = rq->r_ipc;
+	bool write = request_writes(rq);
+	void *pg = NULL, *hold = (void *) (HOLDVA + i * PGSIZE);
+	uint32_t seq = 0;
+	int perm = 0, r;
+
+	fs_lock(write);
+	if (write)
+		journal_reserve();
+	if (rq->r_req == FSREQ_OPEN) {
+		r = serve_open(rq->r_whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+	} else if (rq->r_req == FSREQ_MAP) {
+		r = serve_map(rq->r_whom, (struct Fsreq_map*)fsreq, &pg, &perm);
+	} else if (rq->r_req < NHANDLERS && handlers[rq->r_req]) {
+		r = handlers[rq->r_req](rq->r_whom, fsreq);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", rq->r_req,
+			rq->r_whom);
+		r = -E_INVAL;
+	}
+	if (write)
+		seq = journal_pending();
+	if (!seq) {
+		// Reply before letting writers in, since pg may be a cached block
+		ipc_send(rq->r_whom, r, pg, perm);
+		fs_unlock(write);
+	} else {
+		// pg is an Fd page, if any.  Keep it referenced while we
+		// wait, so openfile_alloc doesn't hand it out again.
+		if (pg && sys_page_map(0, pg, 0, hold, PTE_P|PTE_U) < 0)
+			panic("in serve_thread, cannot hold the reply page");
+		fs_unlock(write);
+		commit_wait(seq);
+		ipc_send(rq->r_whom, r, pg, perm);
+		if (pg)
+			sys_page_unmap(0, hold);
+	}
+
+	sys_page_unmap(0, fsreq);
+	rq->r_busy = 0;
+	nrequests--;
+	thread_wakeup(&nrequests);
+}
+
+static struct Request *
+request_alloc(void)
+{
+	int i;
+
+	while (nrequests == MAXREQ)
+		thread_wait(&nrequests, MAXREQ, ~0);
+	for (i = 0; i < MAXREQ; i++)
+		if (!requests[i].r_busy)
+			break;
+	requests[i].r_busy = 1;
+	nrequests++;
+	return &requests[i];
+}
+
 void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	struct Request *rq = NULL;
+	int i, perm, r;
 
 	while (1) {
+		// Receiving blocks the whole environment, so first let the
+		// other threads get as far as they can.
+		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
+			thread_yield();
+
+		if (!rq)
+			rq = request_alloc();
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		// The thread reading from the disk has to be polled, and
+		// the one about to commit should not wait for long, so
+		// don't sleep for long in those cases.
+		if (bc_fetching() || committing) {
+			req = ipc_recv_until((int32_t *) &whom, rq->r_ipc, &perm,
+					     sys_time_nsec() + IOPOLL_NSEC);
+			if ((int32_t) req == -E_TIMEOUT) {
+				thread_yield();
+				continue;
+			}
+		} else
+			req = ipc_recv((int32_t *) &whom, rq->r_ipc, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
+				req, whom, uvpt[PGNUM(rq->r_ipc)], rq->r_ipc);
 
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
@@ -355,20 +591,24 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		rq->r_req = req;
+		rq->r_whom = whom;
+		if ((r = thread_create(0, "serve_thread", serve_thread,
+				       rq - requests)) < 0)
+			panic("cannot create serve thread: %e", r);
+		rq = NULL;
+		thread_yield(); // let the thread created run
 	}
 }
 
+static void
+tmain(uint32_t arg)
+{
+	serve_init();
+	fs_init();
+	serve();
+}
+
 void
 umain(int argc, char **argv)
 {
@@ -380,8 +620,10 @@ umain(int argc, char **argv)
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
 
-	serve_init();
-	fs_init();
-	serve();
+	// Serve requests from threads; jump into one to start
+	thread_init();
+	thread_create(0, "main", tmain, 0);
+	thread_yield();
+	// never coming here!
 }
 
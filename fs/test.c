@@ -9,9 +9,10 @@ void
 fs_test(void)
 {
 	struct File *f;
+	struct JournalHeader *jh;
 	int r;
 	char *blk;
-	uint32_t *bits;
+	uint32_t *bits, blockno;
 
 	// back up bitmap
 	if ((r = sys_page_alloc(0, (void*) PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
@@ -50,18 +51,52 @@ fs_test(void)
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
 	assert(f->f_direct[0] == 0);
+	assert(journal_pending());
+	journal_commit();
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
+	journal_commit();
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);
 	assert((uvpt[PGNUM(blk)] & PTE_D));
 	file_flush(f);
+	journal_commit();
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file rewrite is good\n");
+
+	// Commit a change to f, then put the old block back on disk and
+	// leave the header as a crash before the blocks went home would.
+	// Replaying the journal must bring the change back.
+	blk = ROUNDDOWN((char*) f, BLKSIZE);
+	blockno = ((uint32_t) blk - DISKMAP) / BLKSIZE;
+	memmove(bits, blk, BLKSIZE);
+	f->f_size = strlen(msg) + 1;
+	journal_add(f);
+	journal_commit();
+	memmove(blk, bits, BLKSIZE);
+	flush_block(blk);
+	assert(f->f_size == strlen(msg));
+	jh = diskaddr(super->s_journal);
+	jh->jh_seq = journal_committed();
+	jh->jh_nblocks = 1;
+	jh->jh_blocks[0] = blockno;
+	flush_block(jh);
+	journal_replay();
+	assert(jh->jh_nblocks == 0);
+	assert(!(uvpt[PGNUM(jh)] & PTE_D));
+	// Read the home block back from disk
+	assert(!(uvpt[PGNUM(blk)] & PTE_D));
+	if ((r = sys_page_unmap(0, blk)) < 0)
+		panic("sys_page_unmap: %e", r);
+	assert(f->f_size == strlen(msg) + 1);
+	f->f_size = strlen(msg);
+	journal_add(f);
+	journal_commit();
+	cprintf("journal_replay is good\n");
 }
@@ -0,0 +1,121 @@
+#!/usr/bin/env python
+
+# Load generator for the JOS web server, run on the host side of QEMU's
+# user networking:
+#
+#   make run-httpd-nox		(in one terminal)
+#   make bench-httpd		(in another)
+#
+# Every client thread keeps one HTTP/1.1 connection open and sends its
+# requests back to back on it.  Reports the request rate and latency
+# percentiles over the whole run.
+
+from __future__ import print_function
+
+import argparse, socket, sys, threading, time
+
+def read_response(sock, buf):
+    """Read one response from sock.  buf holds bytes received earlier.
+    Returns (status, keep_alive, leftover bytes)."""
+    while b"\r\n\r\n" not in buf:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError("connection closed in header")
+        buf += data
+    head, buf = buf.split(b"\r\n\r\n", 1)
+    lines = head.decode("latin-1").split("\r\n")
+    status = int(lines[0].split()[1])
+    length, keep_alive = 0, lines[0].startswith("HTTP/1.1")
+    for line in lines[1:]:
+        name, _, value = line.partition(":")
+        name, value = name.strip().lower(), value.strip().lower()
+        if name == "content-length":
+            length = int(value)
+        elif name == "connection":
+            keep_alive = value == "keep-alive"
+    while len(buf) < length:
+        data = sock.recv(65536)
+        if not data:
+            raise IOError("connection closed in body")
+        buf += data
+    return status, keep_alive, buf[length:]
+
+class Client(threading.Thread):
+    def __init__(self, args, deadline):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.args = args
+        self.deadline = deadline
+        self.latencies = []
+        self.errors = 0
+        self.connects = 0
+
+    def run(self):
+        a = self.args
+        req = ("GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" %
+               (a.path, a.host)).encode("latin-1")
+        sock, buf = None, b""
+        while time.time() < self.deadline:
+            try:
+                if sock is None:
+                    sock = socket.create_connection((a.host, a.port), 10)
+                    sock.settimeout(10)
+                    self.connects += 1
+                    buf = b""
+                start = time.time()
+                sock.sendall(req)
+                status, keep_alive, buf = read_response(sock, buf)
+                self.latencies.append(time.time() - start)
+                if status != 200:
+                    self.errors += 1
+                if not keep_alive:
+                    sock.close()
+                    sock = None
+            except (IOError, socket.error, ValueError, IndexError):
+                self.errors += 1
+                if sock is not None:
+                    sock.close()
+                sock = None
+                time.sleep(0.1)
+        if sock is not None:
+            sock.close()
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0
+    i = min(len(sorted_values) - 1, int(len(sorted_values) * p / 100.0))
+    return sorted_values[i]
+
+def main():
+    p = argparse.ArgumentParser(description="Load test the JOS httpd")
+    p.add_argument("host")
+    p.add_argument("port", type=int)
+    p.add_argument("path", nargs="?", default="/index.html")
+    p.add_argument("-c", "--clients", type=int, default=4,
+                   help="concurrent connections (default 4)")
+    p.add_argument("-t", "--time", type=float, default=10,
+                   help="seconds to run (default 10)")
+    args = p.parse_args()
+
+    start = time.time()
+    clients = [Client(args, start + args.time) for i in range(args.clients)]
+    for c in clients:
+        c.start()
+    for c in clients:
+        c.join()
+    elapsed = time.time() - start
+
+    lat = sorted(l for c in clients for l in c.latencies)
+    errors = sum(c.errors for c in clients)
+    connects = sum(c.connects for c in clients)
+    print("%d requests in %.1fs, %d connections, %d errors" %
+          (len(lat), elapsed, connects, errors))
+    print("%.1f requests/sec" % (len(lat) / elapsed))
+    for pc in (50, 90, 99):
+        print("p%d latency: %.2f ms" % (pc, percentile(lat, pc) * 1000))
+    if lat:
+        print("max latency: %.2f ms" % (lat[-1] * 1000))
+    return 1 if errors or not lat else 0
+
+if __name__ == "__main__":
+    sys.exit(main())
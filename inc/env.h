@@ -6,16 +6,17 @@
 #include <inc/types.h>
 #include <inc/trap.h>
 #include <inc/memlayout.h>
+#include <inc/stats.h>
 
 typedef int32_t envid_t;
 
 // An environment ID 'envid_t' has three parts:
 //
-// +1+---------------21-----------------+--------10--------+
-// |0|          Uniqueifier             |   Environment    |
-// | |                                  |      Index       |
-// +------------------------------------+------------------+
-//                                       \--- ENVX(eid) --/
+// +1+---------16----------+-----------15-----------+
+// |0|     Uniqueifier     |       Environment      |
+// | |                     |          Index         |
+// +-----------------------+------------------------+
+//                          \------ ENVX(eid) ------/
 //
 // The environment index ENVX(eid) equals the environment's offset in the
 // 'envs[]' array.  The uniqueifier distinguishes environments that were
@@ -25,10 +26,16 @@ typedef int32_t envid_t;
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
 
-#define LOG2NENV		10
+// The most environments there can be.  How many there are, the length of
+// 'envs[]', the kernel decides at boot from the memory it has.
+#define LOG2NENV		15
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// Longest name an environment can register as a service under (see
+// sys_service_register), with its terminating null
+#define SERVICE_NAMELEN		16
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -48,6 +55,8 @@ enum EnvType {
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
+	struct Env *env_next;		// Ring of allocated Envs, which
+	struct Env *env_prev;		// the scheduler goes around
 	envid_t env_id;			// Unique environment identifier
 	envid_t env_parent_id;		// env_id of this env's parent
 	enum EnvType env_type;		// Indicates special system environments
@@ -55,18 +64,28 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Sleeping (see sys_sleep_until)
+	uint64_t env_sleep_until;	// Wakeup time in ns, 0 if not asleep
+	struct Env *env_sleep_link;	// Next env in the CPU's sleep queue
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	bool env_kern_cow;		// Kernel resolves PTE_COW write faults
+	uintptr_t env_uxstacktop;	// Top of the user exception stack
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
+	envid_t env_ipc_recv_from;	// Only accept sends from it, if nonzero
 	void *env_ipc_dstva;		// VA at which to map received page
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+
+	// Statistics (see inc/stats.h)
+	struct EnvStats env_stats;
 };
 
 #endif // !JOS_INC_ENV_H
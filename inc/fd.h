@@ -21,6 +21,22 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	// Returns the POLL* events that wouldn't block right now.
+	// Devices without it are always ready.
+	int (*dev_poll)(struct Fd *fd, int events);
+};
+
+// Events for poll()
+#define POLLIN		0x001		// There is data to read
+#define POLLOUT		0x004		// Writing won't block
+#define POLLERR		0x008		// Error condition (revents only)
+#define POLLHUP		0x010		// Other end closed (revents only)
+#define POLLNVAL	0x020		// Invalid fd (revents only)
+
+struct pollfd {
+	int fd;			// File descriptor to watch, ignored if < 0
+	short events;		// Events we are interested in
+	short revents;		// Events that happened
 };
 
 struct FdFile {
@@ -29,6 +45,11 @@ struct FdFile {
 
 struct FdSock {
 	int sockid;
+	bool ring;		// Data goes through the socket's shared ring
+};
+
+struct FdCons {
+	int cons_peek;		// Character read ahead by poll, plus 1
 };
 
 struct Fd {
@@ -40,6 +61,8 @@ struct Fd {
 		struct FdFile fd_file;
 		// Network sockets
 		struct FdSock fd_sock;
+		// Console
+		struct FdCons fd_cons;
 	};
 };
 
@@ -57,6 +57,23 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_journal;		// First block of the journal
+	uint32_t s_njournal;		// Number of blocks in the journal
+};
+
+// Metadata journal.  fsformat reserves JOURNALSIZE blocks after the
+// bitmap: a header block, followed by the log, which holds the new
+// contents of the blocks of one transaction.  A transaction has
+// committed once its header has been written with jh_nblocks != 0.
+
+#define JOURNALSIZE	32
+#define JOURNAL_MAGIC	0x4A4C4F47	// 'JLOG'
+
+struct JournalHeader {
+	uint32_t jh_magic;		// Magic number: JOURNAL_MAGIC
+	uint32_t jh_seq;		// Number of the last transaction
+	uint32_t jh_nblocks;		// Blocks in the log, 0 if none
+	uint32_t jh_blocks[JOURNALSIZE - 1];	// Where each block goes
 };
 
 // Definitions for requests from clients to file system
@@ -70,7 +87,9 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map returns the block cache page holding req_offset, read-only
+	FSREQ_MAP
 };
 
 union Fsipc {
@@ -108,6 +127,10 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
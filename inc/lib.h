@@ -22,6 +22,7 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/trace.h>
 
 #define USED(x)		(void)(x)
 
@@ -30,15 +31,17 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+extern const volatile struct Env *thisenv_main;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
+extern const volatile struct KernStats kstats;
 
 // exit.c
 void	exit(void);
 
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
+int	add_pgfault_hook(int (*hook)(struct UTrapframe *utf));
 
 // readline.c
 char*	readline(const char *buf);
@@ -53,15 +56,26 @@ static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_kern_cow(envid_t env, bool enable);
+envid_t	sys_sfork(void *eip, void *esp, void *uxstacktop);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
+int	sys_page_alloc_range(envid_t env, void *pg, size_t len, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_until(void *rcv_pg, uint64_t deadline);
+int	sys_ipc_recv_from(void *rcv_pg, envid_t from);
 unsigned int sys_time_msec(void);
-int     sys_transmit_packet(void *buf, size_t size);
-int     sys_receive_packet(void *buf, size_t *size_store);
+uint64_t sys_time_nsec(void);
+int	sys_sleep_until(uint64_t deadline);
+int	sys_trace(uint32_t mask, int drain);
+int	sys_service_register(const char *name);
+envid_t	sys_service_lookup(const char *name);
+int     sys_transmit_packet(void *buf, size_t size, struct nic_csum *csum);
+int     sys_receive_packet(void *buf, size_t *size_store,
+			   struct nic_csum *csum_store);
 int     sys_get_mac_address(void *buf);
 
 // This must be inlined.  Exercise for reader: why?
@@ -80,12 +94,41 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
-envid_t	ipc_find_env(enum EnvType type);
+int32_t ipc_recv_until(envid_t *from_env_store, void *pg, int *perm_store,
+		       uint64_t deadline);
+envid_t	ipc_lookup(const char *name);
 
 // fork.c
 #define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	sfork(void (*fn)(void *), void *arg);
+
+// Threads created by sfork run on stacks carved out of this region, one
+// slot of THREADSLOT bytes per thread.  From the bottom of a slot up:
+// a guard page, the thread's stack, its exception stack and a page
+// holding its struct ThreadData.
+#define UTHREADS	0xE0000000
+#define THREADSLOT	(16 * PGSIZE)
+#define NTHREADS	1024
+
+struct ThreadData {
+	const volatile struct Env *td_env;	// thisenv of the thread
+};
+
+// All threads share the global variables, so 'thisenv' is found through
+// the stack pointer: threads keep theirs in their slot's ThreadData.
+static __inline const volatile struct Env ** __attribute__((always_inline))
+thisenv_slot(void)
+{
+	uintptr_t esp;
+
+	__asm __volatile("movl %%esp,%0" : "=r" (esp));
+	if (esp >= UTHREADS && esp < UTHREADS + NTHREADS * THREADSLOT)
+		return &((struct ThreadData *) (ROUNDDOWN(esp, THREADSLOT)
+			+ THREADSLOT - PGSIZE))->td_env;
+	return &thisenv_main;
+}
+#define thisenv		(*thisenv_slot())
 
 // fd.c
 int	close(int fd);
@@ -97,13 +140,54 @@ ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
+int	poll(struct pollfd *fds, int nfds, int timeout);
+
+// stdio.c
+typedef struct Stream FILE;
+extern FILE *stdin, *stdout, *stderr;
+
+#define EOF		(-1)
+#define BUFSIZ		PGSIZE	/* default stream buffer size */
+
+#define _IOFBF		0	/* fully buffered */
+#define _IOLBF		1	/* line buffered */
+#define _IONBF		2	/* unbuffered */
+
+FILE *	fopen(const char *path, const char *mode);
+FILE *	fdopen(int fd, const char *mode);
+int	setvbuf(FILE *f, char *buf, int mode, size_t size);
+int	fflush(FILE *f);
+int	fclose(FILE *f);
+int	feof(FILE *f);
+int	ferror(FILE *f);
+size_t	fread(void *buf, size_t size, size_t n, FILE *f);
+size_t	fwrite(const void *buf, size_t size, size_t n, FILE *f);
+int	fgetc(FILE *f);
+int	fputc(int c, FILE *f);
+char *	fgets(char *s, int size, FILE *f);
+int	fputs(const char *s, FILE *f);
+int	sfprintf(FILE *f, const char *fmt, ...);
+int	vsfprintf(FILE *f, const char *fmt, va_list ap);
 
 // file.c
 int	open(const char *path, int mode);
+int	fmapblock(int fdnum, off_t offset, void *dstva);
+int	fsync(int fdnum);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
 
+// mmap.c
+#define PROT_READ	0x1		/* pages can be read */
+#define PROT_WRITE	0x2		/* pages can be written */
+
+#define MAP_SHARED	0x1		/* writes go back to the file */
+#define MAP_PRIVATE	0x2		/* writes stay private */
+
+void *	mmap(int fd, off_t offset, size_t len, int prot, int flags);
+int	msync(void *addr, size_t len);
+int	munmap(void *addr, size_t len);
+
 // pageref.c
 int	pageref(void *addr);
 
@@ -114,8 +198,11 @@ int     shutdown(int s, int how);
 int     connect(int s, const struct sockaddr *name, socklen_t namelen);
 int     listen(int s, int backlog);
 int     socket(int domain, int type, int protocol);
+int     socket_poll_wait(struct pollfd *fds, int nfds, int timeout);
+ssize_t sendfile(int sockfd, int filefd, off_t offset, size_t count);
 
 // nsipc.c
+envid_t nsipc_env(void);
 int     nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
 int     nsipc_bind(int s, struct sockaddr *name, socklen_t namelen);
 int     nsipc_shutdown(int s, int how);
@@ -125,11 +212,24 @@ int     nsipc_listen(int s, int backlog);
 int     nsipc_recv(int s, void *mem, int len, unsigned int flags);
 int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
 int     nsipc_socket(int domain, int type, int protocol);
+const volatile struct Nsready *nsipc_ready(void);
+int     nsipc_poll(struct pollfd *fds, int nfds, int timeout);
+int     nsipc_ring(int s);
+void    nsipc_kick(int s);
+int     nsipc_sendpage(int s, const void *pg, int len);
 
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
 envid_t	spawnl(const char *program, const char *arg0, ...);
 
+// pager.c
+#define PAGERVA		0x00700000	// the pager's pages, in a spawned child
+#define PAGER_NPAGES	4
+struct Elf;
+int	pager_setup(envid_t child, int fdnum, struct Elf *elf);
+int32_t	fsipc_call(envid_t fsenv, unsigned type, void *req, void *dstva,
+		   const volatile struct Env *self);
+
 // console.c
 void	cputchar(int c);
 int	getchar(void);
@@ -143,6 +243,10 @@ int	pipeisclosed(int pipefd);
 // wait.c
 void	wait(envid_t env);
 
+// bench.c
+void	bench_report(const char *name, uint64_t value, const char *unit);
+uint32_t bench_median(uint32_t *samples, int n);
+
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
 #define	O_WRONLY	0x0001		/* open for writing only */
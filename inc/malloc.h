@@ -3,5 +3,6 @@
 
 void *malloc(size_t size);
 void free(void *addr);
+void *realloc(void *addr, size_t size);
 
 #endif
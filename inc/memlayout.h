@@ -48,9 +48,11 @@
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
- *                     |          RO PAGES            | R-/R-  PTSIZE
- *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |          RO PAGES            | R-/R-  PTSIZE/4
+ *    UPAGES    ---->  +------------------------------+ 0xef300000
+ *                     |           RO STATS           | R-/R-  PTSIZE/4
+ *    USTATS    ---->  +------------------------------+ 0xef200000
+ *                     |           RO ENVS            | R-/R-  3*PTSIZE/2
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -110,10 +112,13 @@
 
 // User read-only virtual page table (see 'uvpt' below)
 #define UVPT		(ULIM - PTSIZE)
-// Read-only copies of the Page structures
-#define UPAGES		(UVPT - PTSIZE)
-// Read-only copies of the global env structures
-#define UENVS		(UPAGES - PTSIZE)
+// Read-only copies of the Page structures (enough for the 256MB of
+// physical memory the kernel can map)
+#define UPAGES		(UVPT - PTSIZE / 4)
+// Read-only kernel statistics
+#define USTATS		(UPAGES - PTSIZE / 4)
+// Read-only copies of the global env structures, up to USTATS
+#define UENVS		(UVPT - 2 * PTSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -185,6 +190,14 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	union {
+		// For a page directory, the index in envs[] of the
+		// environment whose address space it is (see pgdir_count).
+		uint16_t pp_env;
+		// For a kmalloc slab, the size class of its objects.
+		uint16_t pp_slab;
+	};
 };
 
 #endif /* !__ASSEMBLER__ */
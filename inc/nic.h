@@ -0,0 +1,21 @@
+#ifndef JOS_INC_NIC_H
+#define JOS_INC_NIC_H
+
+#include <inc/types.h>
+
+// Checksum offload information that travels with a packet between the
+// network server and the NIC driver.  On transmit, nc_flags asks the NIC
+// to fill in checksums at the offsets given, which jif sets up; on
+// receive, it says which checksums the NIC already found to be good.
+struct nic_csum {
+	uint8_t nc_flags;	// NIC_CSUM_*
+	uint8_t nc_ipstart;	// Offset of the IP header in the packet
+	uint8_t nc_l4start;	// Offset of the TCP/UDP header (end of IP header)
+	uint8_t nc_l4sum;	// Offset of the TCP/UDP checksum field
+};
+
+#define NIC_CSUM_IP	0x01	// IP header checksum
+#define NIC_CSUM_L4	0x02	// TCP or UDP checksum
+#define NIC_CSUM_TCP	0x04	// The L4 protocol is TCP, not UDP (transmit)
+
+#endif	// !JOS_INC_NIC_H
@@ -5,10 +5,13 @@
 
 #include <inc/types.h>
 #include <inc/mmu.h>
+#include <inc/env.h>
+#include <inc/nic.h>
 #include <lwip/sockets.h>
 
 struct jif_pkt {
 	int jp_len;
+	struct nic_csum jp_csum;	// Checksum offload, see inc/nic.h
 	char jp_data[0];
 };
 
@@ -26,6 +29,15 @@ enum {
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
+	// Ready maps the server's Nsready page, read-only, at NSREADYVA.
+	NSREQ_READY,
+	// Poll returns once one of the sockets is ready, or on timeout.
+	NSREQ_POLL,
+	// Ring replies with one page of the socket's shared ring (see below).
+	NSREQ_RING,
+	// Sendpage passes the data to send itself; the socket and the
+	// length are in the IPC value, see NSSENDPAGE.
+	NSREQ_SENDPAGE,
 
 	// The following two messages pass a page containing a struct jif_pkt
 	NSREQ_INPUT,
@@ -33,10 +45,21 @@ enum {
 	// network server, to the output environment
 	NSREQ_OUTPUT,
 
-	// The following message passes no page
+	// The following messages pass no page
 	NSREQ_TIMER,
+	// Kick tells the server to look at the ring of a socket again.
+	// The socket id is in the IPC value, see NSKICK.
+	NSREQ_KICK,
 };
 
+// Some requests carry their arguments in the IPC value: the request
+// code in the low byte, then a socket id, then a length.
+#define NSREQ_TYPE(v)		((v) & 0xff)
+#define NSREQ_SOCK(v)		(((v) >> 8) & 0xff)
+#define NSREQ_LEN(v)		((uint32_t) (v) >> 16)
+#define NSKICK(s)		(NSREQ_KICK | ((s) << 8))
+#define NSSENDPAGE(s, len)	(NSREQ_SENDPAGE | ((s) << 8) | ((len) << 16))
+
 union Nsipc {
 	struct Nsreq_accept {
 		int req_s;
@@ -97,10 +120,92 @@ union Nsipc {
 		int req_protocol;
 	} socket;
 
+	struct Nsreq_poll {
+		int req_nfds;
+		int req_timeout;	// in ms, < 0 to wait forever
+		struct Nspollfd {
+			int s;
+			int events;
+		} req_fds[0];
+	} poll;
+
+	struct Nsreq_ring {
+		int req_s;
+		int req_page;
+	} ring;
+
 	struct jif_pkt pkt;
 
 	// Ensure Nsipc is one page
 	char _pad[PGSIZE];
 };
 
+// Maximum number of sockets in a poll request
+#define NSPOLL_MAX	((PGSIZE - sizeof(struct Nsreq_poll)) / sizeof(struct Nspollfd))
+
+// The network server pushes the readiness of every socket into this
+// page, which clients map read-only at NSREADYVA.  This lets poll() find
+// ready sockets without an IPC round trip.
+#define NSREADYVA	0xE4000000
+#define NSREADY_MAX	(PGSIZE - sizeof(uint32_t))
+
+struct Nsready {
+	uint32_t nr_gen;		// Bumped on every change
+	uint8_t nr_state[NSREADY_MAX];	// POLL* events of each socket
+};
+
+// Connected TCP sockets can also be driven through a ring shared by the
+// client and the network server, so that a busy socket sends and
+// receives without any IPC.  Both sides map the ring of socket s at
+// NSRING(s).
+//
+// Each direction is a byte ring with a single producer and a single
+// consumer.  A side that finds its ring empty (or full) says so in the
+// ring before going to sleep, and the other side wakes it up once it
+// made progress: the server by sending an IPC to the waiting client, the
+// client by sending NSREQ_KICK to the server.  The server reports what
+// became of the data it drained, and the end of the received stream, in
+// the completion queue.
+#define NSRINGVA	0xE4400000
+#define NSRING_MAX	32		// Only sockets below this get a ring
+#define NSRING_NPAGES	5
+#define NSRING_DATA	(2 * PGSIZE)	// Bytes in each direction
+#define NSRING(s)	((struct Nsring *) (NSRINGVA + (s) * NSRING_NPAGES * PGSIZE))
+#define NSCQ_SIZE	64
+#define NSRING_WAKEUP	0x7fffffff	// IPC value of a wakeup, never a reply
+
+struct Nsring_buf {
+	volatile uint32_t nb_head;	// Bytes produced so far
+	volatile uint32_t nb_tail;	// Bytes consumed so far
+	volatile envid_t nb_waiter;	// Client env sleeping on this ring
+	volatile uint32_t nb_idle;	// Server is sleeping on this ring
+};
+
+// Completion codes
+enum {
+	NSOP_SEND = 1,		// res: bytes handed to TCP, or < 0 on error
+	NSOP_RECV,		// res: 0 at the end of the stream, or < 0
+};
+
+struct Nscqe {
+	int cq_op;
+	int cq_res;
+};
+
+struct Nsring {
+	struct Nsring_buf nr_tx;	// Data to send, produced by the client
+	struct Nsring_buf nr_rx;	// Data received, produced by the server
+	volatile uint32_t nr_cq_head;	// Completions posted by the server
+	volatile uint32_t nr_cq_tail;	// Completions reaped by the client
+	struct Nscqe nr_cq[NSCQ_SIZE];
+
+	// Client state, updated from the completions it reaped
+	volatile int nr_txerr;		// First send error
+	volatile int nr_rxdone;		// The received stream ended...
+	volatile int nr_rxerr;		// ...with this error, or 0 at EOF
+
+	uint8_t nr_txbuf[NSRING_DATA] __attribute__((aligned(PGSIZE)));
+	uint8_t nr_rxbuf[NSRING_DATA];
+};
+
 #endif // !JOS_INC_NS_H
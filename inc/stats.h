@@ -0,0 +1,43 @@
+#ifndef JOS_INC_STATS_H
+#define JOS_INC_STATS_H
+
+#include <inc/types.h>
+#include <inc/syscall.h>
+
+// Statistics the kernel keeps for user programs to read (see user/top).
+// Each environment's are in its struct Env, readable through 'envs', and
+// the kernel-wide ones are mapped read-only at USTATS, as 'kstats'.
+
+// Statistics of one environment
+struct EnvStats {
+	uint64_t es_cycles;		// TSC cycles run, in user mode or in
+					// its system calls and page faults
+	uint32_t es_syscalls[NSYSCALLS];// System calls made, by number
+	uint32_t es_ipc_sent;		// IPC values sent
+	uint32_t es_ipc_recvd;		// IPC values received
+	uint32_t es_ipc_not_recv;	// Sends that got -E_IPC_NOT_RECV
+	uint32_t es_pgfaults;		// Page faults
+	uint32_t es_pages;		// Pages mapped in its address space
+};
+
+// Histogram of times in TSC cycles: bucket i counts the ones from 2^i
+// up to 2^(i+1) cycles, and the last bucket everything longer.
+#define NHISTBUCKETS	32
+
+struct Histogram {
+	uint32_t h_count;
+	uint64_t h_cycles;		// All of them added up
+	uint32_t h_buckets[NHISTBUCKETS];
+};
+
+// Kernel-wide statistics.  System calls that block (like sys_yield or
+// sys_ipc_recv) are counted by the environment, but not timed here.
+struct KernStats {
+	uint64_t ks_tsc_hz;		// TSC ticks per second
+	uint32_t ks_nenv;		// Environments in 'envs'
+	uint32_t ks_sysenter;		// System calls can use SYSENTER
+	struct Histogram ks_syscalls[NSYSCALLS];	// Time in the kernel
+	struct Histogram ks_pgfaults;	// Time the kernel takes for a page fault
+};
+
+#endif /* !JOS_INC_STATS_H */
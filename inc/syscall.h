@@ -21,6 +21,16 @@ enum {
 	SYS_transmit_packet,
 	SYS_receive_packet,
 	SYS_get_mac_address,
+	SYS_page_alloc_range,
+	SYS_env_set_kern_cow,
+	SYS_sfork,
+	SYS_time_nsec,
+	SYS_sleep_until,
+	SYS_ipc_recv_until,
+	SYS_ipc_recv_from,
+	SYS_trace,
+	SYS_service_register,
+	SYS_service_lookup,
 	NSYSCALLS
 };
 
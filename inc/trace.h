@@ -0,0 +1,41 @@
+#ifndef JOS_INC_TRACE_H
+#define JOS_INC_TRACE_H
+
+#include <inc/types.h>
+
+// Kernel event tracing.  Each CPU records the events of the categories
+// turned on (with sys_trace, or 'trace' in the kernel monitor) in a ring
+// of fixed-size records, which is written out over the serial port on
+// request.  trace2json.py turns that into a Chrome trace timeline.
+
+// Categories
+#define TRACE_SCHED	0x01	// Environment switches
+#define TRACE_IPC	0x02	// IPC sends and receives
+#define TRACE_SYSCALL	0x04	// System call entry and exit
+#define TRACE_PGFAULT	0x08	// Page faults
+#define TRACE_IRQ	0x10	// Interrupts
+#define TRACE_ALL	0x1f
+
+// Events, with what their arguments are
+enum {
+	TR_ENV_RUN = 1,		// env starts running on the CPU
+	TR_IDLE,		// the CPU has nothing to run
+	TR_SYSCALL,		// system call number, first argument
+	TR_SYSCALL_RET,		// system call number, return value
+	TR_IPC_SEND,		// envid sent to, 0 or -E_IPC_NOT_RECV
+	TR_IPC_RECV,		// envid accepted from (0 for anyone)
+	TR_PGFAULT,		// faulting address, eip
+	TR_PGFAULT_DONE,	// faulting address
+	TR_IRQ,			// IRQ number, interrupted eip
+};
+
+struct TraceRec {
+	uint64_t tr_tsc;	// When, in TSC ticks
+	uint8_t tr_type;	// TR_*
+	uint8_t tr_cpu;
+	uint16_t tr_pad;
+	int32_t tr_env;		// Current environment, 0 if none
+	uint32_t tr_arg[2];
+};
+
+#endif /* !JOS_INC_TRACE_H */
@@ -11,6 +11,7 @@
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
+static void cons_output(int c);
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -22,6 +23,27 @@ delay(void)
 	inb(0x84);
 }
 
+/***** Console output ring *****/
+// Characters for the serial and parallel ports go into a ring, and are
+// sent from there as fast as the ports take them, instead of cputchar
+// waiting on the port for each one (with the big kernel lock held, in
+// sys_cputs).  When the serial port is busy, its transmitter interrupt
+// sends the rest.  That interrupt can't come while the kernel itself
+// prints (interrupts are off in the kernel), so a full ring is flushed
+// by polling then.  Only user output (sys_cputs) that doesn't fit is
+// dropped and counted instead.
+
+#define CONSOUTSIZE	4096	// Must be a power of 2
+
+static struct {
+	uint8_t buf[CONSOUTSIZE];
+	uint32_t wpos;		// Positions only count up, and are
+	uint32_t serial_rpos;	// taken mod CONSOUTSIZE to index buf
+	uint32_t lpt_rpos;
+	uint32_t dropped;	// Characters the ring had no room for
+	bool user;		// Printing for sys_cputs
+} cons_out;
+
 /***** Serial I/O code *****/
 
 #define COM1		0x3F8
@@ -32,8 +54,12 @@ delay(void)
 #define COM_DLM		1	// Out: Divisor Latch High (DLAB=1)
 #define COM_IER		1	// Out: Interrupt Enable Register
 #define   COM_IER_RDI	0x01	//   Enable receiver data interrupt
+#define   COM_IER_TXI	0x02	//   Enable transmitter empty interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
+#define   COM_IIR_FIFO	0xC0	//   FIFOs enabled
 #define COM_FCR		2	// Out: FIFO Control Register
+#define   COM_FCR_FIFO	0x01	//   Enable FIFOs
+#define   COM_FCR_CLEAR	0x06	//   Clear both FIFOs
 #define COM_LCR		3	// Out: Line Control Register
 #define	  COM_LCR_DLAB	0x80	//   Divisor latch access bit
 #define	  COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
@@ -46,7 +72,11 @@ delay(void)
 #define   COM_LSR_TXRDY	0x20	//   Transmit buffer avail
 #define   COM_LSR_TSRE	0x40	//   Transmitter off
 
+#define COM_FIFOSIZE	16	// Bytes a 16550's transmit FIFO holds
+
 static bool serial_exists;
+static bool serial_fifo;	// Transmit COM_FIFOSIZE bytes at a time
+static bool serial_txi;		// Waiting for the transmitter interrupt
 
 static int
 serial_proc_data(void)
@@ -56,11 +86,45 @@ serial_proc_data(void)
 	return inb(COM1+COM_RX);
 }
 
+// Send the serial port as much of cons_out as it has room for.  If
+// that isn't all of it, turn the transmitter interrupt on to send more
+// when the port is ready for it; turn it off when everything is sent.
+static void
+serial_start(void)
+{
+	int n;
+
+	if (!serial_exists) {
+		cons_out.serial_rpos = cons_out.wpos;
+		return;
+	}
+	while (cons_out.serial_rpos != cons_out.wpos) {
+		if (!(inb(COM1+COM_LSR) & COM_LSR_TXRDY)) {
+			if (!serial_txi) {
+				serial_txi = 1;
+				outb(COM1+COM_IER, COM_IER_RDI | COM_IER_TXI);
+			}
+			return;
+		}
+		// TXRDY means the whole FIFO is empty
+		for (n = serial_fifo ? COM_FIFOSIZE : 1;
+		     n > 0 && cons_out.serial_rpos != cons_out.wpos; n--)
+			outb(COM1+COM_TX, cons_out.buf[cons_out.serial_rpos++
+						       % CONSOUTSIZE]);
+	}
+	if (serial_txi) {
+		serial_txi = 0;
+		outb(COM1+COM_IER, COM_IER_RDI);
+	}
+}
+
 void
 serial_intr(void)
 {
-	if (serial_exists)
+	if (serial_exists) {
 		cons_intr(serial_proc_data);
+		serial_start();
+	}
 }
 
 static void
@@ -76,11 +140,26 @@ serial_putc(int c)
 	outb(COM1 + COM_TX, c);
 }
 
+// Write 'n' bytes to the serial port only, for output meant for the
+// host rather than for people (see trace_drain).  This waits for the
+// port, after whatever is still in cons_out.
+void
+serial_write(const char *s, size_t n)
+{
+	if (!serial_exists)
+		return;
+	cons_flush();
+	while (n-- > 0)
+		serial_putc(*s++);
+}
+
 static void
 serial_init(void)
 {
-	// Turn off the FIFO
-	outb(COM1+COM_FCR, 0);
+	// Turn on the FIFOs, if it's a 16550, so that one transmitter
+	// interrupt can send COM_FIFOSIZE bytes.  Receive interrupts still
+	// come for every byte.
+	outb(COM1+COM_FCR, COM_FCR_FIFO | COM_FCR_CLEAR);
 
 	// Set speed; requires DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_DLAB);
@@ -98,7 +177,8 @@ serial_init(void)
 	// Clear any preexisting overrun indications and interrupts
 	// Serial port doesn't exist if COM_LSR returns 0xFF
 	serial_exists = (inb(COM1+COM_LSR) != 0xFF);
-	(void) inb(COM1+COM_IIR);
+	serial_fifo = serial_exists &&
+		(inb(COM1+COM_IIR) & COM_IIR_FIFO) == COM_IIR_FIFO;
 	(void) inb(COM1+COM_RX);
 
 	// Enable serial interrupts
@@ -112,16 +192,16 @@ serial_init(void)
 // For information on PC parallel port programming, see the class References
 // page.
 
+// Send the parallel port as much of cons_out as it is ready for.  We
+// don't use its interrupt, so the rest waits for the next call.
 static void
-lpt_putc(int c)
+lpt_start(void)
 {
-	int i;
-
-	for (i = 0; !(inb(0x378+1) & 0x80) && i < 12800; i++)
-		delay();
-	outb(0x378+0, c);
-	outb(0x378+2, 0x08|0x04|0x01);
-	outb(0x378+2, 0x08);
+	while (cons_out.lpt_rpos != cons_out.wpos && (inb(0x378+1) & 0x80)) {
+		outb(0x378+0, cons_out.buf[cons_out.lpt_rpos++ % CONSOUTSIZE]);
+		outb(0x378+2, 0x08|0x04|0x01);
+		outb(0x378+2, 0x08);
+	}
 }
 
 
@@ -184,11 +264,11 @@ cga_putc(int c)
 		crt_pos -= (crt_pos % CRT_COLS);
 		break;
 	case '\t':
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
+		cons_output(' ');
+		cons_output(' ');
+		cons_output(' ');
+		cons_output(' ');
+		cons_output(' ');
 		break;
 	default:
 		crt_buf[crt_pos++] = c;		/* write the character */
@@ -431,13 +511,99 @@ cons_getc(void)
 	return 0;
 }
 
+// The last CONSLOGSIZE characters of console output, for dmesg
+#define CONSLOGSIZE	16384	// Must be a power of 2
+
+static struct {
+	uint8_t buf[CONSLOGSIZE];
+	uint32_t wpos;
+} cons_log;
+
+// put a character in cons_out and show it on the display
+static void
+cons_output(int c)
+{
+	// The kernel's own output waits for room rather than being dropped
+	if (cons_out.wpos - cons_out.serial_rpos == CONSOUTSIZE
+	    && !cons_out.user)
+		cons_flush();
+	if (cons_out.wpos - cons_out.serial_rpos == CONSOUTSIZE)
+		cons_out.dropped++;
+	else {
+		// The parallel port gets what it can, but doesn't hold
+		// up the serial port
+		if (cons_out.wpos - cons_out.lpt_rpos == CONSOUTSIZE)
+			cons_out.lpt_rpos++;
+		cons_out.buf[cons_out.wpos++ % CONSOUTSIZE] = c;
+		// Leave it to the interrupt if the port is busy
+		if (!serial_txi)
+			serial_start();
+		lpt_start();
+	}
+	cga_putc(c);
+}
+
 // output a character to the console
 static void
 cons_putc(int c)
 {
-	serial_putc(c);
-	lpt_putc(c);
-	cga_putc(c);
+	cons_log.buf[cons_log.wpos++ % CONSLOGSIZE] = c;
+	cons_output(c);
+}
+
+// Wait until the serial and parallel ports have taken all of cons_out,
+// for when interrupts won't come to send it (see _panic and
+// cons_output).  Gives up if they take nothing for as long as a
+// character ever took.
+void
+cons_flush(void)
+{
+	uint32_t serial_rpos, lpt_rpos;
+	int i = 0;
+
+	while ((cons_out.serial_rpos != cons_out.wpos ||
+		cons_out.lpt_rpos != cons_out.wpos) && i < 12800) {
+		serial_rpos = cons_out.serial_rpos;
+		lpt_rpos = cons_out.lpt_rpos;
+		serial_start();
+		lpt_start();
+		if (cons_out.serial_rpos == serial_rpos &&
+		    cons_out.lpt_rpos == lpt_rpos) {
+			delay();
+			i++;
+		} else
+			i = 0;
+	}
+}
+
+// Show the console output in cons_log again.  It isn't logged a
+// second time.
+void
+cons_dmesg(void)
+{
+	uint32_t i;
+
+	i = cons_log.wpos - MIN(cons_log.wpos, CONSLOGSIZE);
+	for (; i != cons_log.wpos; i++)
+		cons_output(cons_log.buf[i % CONSLOGSIZE]);
+}
+
+// Print 'len' characters of user output, for sys_cputs.  What doesn't
+// fit in cons_out is dropped, rather than holding up the kernel until
+// the serial port takes it.
+void
+cons_user_write(const char *s, size_t len)
+{
+	cons_out.user = 1;
+	cprintf("%.*s", len, s);
+	cons_out.user = 0;
+}
+
+// Returns how many characters of output the console had to drop.
+uint32_t
+cons_dropped(void)
+{
+	return cons_out.dropped;
 }
 
 // initialize the console devices
@@ -19,8 +19,13 @@
 
 void cons_init(void);
 int cons_getc(void);
+void cons_flush(void);
+void cons_dmesg(void);
+void cons_user_write(const char *s, size_t len);
+uint32_t cons_dropped(void);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
+void serial_write(const char *s, size_t n);
 
 #endif /* _CONSOLE_H_ */
@@ -23,6 +23,16 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	volatile bool cpu_in_user;      // Running cpu_env in user mode
+	volatile bool cpu_tlb_pending;  // TLB must be flushed before using cpu_pgdir's mappings
+	pde_t *cpu_pgdir;               // Page directory in cr3, if known (see pgdir_switch)
+	bool cpu_pgdir_freed;           // cpu_pgdir's environments are gone
+	struct Env *cpu_sleepq;         // Sleeping envs, earliest deadline first
+	uint64_t cpu_slice_end;         // End of cpu_env's time slice, 0 if none
+	uint64_t cpu_timer_armed;       // Deadline the LAPIC timer is set for
+	uint64_t cpu_prof_next;         // Time of the next profiler sample
+	uint64_t cpu_user_start;        // TSC when cpu_env last entered user mode
+	bool cpu_sysenter_tf;           // cpu_env came in by SYSENTER with TF set
 };
 
 // Initialized in mpconfig.c
@@ -42,5 +52,9 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_timer_calibrate(uint64_t tsc_hz);
+void lapic_timer_oneshot(uint64_t nsec);
+void lapic_timer_stop(void);
 
 #endif
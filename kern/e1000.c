@@ -4,6 +4,7 @@
 
 #include <kern/e1000.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 
 volatile uint32_t *e1000; // Pointer to the start of E1000's MMIO region
 uint8_t mac_address[6]; // Mac address, 6 bytes
@@ -12,9 +13,9 @@ char *tx_buffers[NUM_TX_DESC];
 struct rx_desc *rx_ring;
 char *rx_buffers[NUM_RX_DESC];
 
-/* Auxiliary Funcions */
-static int e1000_page_alloc(char **va_store, int perm);
-static physaddr_t va2pa(void *va);
+// Checksum offload settings last loaded with a context descriptor
+static struct nic_csum tx_context;
+static bool tx_context_valid;
 
 /* Testing Functions */
 static void check_mmio(int check);
@@ -32,19 +33,19 @@ init_transmission(void)
 	cprintf("E1000 initializing transmission\n");
 
 	/* Data structures setup */
-	// Allocate memory for descriptor ring
-	char *va;
-	int r;
-	if((r = e1000_page_alloc(&va, PTE_P | PTE_W)) < 0)
-		panic("e1000_page_alloc: %e", r);
-	tx_ring = (struct tx_desc *) va;
+	// Allocate memory for descriptor ring.  kmalloc'd memory is in the
+	// kernel's direct map, so PADDR gives the address the E1000 uses,
+	// and it is aligned to its size, so the ring is 16-byte aligned
+	// and no buffer crosses a page.
+	tx_ring = kmalloc(TX_RING_SIZE, ALLOC_ZERO);
+	if (!tx_ring)
+		panic("init_transmission: out of memory for the ring");
 
 	// Allocate memory for the buffers
 	int i;
 	for (i = 0; i < NUM_TX_DESC; i++) {
-		if((r = e1000_page_alloc(&va, PTE_P | PTE_W)) < 0)
-			panic("e1000_page_alloc: %e", r);
-		tx_buffers[i] = va;
+		if (!(tx_buffers[i] = kmalloc(E1000_BUFSIZE, ALLOC_ZERO)))
+			panic("init_transmission: out of memory for the buffers");
 	}
 
 	// Test mappings
@@ -64,11 +65,11 @@ init_transmission(void)
 	// TDBAH & TDBAL (Transmit Descriptor Ring address)
 	// Always store physical address, not the virtual address!
 	// E1000_REG(E1000_TDBAH) = 0;
-	E1000_REG(E1000_TDBAL) = va2pa(tx_ring);
+	E1000_REG(E1000_TDBAL) = PADDR(tx_ring);
 
 	// TDLEN (Transmit Descriptor Ring length in bytes)
 	// Length is NUM_TX_DESC * sizeof(struct tx_desc), which is NUM_TX_DESC * 16
-	E1000_REG(E1000_TDLEN) = NUM_TX_DESC * sizeof(struct tx_desc);
+	E1000_REG(E1000_TDLEN) = TX_RING_SIZE;
 
 	// TDH & TDT (Transmit Decriptor Ring Head and Tail)
 	E1000_REG(E1000_TDH) = 0;
@@ -91,9 +92,37 @@ init_transmission(void)
 	E1000_REG(E1000_TIPG) += ( 6 << 20); // TIPG.IPGR2 = 6, bits 20-29
 }
 
-// Transmit packet
+// Load the checksum offload settings in 'csum' with a context
+// descriptor in tx_ring[i]
+static void
+load_tx_context(uint32_t i, struct nic_csum *csum)
+{
+	struct tx_context_desc *ctx = (struct tx_context_desc *) &tx_ring[i];
+	uint8_t tucmd = E1000_TXC_TUCMD_DEXT | E1000_TXC_TUCMD_IP
+			| E1000_TXC_TUCMD_RS;
+
+	if (csum->nc_flags & NIC_CSUM_TCP)
+		tucmd |= E1000_TXC_TUCMD_TCP;
+
+	memset(ctx, 0, sizeof(*ctx));
+	// The IP checksum is at offset 10 of the IP header
+	ctx->ipcss = csum->nc_ipstart;
+	ctx->ipcso = csum->nc_ipstart + 10;
+	ctx->ipcse = csum->nc_l4start - 1;
+	// The TCP/UDP checksum covers everything up to the end of the packet
+	ctx->tucss = csum->nc_l4start;
+	ctx->tucso = csum->nc_l4sum;
+	ctx->tucse = 0;
+	ctx->paylen_dtyp_tucmd = (uint32_t) tucmd << 24;
+
+	tx_context = *csum;
+	tx_context_valid = 1;
+}
+
+// Transmit packet.  If 'csum' asks for it, the E1000 fills in the IP
+// and TCP/UDP checksums of the packet.
 void
-transmit_packet(void *buf, size_t size)
+transmit_packet(void *buf, size_t size, struct nic_csum *csum)
 {
 	// Initial checkings
 	if (size > MAX_PACKET_SIZE)
@@ -101,29 +130,52 @@ transmit_packet(void *buf, size_t size)
 	if (!buf)
 		panic("Null pointer passed");
 
+	// A new context descriptor is needed whenever the offsets change,
+	// which is rare: most packets are TCP with the same headers.
+	bool offload = csum && csum->nc_flags;
+	bool new_context = offload
+		&& (!tx_context_valid
+		    || memcmp(csum, &tx_context, sizeof(*csum)) != 0);
+
 	// Retrieve tail and check if it is available (if ring is not full)
 	// by checking if TXD.STATUS.DD is set
 	uint32_t tail = E1000_REG(E1000_TDT);
-	if (!(tx_ring[tail].status & 0x01)) {
+	if (!(tx_ring[tail].status & E1000_TXD_STAT_DD)
+	    || (new_context
+		&& !(tx_ring[(tail + 1) % NUM_TX_DESC].status & E1000_TXD_STAT_DD))) {
 		// Drop packet if tx_ring is full
 		cprintf("tx_ring[tail] DD is not set: tx_ring is full. "
 			"Transmission aborted.\n");
 		return;
 	}
 
-	// Set tx_desc registers
-	// Set CMD.EOP, meaning this is the end of packet (TODO: Really needed?)
-	tx_ring[tail].cmd |= E1000_TXD_CMD_EOP;
-	// Set STAT.DD to 0, meaning this tx_desc is not done, and needs to be sent
-	tx_ring[tail].status &= ~E1000_TXD_STAT_DD;
+	if (new_context) {
+		load_tx_context(tail, csum);
+		tail = (tail + 1) % NUM_TX_DESC;
+	}
 
 	// Put packet data in buffer
-	memset(tx_buffers[tail], 0, PGSIZE);
 	memmove(tx_buffers[tail], buf, size);
 
-	// Update tx descriptor
-	tx_ring[tail].addr = (uint64_t) va2pa(tx_buffers[tail]); //TODO: Redundant! Put this in the initialization
+	// Set tx_desc registers.  CMD.EOP means this is the end of packet,
+	// CMD.RS asks for STAT.DD to be set once the packet is sent.
+	tx_ring[tail].addr = (uint64_t) PADDR(tx_buffers[tail]);
 	tx_ring[tail].length = (uint16_t) size;
+	tx_ring[tail].cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
+	tx_ring[tail].cso = 0;
+	tx_ring[tail].css = 0;
+	tx_ring[tail].special = 0;
+	if (offload) {
+		// Extended data descriptor: css holds the POPTS field
+		tx_ring[tail].cmd |= E1000_TXD_CMD_DEXT;
+		tx_ring[tail].cso = E1000_TXD_DTYP_D;
+		if (csum->nc_flags & NIC_CSUM_IP)
+			tx_ring[tail].css |= E1000_TXD_POPTS_IXSM;
+		if (csum->nc_flags & NIC_CSUM_L4)
+			tx_ring[tail].css |= E1000_TXD_POPTS_TXSM;
+	}
+	// Set STAT.DD to 0, meaning this tx_desc is not done, and needs to be sent
+	tx_ring[tail].status = 0;
 
 	/* Debugging */
 	//cprintf("transmit_packet: Transmitting packet from "
@@ -143,19 +195,16 @@ init_receive(void)
 	cprintf("E1000 initializing receive\n");
 
 	/* Data structures setup */
-	// Allocate memory for descriptor ring
-	char *va;
-	int r;
-	if((r = e1000_page_alloc(&va, PTE_P | PTE_W)) < 0)
-		panic("e1000_page_alloc: %e", r);
-	rx_ring = (struct rx_desc *) va;
+	// Allocate memory for descriptor ring (see init_transmission)
+	rx_ring = kmalloc(RX_RING_SIZE, ALLOC_ZERO);
+	if (!rx_ring)
+		panic("init_receive: out of memory for the ring");
 
 	// Allocate memory for the buffers
 	int i;
 	for (i = 0; i < NUM_RX_DESC; i++) {
-		if((r = e1000_page_alloc(&va, PTE_P | PTE_W)) < 0)
-			panic("e1000_page_alloc: %e", r);
-		rx_buffers[i] = va;
+		if (!(rx_buffers[i] = kmalloc(E1000_BUFSIZE, ALLOC_ZERO)))
+			panic("init_receive: out of memory for the buffers");
 	}
 
 	// Test mappings
@@ -173,7 +222,7 @@ init_receive(void)
 		/* Already zero */
 
 		// Buffer address
-		rx_ring[i].addr = (uint64_t) va2pa(rx_buffers[i]);
+		rx_ring[i].addr = (uint64_t) PADDR(rx_buffers[i]);
 	}
 
 	// The last descriptor starts pointed by the tail
@@ -217,11 +266,11 @@ init_receive(void)
 	// RDBAL and RDBAH (Receive Descriptor Ring address)
 	// Always store physical address, not the virtual address!
 	// Don't use RDBAH as we are using 32 bit addresses
-	E1000_REG(E1000_RDBAL) = va2pa(rx_ring);
+	E1000_REG(E1000_RDBAL) = PADDR(rx_ring);
 
 	// RDLEN (Receive Descriptor Ring length in bytes)
 	// This size must be multiple of 128 bytes
-	E1000_REG(E1000_RDLEN) = NUM_RX_DESC * sizeof(struct rx_desc);
+	E1000_REG(E1000_RDLEN) = RX_RING_SIZE;
 
 	// RDH and RDT (rx_ring head and tail indexes)
 	E1000_REG(E1000_RDH) = 0;
@@ -244,15 +293,20 @@ init_receive(void)
 	/* 00b */
 	// RCTL.SECRC = 1b (Strips the CRC from packet)
 	E1000_REG(E1000_RCTL) |= E1000_RCTL_SECRC;
+
+	// RXCSUM: check the IP and TCP/UDP checksums of received packets
+	E1000_REG(E1000_RXCSUM) = E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL;
 }
 
 // Receive packet function. If there is no packet to be received, does nothing.
+// If 'csum_store' is not null, it is told which checksums of the packet
+// the E1000 verified.
 // The invariants are:
 //   Descriptors owned by software: DD and EOP is set
 //   Descriptors owned by hardware: DD and EOP are not set
 //   The desc. pointed by the tail is SW-owned, but holds no packet.
 void
-receive_packet(void *buf, size_t *size_store)
+receive_packet(void *buf, size_t *size_store, struct nic_csum *csum_store)
 {
 	// Initial checkings
 	if (!buf || !size_store)
@@ -272,6 +326,23 @@ receive_packet(void *buf, size_t *size_store)
 		memmove(buf, rx_buffers[next], (size_t)rx_ring[next].length);
 		*size_store = (size_t) rx_ring[next].length;
 
+		// Report the checksums the hardware checked and found good,
+		// unless it tells us to ignore its checksum indications
+		if (csum_store) {
+			uint8_t status = rx_ring[next].status;
+			uint8_t errors = rx_ring[next].errors;
+
+			memset(csum_store, 0, sizeof(*csum_store));
+			if (!(status & E1000_RXD_STAT_IXSM)) {
+				if ((status & E1000_RXD_STAT_IPCS)
+				    && !(errors & E1000_RXD_ERR_IPE))
+					csum_store->nc_flags |= NIC_CSUM_IP;
+				if ((status & E1000_RXD_STAT_TCPCS)
+				    && !(errors & E1000_RXD_ERR_TCPE))
+					csum_store->nc_flags |= NIC_CSUM_L4;
+			}
+		}
+
 		// Current tail becomes hw-owned (DD=0, EOP=0)
 		rx_ring[tail].status &= ~E1000_RXD_STAT_DD;
 		rx_ring[tail].status &= ~E1000_RXD_STAT_EOP;
@@ -365,60 +436,6 @@ attach_e1000(struct pci_func *pcif)
 	return 0;
 }
 
-/* --------------------------- */
-/* --- Auxiliary Functions --- */
-/* --------------------------- */
-
-// Custom page allocator for the E1000. If succeeds and va_store is not null,
-// stores the virtual address of this new allocated page in it.
-// Returns:
-//   0 on success
-//   -E_NO_MEM if there is no more page to allocate a page or page table for mapping
-static int
-e1000_page_alloc(char **va_store, int perm)
-{
-	// Hold the virtual address of the next free page in virtual address space
-	static char *nextfree;
-
-	// Initial address should be in the beggining of a free area, above UTOP
-	// The chosen address for that was MMIOLIM, there could be a better one
-	if (!nextfree) {
-		nextfree = (char *) MMIOLIM;
-	}
-
-	// Tries to allocate a physical page
-	struct PageInfo *pp = page_alloc(ALLOC_ZERO);
-	if (!pp) {
-	        return -E_NO_MEM;
-	}
-
-	// Tries to map the physical page at nextfree on kern_pgdir
-	int r;
-	if ((r = page_insert(kern_pgdir, pp, nextfree, perm)) < 0) {
-	        page_free(pp);
-	        return -E_NO_MEM;
-	}
-
-	// Store the va of the page
-	if(va_store)
-		*va_store = nextfree;
-
-	// Increment to next free page, and returns success
-	nextfree += PGSIZE;
-	return 0;
-}
-
-// Translates virtual address to physical address
-// Could also use UVPT, but I think this way is simpler/easier
-static physaddr_t
-va2pa(void *va)
-{
-	struct PageInfo *pp = page_lookup(kern_pgdir, va, NULL);
-	if (!pp)
-		panic("va2pa: va is not mapped");
-	return page2pa(pp);
-}
-
 /* ------------------------- */
 /* --- Testing Functions --- */
 /* ------------------------- */
@@ -437,20 +454,25 @@ check_tx_mappings(int check)
 {
 	if (!check) return;
 
-	// Check that the tx_ring page is present, writable and filled with zeroes
+	// Check that the tx_ring is writable and filled with zeroes
 	char *va = (char *) tx_ring;
+	int i;
 	*va = 'a';
-	assert(*(va)      ==  'a');
-	assert(*(va+10)   == '\0');
-	assert(*(va+100)  == '\0');
-	assert(*(va+1000) == '\0');
+	assert(*(va) == 'a');
+	for (i = 1; i < TX_RING_SIZE; i++)
+		assert(va[i] == '\0');
 	*va = 0;
 
-	// Check that buffers pages are all present, writable and filled with
-	// zeroes, by comparing it to the tx_ring page
-	int i;
+	// Check that the buffers are writable, filled with zeroes and
+	// don't overlap each other or the ring
 	for (i = 0; i < NUM_TX_DESC; i++) {
-		assert(memcmp(tx_ring, tx_buffers[i], PGSIZE) == 0);
+		va = tx_buffers[i];
+		assert(va[0] == '\0' && va[E1000_BUFSIZE - 1] == '\0');
+		va[0] = 'a';
+		assert(*(char *) tx_ring == '\0');
+		if (i > 0)
+			assert(tx_buffers[i - 1][0] == '\0');
+		va[0] = 0;
 	}
 
 	cprintf("E1000 TX mappings are ok\n");
@@ -463,11 +485,11 @@ show_tx_mappings(int check)
 
 	// Print all the TX mappings
 	cprintf("E1000 TX mappings:\n");
-	cprintf("\ttx_ring       \tva=%p, \tpa=%p\n", tx_ring, va2pa(tx_ring));
+	cprintf("\ttx_ring       \tva=%p, \tpa=%p\n", tx_ring, PADDR(tx_ring));
 	int i;
 	for (i = 0; i < NUM_TX_DESC; i++) {
 		cprintf("\ttx_buffers[%d] \tva=%p, \tpa=%p\n",
-			i, tx_buffers[i], va2pa(tx_buffers[i]));
+			i, tx_buffers[i], PADDR(tx_buffers[i]));
 	}
 }
 
@@ -476,20 +498,25 @@ check_rx_mappings(int check)
 {
 	if (!check) return;
 
-	// Check that the rx_ring page is present, writable and filled with zeroes
+	// Check that the rx_ring is writable and filled with zeroes
 	char *va = (char *) rx_ring;
+	int i;
 	*va = 'a';
-	assert(*(va)      ==  'a');
-	assert(*(va+10)   == '\0');
-	assert(*(va+100)  == '\0');
-	assert(*(va+1000) == '\0');
+	assert(*(va) == 'a');
+	for (i = 1; i < RX_RING_SIZE; i++)
+		assert(va[i] == '\0');
 	*va = 0;
 
-	// Check that buffers pages are all present, writable and filled with
-	// zeroes, by comparing it to the rx_ring page
-	int i;
+	// Check that the buffers are writable, filled with zeroes and
+	// don't overlap each other or the ring
 	for (i = 0; i < NUM_RX_DESC; i++) {
-		assert(memcmp(rx_ring, rx_buffers[i], PGSIZE) == 0);
+		va = rx_buffers[i];
+		assert(va[0] == '\0' && va[E1000_BUFSIZE - 1] == '\0');
+		va[0] = 'a';
+		assert(*(char *) rx_ring == '\0');
+		if (i > 0)
+			assert(rx_buffers[i - 1][0] == '\0');
+		va[0] = 0;
 	}
 
 	cprintf("E1000 RX mappings are ok\n");
@@ -502,11 +529,11 @@ show_rx_mappings(int check)
 
 	// Print all the RX mappings
 	cprintf("E1000 RX mappings:\n");
-	cprintf("\trx_ring       \tva=%p, \tpa=%p\n", rx_ring, va2pa(rx_ring));
+	cprintf("\trx_ring       \tva=%p, \tpa=%p\n", rx_ring, PADDR(rx_ring));
 	int i;
 	for (i = 0; i < NUM_RX_DESC; i++) {
 		cprintf("\trx_buffers[%d] \tva=%p, \tpa=%p\n",
-			i, rx_buffers[i], va2pa(rx_buffers[i]));
+			i, rx_buffers[i], PADDR(rx_buffers[i]));
 	}
 }
 
@@ -522,7 +549,7 @@ test_transmission(void)
 	}
 
 	for (i = 0; i < 18; i++) {
-		transmit_packet(&data, sizeof(data));
+		transmit_packet(&data, sizeof(data), NULL);
 	}
 }
 
@@ -532,18 +559,17 @@ test_receive(void)
 	cprintf("test_receive - Testing receive...\n");
 	char *buf;
 	size_t length;
-	int r;
 	int i;
 
 	// Allocate buffer to hold received packet
 	cprintf("test_receive - Allocating buffer to hold received packet\n");
-	if ((r = e1000_page_alloc(&buf, PTE_P | PTE_W)) < 0)
-		panic("e1000_page_alloc: %e", r);
-	cprintf("test_receive - buffer: va = %p, pa = %p\n", buf, va2pa(buf));
+	if (!(buf = kmalloc(E1000_BUFSIZE, ALLOC_ZERO)))
+		panic("test_receive: out of memory");
+	cprintf("test_receive - buffer: va = %p, pa = %p\n", buf, PADDR(buf));
 
 	// Try to receive a packet
 	cprintf("test_receive - calling receive_packet\n");
-	receive_packet(buf, &length);
+	receive_packet(buf, &length, NULL);
 
 	// Print the result
 	cprintf("test_receive - data on buf after receiving (first 1000 bytes):\n");
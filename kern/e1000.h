@@ -1,12 +1,16 @@
 #ifndef JOS_KERN_E1000_H
 #define JOS_KERN_E1000_H
 
+#include <inc/nic.h>
 #include <kern/pci.h>
 
 // Constants
 #define MAX_PACKET_SIZE 1518
 #define NUM_TX_DESC 16  // Multiple of 8, at maximum 64
 #define NUM_RX_DESC 128 // Multiple of 8, at least 128
+#define E1000_BUFSIZE 2048 // Packet buffer size, as set in RCTL.BSIZE
+#define TX_RING_SIZE (NUM_TX_DESC * sizeof(struct tx_desc))
+#define RX_RING_SIZE (NUM_RX_DESC * sizeof(struct rx_desc))
 
 // Mac Address 52:54:00:12:34:56 (Attention: reversed byte order)
 #define MAC_ADDR_LOW_32  0x12005452  /* 52:54:00:12 */
@@ -59,7 +63,17 @@
 // Transmit Descriptor bit definitions
 #define E1000_TXD_CMD_EOP  0x01
 #define E1000_TXD_CMD_RS   0x08
+#define E1000_TXD_CMD_DEXT 0x20     /* Extended descriptor */
 #define E1000_TXD_STAT_DD  0x01
+#define E1000_TXD_DTYP_D   0x10     /* Data descriptor, in the cso byte */
+#define E1000_TXD_POPTS_IXSM 0x01   /* Insert IP checksum */
+#define E1000_TXD_POPTS_TXSM 0x02   /* Insert TCP/UDP checksum */
+
+// Context Descriptor bit definitions (TUCMD field)
+#define E1000_TXC_TUCMD_TCP  0x01   /* TCP, not UDP */
+#define E1000_TXC_TUCMD_IP   0x02   /* IPv4 */
+#define E1000_TXC_TUCMD_RS   0x08   /* Report status */
+#define E1000_TXC_TUCMD_DEXT 0x20   /* Extended descriptor */
 
 /* -- Registers used in RX -- */
 // Other rx registers
@@ -82,14 +96,24 @@
 #define E1000_RCTL_BAM            0x00008000    /* broadcast enable */
 #define E1000_RCTL_SECRC          0x04000000    /* Strip Ethernet CRC */
 
+// Receive Checksum Control
+#define E1000_RXCSUM   0x05000  /* RX Checksum Control - RW */
+#define E1000_RXCSUM_IPOFL        0x00000100    /* IP checksum offload */
+#define E1000_RXCSUM_TUOFL        0x00000200    /* TCP/UDP checksum offload */
+
 // Receive Descriptor bit definitions
 #define E1000_RXD_STAT_DD       0x01    /* Descriptor Done */
 #define E1000_RXD_STAT_EOP      0x02    /* End of Packet */
+#define E1000_RXD_STAT_IXSM     0x04    /* Ignore checksum indications */
+#define E1000_RXD_STAT_TCPCS    0x20    /* TCP/UDP checksum calculated */
+#define E1000_RXD_STAT_IPCS     0x40    /* IP checksum calculated */
+#define E1000_RXD_ERR_TCPE      0x20    /* TCP/UDP checksum error */
+#define E1000_RXD_ERR_IPE       0x40    /* IP checksum error */
 
 /* Functions headers */
 int attach_e1000(struct pci_func *pcif);
-void transmit_packet(void *buf, size_t size);
-void receive_packet(void *buf, size_t* size_store);
+void transmit_packet(void *buf, size_t size, struct nic_csum *csum);
+void receive_packet(void *buf, size_t* size_store, struct nic_csum *csum_store);
 void get_mac_address(void *buf);
 
 /* Structures */
@@ -112,6 +136,28 @@ struct tx_desc
 	uint16_t special;
 };
 
+// Transmit context descriptor, which loads the checksum offload
+// settings used by the extended data descriptors that follow it
+// 63            48 47   40 39   32 31   24 23   16 15             0
+// +---------------+-------+-------+-------+-------+---------------+
+// |     TUCSE     | TUCSO | TUCSS |     IPCSE     | IPCSO | IPCSS |
+// +---------------+-------+-------+-------+-------+---------------+
+// |      MSS      | HDRLEN|  STA  | TUCMD | DTYP  |    PAYLEN     |
+// +---------------+-------+-------+-------+-------+---------------+
+struct tx_context_desc
+{
+	uint8_t ipcss;
+	uint8_t ipcso;
+	uint16_t ipcse;
+	uint8_t tucss;
+	uint8_t tucso;
+	uint16_t tucse;
+	uint32_t paylen_dtyp_tucmd;
+	uint8_t status;
+	uint8_t hdrlen;
+	uint16_t mss;
+};
+
 // Receive descriptor
 // 63            48 47   40 39   32 31           16 15             0
 // +---------------------------------------------------------------+
@@ -11,15 +11,33 @@
 #include <kern/pmap.h>
 #include <kern/trap.h>
 #include <kern/monitor.h>
+#include <kern/trace.h>
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/time.h>
 
 struct Env *envs = NULL;		// All environments
+size_t nenv;				// Length of 'envs', set by mem_init
+struct Env *env_ring;			// Allocated environments
+					// (linked by Env->env_next/env_prev)
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
-#define ENVGENSHIFT	12		// >= LOGNENV
+#define ENVGENSHIFT	15		// >= LOG2NENV
+
+// Address spaces of freed environments, waiting for env_reclaim to tear
+// them down (linked by their page directories' pp_link)
+static struct PageInfo *reclaim_head, *reclaim_tail;
+static uint32_t reclaim_pdeno;		// How far it got in the first one
+
+// Registered services, by name (see service_register)
+#define NSERVICES	16
+
+static struct Service {
+	char name[SERVICE_NAMELEN];
+	envid_t envid;
+} services[NSERVICES];
 
 // Global descriptor table.
 //
@@ -88,6 +106,10 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
+	if (envid < 0 || ENVX(envid) >= nenv) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
 	e = &envs[ENVX(envid)];
 	if (e->env_status == ENV_FREE || e->env_id != envid) {
 		*env_store = 0;
@@ -119,8 +141,11 @@ env_init(void)
 {
 	// Set up envs array
 	// LAB 3: Your code here.
+	// mem_init couldn't clear it: it may not all be mapped before
+	// kern_pgdir is loaded.
 	int i;
-	for (i = NENV-1; i >= 0; i--) {
+	memset(envs, 0, nenv * sizeof(struct Env));
+	for (i = nenv-1; i >= 0; i--) {
 		envs[i].env_id = 0;
 
 		envs[i].env_link = env_free_list;
@@ -191,6 +216,7 @@ env_setup_vm(struct Env *e)
 
 	// LAB 3: Your code here.
 	p->pp_ref += 1; // TODO: Why?
+	p->pp_env = e - envs;
 	e->env_pgdir = page2kva(p);
 
 	// Needs to map everything above UTOP: pages, envs, kernel stack
@@ -215,8 +241,11 @@ env_setup_vm(struct Env *e)
 //	-E_NO_FREE_ENV if all NENVS environments are allocated
 //	-E_NO_MEM on memory exhaustion
 //
-int
-env_alloc(struct Env **newenv_store, envid_t parent_id)
+// If 'pgdir' is not null the new environment shares that page directory
+// instead of getting its own, see env_alloc_shared.
+//
+static int
+env_alloc_pgdir(struct Env **newenv_store, envid_t parent_id, pde_t *pgdir)
 {
 	int32_t generation;
 	int r;
@@ -226,7 +255,12 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 		return -E_NO_FREE_ENV;
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if (pgdir) {
+		// The page directory's pp_ref counts the environments
+		// using it, so env_free knows when to tear it down.
+		pa2page(PADDR(pgdir))->pp_ref++;
+		e->env_pgdir = pgdir;
+	} else if ((r = env_setup_vm(e)) < 0)
 		return r;
 
 	// Generate an env_id for this environment.
@@ -240,6 +274,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	memset(&e->env_stats, 0, sizeof(e->env_stats));
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -268,18 +303,53 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_kern_cow = 0;
+	e->env_uxstacktop = UXSTACKTOP;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	// Not sleeping
+	e->env_sleep_until = 0;
+	e->env_sleep_link = NULL;
+
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
 
+	// Join the ring, last in line after the others
+	if (env_ring) {
+		e->env_next = env_ring;
+		e->env_prev = env_ring->env_prev;
+		e->env_prev->env_next = e;
+		env_ring->env_prev = e;
+	} else
+		env_ring = e->env_next = e->env_prev = e;
+
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
 }
 
+int
+env_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+	return env_alloc_pgdir(newenv_store, parent_id, NULL);
+}
+
+//
+// Allocates a new environment that shares parent's address space,
+// that is, a thread of parent.  The new environment is otherwise
+// initialized like env_alloc does, with parent as its parent.
+//
+// Returns 0 on success, < 0 on failure.  Errors include:
+//	-E_NO_FREE_ENV if all NENVS environments are allocated
+//
+int
+env_alloc_shared(struct Env **newenv_store, struct Env *parent)
+{
+	return env_alloc_pgdir(newenv_store, parent->env_id, parent->env_pgdir);
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -372,7 +442,7 @@ load_icode(struct Env *e, uint8_t *binary)
 		if (ph->p_type == ELF_PROG_LOAD) {
 			region_alloc(e, (uint8_t *) ph->p_va, ph->p_memsz);
 
-			lcr3(PADDR(e->env_pgdir));
+			pgdir_switch(e->env_pgdir);
 
 			uint8_t *dst = (uint8_t *) ph->p_va;
 			uint8_t *src = binary + ph->p_offset;
@@ -392,6 +462,60 @@ load_icode(struct Env *e, uint8_t *binary)
 	region_alloc(e, (void *) (USTACKTOP - PGSIZE), PGSIZE);
 }
 
+//
+// Register 'e' as the service called 'name', so that other environments
+// can find it with service_lookup.  A name stays taken until the
+// environment registered under it is gone.
+//
+// Returns 0 on success, < 0 on failure.  Errors include:
+//	-E_INVAL if 'name' is too long, or another environment has it
+//	-E_NO_MEM if there are too many services
+//
+int
+service_register(const char *name, struct Env *e)
+{
+	struct Service *s, *slot = NULL;
+	struct Env *holder;
+
+	if (strlen(name) >= SERVICE_NAMELEN)
+		return -E_INVAL;
+	for (s = services; s < services + NSERVICES; s++) {
+		// Entries of environments that are gone are free
+		if (!s->envid || envid2env(s->envid, &holder, 0) < 0) {
+			if (!slot)
+				slot = s;
+			continue;
+		}
+		if (strcmp(s->name, name) == 0) {
+			if (holder != e)
+				return -E_INVAL;
+			return 0;
+		}
+	}
+	if (!slot)
+		return -E_NO_MEM;
+	strcpy(slot->name, name);
+	slot->envid = e->env_id;
+	return 0;
+}
+
+//
+// Returns the envid of the environment registered as the service
+// called 'name', or -E_NOT_FOUND if there is none.
+//
+envid_t
+service_lookup(const char *name)
+{
+	struct Service *s;
+	struct Env *e;
+
+	for (s = services; s < services + NSERVICES; s++)
+		if (s->envid && strcmp(s->name, name) == 0
+		    && envid2env(s->envid, &e, 0) == 0)
+			return s->envid;
+	return -E_NOT_FOUND;
+}
+
 //
 // Allocates a new env with env_alloc, loads the named elf
 // binary into it with load_icode, and sets its env_type.
@@ -413,54 +537,68 @@ env_create(uint8_t *binary, enum EnvType type)
 	if (type == ENV_TYPE_FS) {
 		e->env_tf.tf_eflags |= FL_IOPL_MASK;
 	}
+
+	// The servers are registered from the start, so their clients
+	// can find them however early they look
+	if (type == ENV_TYPE_FS)
+		service_register("fs", e);
+	else if (type == ENV_TYPE_NS)
+		service_register("ns", e);
 }
 
 //
-// Frees env e and all memory it uses.
+// Frees env e.  The memory its address space uses is freed later, by
+// env_reclaim.
 //
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
+	struct PageInfo *pp;
 	physaddr_t pa;
 
-	// If freeing the current environment, switch to kern_pgdir
-	// before freeing the page directory, just in case the page
-	// gets reused.
-	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+	// A sleeping environment must leave its sleep queue
+	timer_cancel(e);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
-	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
-
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
-
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
+	// Other threads still use the address space: just drop our reference
+	pa = PADDR(e->env_pgdir);
+	if (pa2page(pa)->pp_ref > 1) {
+		e->env_pgdir = 0;
 		page_decref(pa2page(pa));
+		goto done;
 	}
 
-	// free the page directory
-	pa = PADDR(e->env_pgdir);
+	// If we have the address space loaded, switch to kern_pgdir
+	// before its page tables get freed, just in case the pages get
+	// reused.
+	if (thiscpu->cpu_pgdir == e->env_pgdir)
+		pgdir_switch(kern_pgdir);
+
+	// Tearing the address space down can take a while, and nobody is
+	// waiting for it: leave it to env_reclaim, on an idle CPU if there
+	// is one, and free the Env right away.
+	pp = pa2page(pa);
+	pp->pp_link = NULL;
+	if (reclaim_head)
+		reclaim_tail->pp_link = pp;
+	else
+		reclaim_head = pp;
+	reclaim_tail = pp;
 	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
+	sched_wakeup();
+
+done:
+	// leave the ring
+	if (e->env_next == e)
+		env_ring = NULL;
+	else {
+		e->env_prev->env_next = e->env_next;
+		e->env_next->env_prev = e->env_prev;
+		if (env_ring == e)
+			env_ring = e->env_next;
+	}
 
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
@@ -468,6 +606,78 @@ env_free(struct Env *e)
 	env_free_list = e;
 }
 
+// Drop a reference to page 'pp', which env_reclaim found mapped.  If it
+// was the last, add it to the list 'freed' instead of freeing it, to be
+// freed with the others.
+static void
+reclaim_page(struct PageInfo *pp, struct PageInfo **freed)
+{
+	if (--pp->pp_ref == 0) {
+		pp->pp_link = *freed;
+		*freed = pp;
+	}
+}
+
+//
+// Tear down the address spaces env_free left behind, up to 'npts' page
+// tables of them (all of them if 'npts' is negative): unmap their pages,
+// free their page tables and at last their page directories.  The pages
+// go back to the free list together at the end.
+//
+// The address spaces are no environment's anymore, and no CPU can be
+// running them in user mode, so there are no TLB entries to flush but
+// those of CPUs that switch away from them anyway.
+//
+// Returns whether there is more left to do.
+//
+bool
+env_reclaim(int npts)
+{
+	struct PageInfo *pp, *large, *freed = NULL;
+	pde_t *pgdir, pde;
+	pte_t *pt;
+	uint32_t pteno;
+
+	static_assert(UTOP % PTSIZE == 0);
+	while ((pp = reclaim_head) && npts != 0) {
+		pgdir = page2kva(pp);
+		for (; reclaim_pdeno < PDX(UTOP) && npts != 0; reclaim_pdeno++) {
+			// only look at mapped page tables
+			pde = pgdir[reclaim_pdeno];
+			if (!(pde & PTE_P))
+				continue;
+			pgdir[reclaim_pdeno] = 0;
+
+			// a 4MB page has no page table
+			if (pde & PTE_PS) {
+				large = pa2page(PTE_PS_ADDR(pde));
+				if (--large->pp_ref == 0)
+					page_free_large(large);
+				continue;
+			}
+
+			// unmap all PTEs in this page table, and free it
+			pt = (pte_t *) KADDR(PTE_ADDR(pde));
+			for (pteno = 0; pteno < NPTENTRIES; pteno++)
+				if (pt[pteno] & PTE_P)
+					reclaim_page(pa2page(PTE_ADDR(pt[pteno])),
+						     &freed);
+			reclaim_page(pa2page(PTE_ADDR(pde)), &freed);
+			npts--;
+		}
+		if (reclaim_pdeno < PDX(UTOP))
+			break;
+
+		// free the page directory, once no CPU has it loaded
+		reclaim_head = pp->pp_link;
+		pp->pp_link = NULL;
+		reclaim_pdeno = 0;
+		pgdir_free(pgdir);
+	}
+	page_free_batch(freed);
+	return reclaim_head != NULL;
+}
+
 //
 // Frees environment e.
 // If e was the current env, then runs a new environment (and does not return
@@ -543,15 +753,29 @@ env_run(struct Env *e)
 
 	// LAB 3: Your code here.
 	// Step 1
+	bool switched = curenv != e;
 	if (curenv && curenv->env_status == ENV_RUNNING)
 		curenv->env_status = ENV_RUNNABLE;
 	curenv = e;
+	if (switched)
+		trace(TRACE_SCHED, TR_ENV_RUN, e->env_id, e->env_runs);
 	e->env_status = ENV_RUNNING;
 	e->env_runs += 1;
-	lcr3(PADDR(e->env_pgdir));
+	pgdir_switch(e->env_pgdir);	// free if we ran it last
+
+	// A new time slice starts when the scheduler picks an environment.
+	// Make sure the timer fires at its end, or earlier if some
+	// environment has to wake up.
+	if (!thiscpu->cpu_slice_end)
+		thiscpu->cpu_slice_end = time_nsec() + TIME_SLICE_NSEC;
+	timer_arm(thiscpu->cpu_slice_end);
 
 	// Step 2
+	// From here on, CPUs changing our address space wait for us to
+	// flush the TLB (see tlb_shootdown).
+	thiscpu->cpu_in_user = 1;
 	unlock_kernel();
+	thiscpu->cpu_user_start = read_tsc();	// see trap()
 	env_pop_tf(&(e->env_tf));
 }
 
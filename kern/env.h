@@ -7,17 +7,30 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
+extern size_t nenv;			// How many there are in 'envs'
+extern struct Env *env_ring;		// The allocated ones (see env_next)
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
+// mem_init gives envs[] one environment for every ENV_PAGES pages of
+// memory, about the least an environment can get by with
+#define ENV_PAGES	4
+
+// Page tables an idle CPU tears down at a time (see env_reclaim)
+#define ENV_RECLAIM_SLICE	8
+
 void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
+int	env_alloc_shared(struct Env **e, struct Env *parent);
 void	env_free(struct Env *e);
+bool	env_reclaim(int npts);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	service_register(const char *name, struct Env *e);
+envid_t	service_lookup(const char *name);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
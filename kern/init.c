@@ -16,6 +16,8 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/prof.h>
+#include <kern/trace.h>
 
 static void boot_aps(void);
 
@@ -54,6 +56,16 @@ i386_init(void)
 	time_init();
 	pci_init();
 
+#ifdef PROF_HZ
+	// Profile from boot, e.g. with
+	// make run-benchfile-nox INIT_CFLAGS=-DPROF_HZ=1000
+	prof_start(PROF_HZ);
+#endif
+#ifdef TRACE_MASK
+	// Trace from boot, e.g. INIT_CFLAGS=-DTRACE_MASK=TRACE_ALL
+	trace_mask = TRACE_MASK;
+#endif
+
 	// Acquire the big kernel lock before waking up APs
 	// Your code here:
 	lock_kernel();
@@ -121,7 +133,8 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
+	pgdir_switch(kern_pgdir);
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -169,6 +182,9 @@ _panic(const char *file, int line, const char *fmt,...)
 	cprintf("\n");
 	va_end(ap);
 
+	// No more interrupts will come to send it
+	cons_flush();
+
 dead:
 	/* break into the kernel monitor */
 	while (1)
@@ -0,0 +1,175 @@
+// Allocator for kernel objects smaller than a page.
+//
+// Objects come in power-of-two size classes from KM_MINSIZE bytes up to
+// a page.  Each class carves whole pages ("slabs") into objects of its
+// size, so objects are aligned to their size, never cross a page, and
+// being in the direct map, PADDR gives their physical address for DMA.
+// A slab's PageInfo says which class it belongs to (pp_slab).
+//
+// Each CPU keeps a small cache of free objects of every class, and only
+// goes to the shared lists, under kmalloc_lock, to refill or spill half
+// of it.  Nothing here sleeps, so kmalloc and kfree can be called from
+// system calls and interrupt handlers alike (the kernel runs with
+// interrupts off, so a CPU's cache is never used by two at once).
+//
+// Slabs are never given back to page_free: kernel objects are few and
+// mostly live as long as the kernel.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define KM_MINSHIFT	4
+#define KM_MINSIZE	(1 << KM_MINSHIFT)
+#define KM_NCLASSES	(PGSHIFT - KM_MINSHIFT + 1)	// 16 bytes .. a page
+#define KM_CACHE	16	// Free objects a CPU keeps per class
+
+// A free object starts with a link to the next
+struct KmFree {
+	struct KmFree *next;
+};
+
+struct KmClass {
+	struct KmFree *free;	// Free objects not in any CPU's cache
+	uint32_t nfree;
+	uint32_t nslabs;	// Pages carved up for this class
+};
+
+struct KmCache {
+	int n;
+	void *objs[KM_CACHE];
+};
+
+static struct KmClass km_classes[KM_NCLASSES];
+static struct KmCache km_caches[NCPU][KM_NCLASSES];
+static struct spinlock kmalloc_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "kmalloc_lock"
+#endif
+};
+
+// The smallest class that holds 'size' bytes
+static int
+size_class(size_t size)
+{
+	int c = 0;
+
+	while ((KM_MINSIZE << c) < size)
+		c++;
+	return c;
+}
+
+// Move up to 'n' free objects of class 'c' into 'cache'.  Carves a new
+// slab if there are none.  Returns the number moved.
+static int
+km_refill(struct KmCache *cache, int c, int n)
+{
+	struct KmClass *kc = &km_classes[c];
+	struct PageInfo *pp;
+	struct KmFree *f;
+	size_t size = KM_MINSIZE << c;
+	char *slab;
+	int i;
+
+	spin_lock(&kmalloc_lock);
+	if (!kc->free && (pp = page_alloc(0))) {
+		pp->pp_slab = c;
+		slab = page2kva(pp);
+		for (i = PGSIZE / size - 1; i >= 0; i--) {
+			f = (struct KmFree *) (slab + i * size);
+			f->next = kc->free;
+			kc->free = f;
+		}
+		kc->nfree += PGSIZE / size;
+		kc->nslabs++;
+	}
+	for (i = 0; i < n && kc->free; i++) {
+		cache->objs[cache->n++] = kc->free;
+		kc->free = kc->free->next;
+		kc->nfree--;
+	}
+	spin_unlock(&kmalloc_lock);
+	return i;
+}
+
+// Give the shared list the oldest 'n' objects of 'cache', of class 'c'.
+static void
+km_spill(struct KmCache *cache, int c, int n)
+{
+	struct KmClass *kc = &km_classes[c];
+	struct KmFree *f;
+	int i;
+
+	spin_lock(&kmalloc_lock);
+	for (i = 0; i < n; i++) {
+		f = cache->objs[i];
+		f->next = kc->free;
+		kc->free = f;
+	}
+	kc->nfree += n;
+	spin_unlock(&kmalloc_lock);
+	cache->n -= n;
+	memmove(cache->objs, cache->objs + n, cache->n * sizeof(void *));
+}
+
+// Allocate 'size' bytes, zeroed if (alloc_flags & ALLOC_ZERO).
+// Returns NULL if out of memory, or if 'size' is more than KMALLOC_MAX.
+void *
+kmalloc(size_t size, int alloc_flags)
+{
+	struct KmCache *cache;
+	void *obj;
+	int c;
+
+	if (size > KMALLOC_MAX)
+		return NULL;
+	c = size_class(size);
+	cache = &km_caches[cpunum()][c];
+	if (!cache->n && !km_refill(cache, c, KM_CACHE / 2))
+		return NULL;
+	obj = cache->objs[--cache->n];
+	if (alloc_flags & ALLOC_ZERO)
+		memset(obj, 0, KM_MINSIZE << c);
+	return obj;
+}
+
+// Free an object from kmalloc.
+void
+kfree(void *obj)
+{
+	struct KmCache *cache;
+	int c;
+
+	if (!obj)
+		return;
+	c = pa2page(PADDR(obj))->pp_slab;
+	assert(c < KM_NCLASSES && ((uintptr_t) obj & ((KM_MINSIZE << c) - 1)) == 0);
+	cache = &km_caches[cpunum()][c];
+	if (cache->n == KM_CACHE)
+		km_spill(cache, c, KM_CACHE / 2);
+	cache->objs[cache->n++] = obj;
+}
+
+// Show how much memory each size class uses.
+void
+kmalloc_print(void)
+{
+	uint32_t cached;
+	int c, i;
+
+	cprintf("  size  slabs   free  cached\n");
+	for (c = 0; c < KM_NCLASSES; c++) {
+		if (!km_classes[c].nslabs)
+			continue;
+		cached = 0;
+		for (i = 0; i < ncpu; i++)
+			cached += km_caches[i][c].n;
+		cprintf("%6d %6u %6u %7u\n", KM_MINSIZE << c,
+			km_classes[c].nslabs, km_classes[c].nfree, cached);
+	}
+}
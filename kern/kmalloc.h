@@ -0,0 +1,17 @@
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Largest object kmalloc hands out
+#define KMALLOC_MAX	PGSIZE
+
+void *	kmalloc(size_t size, int alloc_flags);
+void	kfree(void *obj);
+void	kmalloc_print(void);
+
+#endif /* !JOS_KERN_KMALLOC_H */
@@ -45,6 +45,8 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+static uint64_t lapic_timer_hz;	// Timer count rate, measured at boot
+
 static void
 lapicw(int index, int value)
 {
@@ -65,13 +67,12 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  It stays stopped until
+	// lapic_timer_oneshot programs it, see kern/time.c.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, 0);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -180,3 +181,55 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Measure the timer's count rate against the TSC, which ticks at
+// 'tsc_hz'.  The rate is the same for all CPUs.
+void
+lapic_timer_calibrate(uint64_t tsc_hz)
+{
+	uint64_t start;
+
+	if (!lapic)
+		return;
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0xffffffff);
+	start = read_tsc();
+	while (read_tsc() - start < tsc_hz / 100)
+		;
+	lapic_timer_hz = (uint64_t) (0xffffffff - lapic[TCCR]) * 100;
+	lapicw(TICR, 0);
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+}
+
+// Raise a timer interrupt in 'nsec' nanoseconds.  Delays longer than a
+// second are cut short; the interrupt handler just reprograms the timer.
+void
+lapic_timer_oneshot(uint64_t nsec)
+{
+	uint64_t count;
+
+	if (nsec > 1000000000)
+		nsec = 1000000000;
+	count = nsec * lapic_timer_hz / 1000000000;
+	if (count == 0)
+		count = 1;
+	if (count > 0xffffffff)
+		count = 0xffffffff;
+	lapicw(TICR, count);
+}
+
+void
+lapic_timer_stop(void)
+{
+	lapicw(TICR, 0);
+}
+
+// Send an IPI to a single CPU, given its local APIC ID
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
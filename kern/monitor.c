@@ -11,6 +11,9 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/prof.h>
+#include <kern/trace.h>
+#include <kern/kmalloc.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -25,6 +28,10 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
+	{ "prof", "Profiler: prof [n] | prof start [hz] | prof stop | prof dump", mon_prof },
+	{ "trace", "Tracing: trace | trace category... | trace off | trace dump", mon_trace },
+	{ "kmalloc", "Show the kernel object allocator's memory use", mon_kmalloc },
+	{ "dmesg", "Show the recent console output again", mon_dmesg },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -75,6 +82,92 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
         return 0;
 }
 
+int
+mon_prof(int argc, char **argv, struct Trapframe *tf)
+{
+	long n;
+
+	if (argc == 1) {
+		prof_print(20);
+	} else if (strcmp(argv[1], "start") == 0) {
+		n = argc > 2 ? strtol(argv[2], 0, 0) : PROF_HZ_DEFAULT;
+		if (n <= 0 || n > 100000) {
+			cprintf("prof: bad rate %s\n", argv[2]);
+			return 0;
+		}
+		prof_start(n);
+		cprintf("prof: sampling at %ld Hz\n", n);
+	} else if (strcmp(argv[1], "stop") == 0) {
+		prof_stop();
+	} else if (strcmp(argv[1], "dump") == 0) {
+		prof_dump();
+	} else if ((n = strtol(argv[1], 0, 0)) > 0) {
+		prof_print(n);
+	} else
+		cprintf("usage: prof [n] | prof start [hz] | prof stop | prof dump\n");
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	uint32_t mask;
+} trace_categories[] = {
+	{ "sched", TRACE_SCHED },
+	{ "ipc", TRACE_IPC },
+	{ "syscall", TRACE_SYSCALL },
+	{ "pgfault", TRACE_PGFAULT },
+	{ "irq", TRACE_IRQ },
+	{ "all", TRACE_ALL },
+	{ "off", 0 },
+};
+#define NTRACE_CATEGORIES (sizeof(trace_categories)/sizeof(trace_categories[0]))
+
+int
+mon_trace(int argc, char **argv, struct Trapframe *tf)
+{
+	uint32_t mask = 0;
+	int i, j;
+
+	if (argc == 1) {
+		trace_print();
+		return 0;
+	}
+	if (argc == 2 && strcmp(argv[1], "dump") == 0) {
+		trace_drain();
+		return 0;
+	}
+	for (i = 1; i < argc; i++) {
+		for (j = 0; j < NTRACE_CATEGORIES; j++)
+			if (strcmp(argv[i], trace_categories[j].name) == 0)
+				break;
+		if (j == NTRACE_CATEGORIES) {
+			cprintf("trace: no category %s\n", argv[i]);
+			return 0;
+		}
+		mask |= trace_categories[j].mask;
+	}
+	trace_mask = mask;
+	trace_print();
+	return 0;
+}
+
+int
+mon_kmalloc(int argc, char **argv, struct Trapframe *tf)
+{
+	kmalloc_print();
+	return 0;
+}
+
+int
+mon_dmesg(int argc, char **argv, struct Trapframe *tf)
+{
+	cons_dmesg();
+	if (cons_dropped())
+		cprintf("(%u characters of console output were dropped)\n",
+			cons_dropped());
+	return 0;
+}
+
 
 
 /***** Kernel monitor command interpreter *****/
@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/stats.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -20,6 +21,14 @@ pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
 
+// Set in mem_init() if the CPU can map 4MB pages, and global pages
+static bool pse;
+static bool pge;
+
+// Feature bits of cpuid(1), in %edx
+#define CPUID_PSE	0x00000008	// Page Size Extensions
+#define CPUID_PGE	0x00002000	// Page Global Enable
+
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -59,14 +68,17 @@ i386_detect_memory(void)
 // Set up memory mappings above UTOP.
 // --------------------------------------------------------------
 
-static void mem_init_mp(void);
+static void mem_init_mp(int global);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void pgtable_remove(pde_t *pgdir, void *va);
+static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void check_page_large(void);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -123,12 +135,24 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
+	uint32_t cr0, edx;
+	int global;
 	size_t n;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
 
+	// Can we use 4MB pages?  Global pages?
+	cpuid(1, NULL, NULL, NULL, &edx);
+	pse = (edx & CPUID_PSE) != 0;
+	pge = (edx & CPUID_PGE) != 0;
+	mem_init_percpu();
+
+	// The kernel's mappings are the same in every address space, so
+	// they can be global: switching address spaces leaves them in the
+	// TLB.  Only what is mapped for the user, UVPT, is not.
+	global = pge ? PTE_G : 0;
+
 	// Remove this line when you're ready to test this function.
 //	panic("mem_init: This function is not finished\n");
 
@@ -158,11 +182,16 @@ mem_init(void)
 	memset(pages, 0, npages * sizeof(struct PageInfo));
 
 	//////////////////////////////////////////////////////////////////////
-	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
+	// Make 'envs' point to an array of size 'nenv' of 'struct Env'.
 	// LAB 3: Your code here.
+	// As many as the memory can hold (see ENV_PAGES), and UENVS can
+	// show the user.  env_init clears them: with many environments the
+	// array can go past the 4MB entry_pgdir maps.
 
-	envs = (struct Env *) boot_alloc(NENV * sizeof(struct Env));
-	memset(envs, 0, NENV * sizeof(struct Env));
+	nenv = MIN(npages / ENV_PAGES, (USTATS - UENVS) / sizeof(struct Env));
+	nenv = MIN(nenv, NENV);
+	envs = (struct Env *) boot_alloc(nenv * sizeof(struct Env));
+	kstats.ks_nenv = nenv;
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -188,7 +217,8 @@ mem_init(void)
 	// Your code goes here:
 
 	uint32_t size = ROUNDUP(npages * sizeof(struct PageInfo), PGSIZE);
-	boot_map_region(kern_pgdir, UPAGES, size, PADDR(pages), PTE_U);
+	assert(size <= UVPT - UPAGES);
+	boot_map_region(kern_pgdir, UPAGES, size, PADDR(pages), PTE_U | global);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map the 'envs' array read-only by the user at linear address UENVS
@@ -198,8 +228,13 @@ mem_init(void)
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
 
-	size = ROUNDUP(NENV * sizeof(struct Env), PGSIZE);
-	boot_map_region(kern_pgdir, UENVS, size, PADDR(envs), PTE_U);
+	size = ROUNDUP(nenv * sizeof(struct Env), PGSIZE);
+	boot_map_region(kern_pgdir, UENVS, size, PADDR(envs), PTE_U | global);
+
+	// And the kernel's statistics at USTATS, the same way
+	size = ROUNDUP(sizeof(struct KernStats), PGSIZE);
+	static_assert(sizeof(struct KernStats) <= UPAGES - USTATS);
+	boot_map_region(kern_pgdir, USTATS, size, PADDR(&kstats), PTE_U | global);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -213,7 +248,7 @@ mem_init(void)
 	//     Permissions: kernel RW, user NONE
 	// Your code goes here:
 	extern char bootstack[];
-	boot_map_region(kern_pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W);
+	boot_map_region(kern_pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W | global);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
@@ -223,11 +258,16 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
+	// With 4MB pages if we can: no page tables to allocate, and a TLB
+	// entry covers 1024 times as much memory.
 	size = ((0xFFFFFFFF) - KERNBASE) + 1;
-	boot_map_region(kern_pgdir, KERNBASE, size, 0, PTE_W);
+	if (pse)
+		boot_map_region_large(kern_pgdir, KERNBASE, size, 0, PTE_W | global);
+	else
+		boot_map_region(kern_pgdir, KERNBASE, size, 0, PTE_W | global);
 
 	// Initialize the SMP-related parts of the memory map
-	mem_init_mp();
+	mem_init_mp(global);
 
 	// Check that the initial page directory has been set up correctly.
 	check_kern_pgdir();
@@ -252,13 +292,29 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+	if (pse)
+		check_page_large();
+}
+
+// Turn on the paging features kern_pgdir needs on this CPU.  Must be
+// called before loading kern_pgdir.
+void
+mem_init_percpu(void)
+{
+	uint32_t cr4 = rcr4();
+
+	if (pse)
+		cr4 |= CR4_PSE;
+	if (pge)
+		cr4 |= CR4_PGE;
+	lcr4(cr4);
 }
 
 // Modify mappings in kern_pgdir to support SMP
 //   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
 //
 static void
-mem_init_mp(void)
+mem_init_mp(int global)
 {
 	// Map per-CPU stacks starting at KSTACKTOP, for up to 'NCPU' CPUs.
 	//
@@ -281,7 +337,7 @@ mem_init_mp(void)
 		uintptr_t kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
 		uintptr_t kstackbot_i = kstacktop_i - KSTKSIZE;
 		physaddr_t kstackpa_i = PADDR(&percpu_kstacks[i]);
-		boot_map_region(kern_pgdir, kstackbot_i, KSTKSIZE, kstackpa_i, PTE_W);
+		boot_map_region(kern_pgdir, kstackbot_i, KSTKSIZE, kstackpa_i, PTE_W | global);
 	}
 }
 
@@ -366,7 +422,11 @@ page_alloc(int alloc_flags)
 {
 	// Fill this function in
 
-	// Test if it is out of memory
+	// Test if it is out of memory.  If it is, there may be pages left
+	// in the address spaces of freed environments: take them now
+	// instead of waiting for an idle CPU to.
+	if (!page_free_list)
+		env_reclaim(-1);
 	if (!page_free_list)
 		return NULL;
 
@@ -398,6 +458,27 @@ page_free(struct PageInfo *pp)
 	page_free_list = pp;
 }
 
+//
+// Return all the pages on 'list' (linked by pp_link) to the free list at
+// once.  They must all have pp_ref 0.
+//
+void
+page_free_batch(struct PageInfo *list)
+{
+	struct PageInfo *pp;
+
+	if (!list)
+		return;
+	for (pp = list; ; pp = pp->pp_link) {
+		if (pp->pp_ref != 0)
+			panic("page_free_batch: pp->pp_ref is nonzero");
+		if (!pp->pp_link)
+			break;
+	}
+	pp->pp_link = page_free_list;
+	page_free_list = list;
+}
+
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
@@ -409,6 +490,65 @@ page_decref(struct PageInfo* pp)
 		page_free(pp);
 }
 
+//
+// Allocates a 4MB page: NPTENTRIES physically contiguous pages, the
+// first of them 4MB-aligned, to be mapped by a single page directory
+// entry with PTE_PS.  Returns the PageInfo of the first page, which
+// holds the reference count of the whole 4MB page; the others are kept
+// off the free list with pp_ref 0.  alloc_flags as for page_alloc.
+//
+// Returns NULL if no 4MB-aligned chunk of physical memory is all free.
+//
+struct PageInfo *
+page_alloc_large(int alloc_flags)
+{
+	static uint16_t nfree[NPDENTRIES];	// free pages per 4MB chunk
+	struct PageInfo *pp, **pprev;
+	uint32_t chunk;
+
+	// The free list isn't sorted: count what's free in every chunk
+	memset(nfree, 0, sizeof(nfree));
+	for (pp = page_free_list; pp; pp = pp->pp_link)
+		nfree[PDX(page2pa(pp))]++;
+	for (chunk = 0; chunk < npages / NPTENTRIES; chunk++)
+		if (nfree[chunk] == NPTENTRIES)
+			break;
+	if (chunk == npages / NPTENTRIES)
+		return NULL;
+
+	// Take the chunk's pages off the free list
+	pprev = &page_free_list;
+	while ((pp = *pprev)) {
+		if (PDX(page2pa(pp)) == chunk) {
+			*pprev = pp->pp_link;
+			pp->pp_link = NULL;
+		} else
+			pprev = &pp->pp_link;
+	}
+
+	pp = &pages[chunk * NPTENTRIES];
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), '\0', PTSIZE);
+	return pp;
+}
+
+//
+// Return a 4MB page from page_alloc_large to the free list.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free_large(struct PageInfo *pp)
+{
+	int i;
+
+	if (pp->pp_ref != 0 || pp->pp_link != NULL || page2pa(pp) % PTSIZE)
+		panic("page_free_large: not a free 4MB page");
+	for (i = 0; i < NPTENTRIES; i++) {
+		pp[i].pp_link = page_free_list;
+		page_free_list = &pp[i];
+	}
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -431,6 +571,10 @@ page_decref(struct PageInfo* pp)
 // Hint 3: look at inc/mmu.h for useful macros that mainipulate page
 // table and page directory entries.
 //
+// If 'va' is in a 4MB page there is no page table, and pgdir_walk
+// returns a pointer to the page directory entry itself, which has
+// PTE_PS set.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
@@ -441,6 +585,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 
 	// If pgdir_entry is present
 	if (*pgdir_entry & PTE_P) {
+		if (*pgdir_entry & PTE_PS)
+			return pgdir_entry;
 		physaddr_t pgtable_pa = (physaddr_t) (*pgdir_entry & 0xFFFFF000);
 		pte_t *pgtable = (pte_t *) KADDR(pgtable_pa);
 		return pgtable + pgtable_index;
@@ -494,6 +640,22 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 	}
 }
 
+//
+// Like boot_map_region, but with 4MB pages.  va, pa and size must be
+// multiples of PTSIZE, and the CPU must support 4MB pages.
+//
+static void
+boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+{
+	if (va % PTSIZE || pa % PTSIZE || size % PTSIZE)
+		panic("boot_map_region_large: not 4MB-aligned");
+	for (; size > 0; size -= PTSIZE) {
+		pgdir[PDX(va)] = pa | perm | PTE_PS | PTE_P;
+		va += PTSIZE;
+		pa += PTSIZE;
+	}
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -512,6 +674,10 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // frequently leads to subtle bugs; there's an elegant way to handle
 // everything in one code path.
 //
+// If perm has PTE_PS, 'pp' must come from page_alloc_large and 'va' must
+// be 4MB-aligned: the 4MB page is mapped by the page directory entry,
+// and anything mapped in the 4MB range before is removed.
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
@@ -521,6 +687,21 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 //
 // TODO: It should only be used on pages that are not free? (Allocated pages)
 // So it can only be used on pages that were allocated.
+//
+// Count 'n' pages mapped (or unmapped, if 'n' is negative) in the
+// statistics of the environment whose address space 'pgdir' is.
+static void
+pgdir_count(pde_t *pgdir, int n)
+{
+	struct Env *e;
+
+	if (pgdir == kern_pgdir)
+		return;
+	e = &envs[pa2page(PADDR(pgdir))->pp_env];
+	if (e->env_pgdir == pgdir)
+		e->env_stats.es_pages += n;
+}
+
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
@@ -528,19 +709,28 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	// TODO: Find a better solution...
 
 	// Corner case
+	// The permissions may have been reduced (fork remaps pages
+	// copy-on-write this way), so the old TLB entry must go.
 	pte_t *pte;
-	if (page_lookup(pgdir, va, &pte) == pp) {
+	if (page_lookup(pgdir, va, &pte) == pp &&
+	    (*pte & PTE_PS) == (perm & PTE_PS)) {
 		*pte = (page2pa(pp) | perm | PTE_P);
+		tlb_invalidate(pgdir, va);
 		return 0;
 	}
 
 	// Normal case
 	page_remove(pgdir, va);
-	pte = pgdir_walk(pgdir, va, 1);
+	if (perm & PTE_PS) {
+		pgtable_remove(pgdir, va);
+		pte = &pgdir[PDX(va)];
+	} else
+		pte = pgdir_walk(pgdir, va, 1);
 	if (!pte)
 		return -E_NO_MEM;
 	pp->pp_ref += 1;
 	*pte = (page2pa(pp) | perm | PTE_P);
+	pgdir_count(pgdir, (perm & PTE_PS) ? NPTENTRIES : 1);
 	return 0;
 }
 
@@ -553,6 +743,9 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 //
 // Return NULL if there is no page mapped at va.
 //
+// If va is in a 4MB page, this is the 4KB page of it that holds va, and
+// *pte_store is its page directory entry (see pgdir_walk).
+//
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
 struct PageInfo *
@@ -563,6 +756,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	if (!pte || !(*pte & PTE_P))
 		return NULL;
 	physaddr_t page_pa = (*pte & 0xFFFFF000);
+	if (*pte & PTE_PS)
+		page_pa = PTE_PS_ADDR(*pte) + PTX(va) * PGSIZE;
 	if (pte_store)
 		*pte_store = pte;
 	return pa2page(page_pa);
@@ -583,28 +778,222 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
+// If va is in a 4MB page, the whole 4MB page is unmapped.
+//
 void
 page_remove(pde_t *pgdir, void *va)
 {
 	pte_t *pte;
 	struct PageInfo *page = page_lookup(pgdir, va, &pte);
 	if (page) {
-		page_decref(page);
+		if (*pte & PTE_PS) {
+			// Its first page counts the references
+			page = pa2page(PTE_PS_ADDR(*pte));
+			if (--page->pp_ref == 0)
+				page_free_large(page);
+			pgdir_count(pgdir, -NPTENTRIES);
+		} else {
+			page_decref(page);
+			pgdir_count(pgdir, -1);
+		}
 		*pte = 0;
 		tlb_invalidate(pgdir, va); // How this works? Is va here ok?
 	}
 }
 
+//
+// Unmap all the pages mapped by the page table covering 'va', and free
+// the page table.  Does nothing if there is no page table there.
+//
+static void
+pgtable_remove(pde_t *pgdir, void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	pte_t *pt;
+	int i;
+
+	if (!(*pde & PTE_P) || (*pde & PTE_PS))
+		return;
+	pt = (pte_t *) KADDR(PTE_ADDR(*pde));
+	for (i = 0; i < NPTENTRIES; i++)
+		if (pt[i] & PTE_P)
+			page_remove(pgdir, PGADDR(PDX(va), i, 0));
+	page_decref(pa2page(PTE_ADDR(*pde)));
+	*pde = 0;
+	tlb_invalidate(pgdir, va);
+}
+
+//
+// Resolve a write to the copy-on-write page mapped at 'va' in 'pgdir'.
+// If no other mapping refers to the physical page, it is simply made
+// writable again; otherwise it is replaced by a private writable copy.
+// Either way PTE_COW is dropped and the other permission bits are kept.
+// A 4MB page is copied whole.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if there is no user PTE_COW page mapped at 'va'
+//   -E_NO_MEM, if the copy couldn't be allocated
+//
+int
+page_cow(pde_t *pgdir, void *va)
+{
+	pte_t *pte;
+	struct PageInfo *pp, *copy;
+	size_t size = PGSIZE;
+	int perm;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP)
+		return -E_INVAL;
+	pp = page_lookup(pgdir, va, &pte);
+	if (!pp)
+		return -E_INVAL;
+	if (*pte & PTE_PS) {
+		va = ROUNDDOWN(va, PTSIZE);
+		pp = pa2page(PTE_PS_ADDR(*pte));
+		size = PTSIZE;
+	}
+
+	// Another thread of the same address space already resolved the
+	// fault, and we took it on a stale TLB entry.
+	if ((*pte & (PTE_U | PTE_W)) == (PTE_U | PTE_W)) {
+		invlpg(va);
+		return 0;
+	}
+
+	if ((*pte & (PTE_U | PTE_COW)) != (PTE_U | PTE_COW))
+		return -E_INVAL;
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | (*pte & PTE_PS) | PTE_W;
+
+	// We are the only user of the page: no need to copy
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if (!(copy = size == PTSIZE ? page_alloc_large(0) : page_alloc(0)))
+		return -E_NO_MEM;
+	memmove(page2kva(copy), page2kva(pp), size);
+	// Can't fail: the page table already exists
+	return page_insert(pgdir, copy, va, perm);
+}
+
+//
+// Load 'pgdir' on this CPU.  If it is loaded already (the CPU last ran
+// the same environment, or another thread of it), and no TLB flush is
+// pending for it, there is nothing to do, and the TLB keeps its user
+// mappings as well as the kernel's global ones.
+//
+// A CPU keeps its page directory loaded while it is idle, which keeps
+// the page directory in use after its environments are gone: the last
+// CPU to switch away from it frees it (see pgdir_free).
+//
+void
+pgdir_switch(pde_t *pgdir)
+{
+	struct CpuInfo *c = thiscpu;
+	pde_t *old = c->cpu_pgdir;
+
+	if (pgdir == old && !c->cpu_tlb_pending)
+		return;
+	c->cpu_tlb_pending = 0;		// lcr3 flushes the TLB
+	lcr3(PADDR(pgdir));
+	c->cpu_pgdir = pgdir;
+	if (c->cpu_pgdir_freed) {
+		c->cpu_pgdir_freed = 0;
+		page_decref(pa2page(PADDR(old)));
+	}
+}
+
+//
+// Drop the last environment's reference to the page directory 'pgdir',
+// whose user part is already empty.  CPUs that still have it loaded are
+// idle, or waiting for the big kernel lock, and may take interrupts on
+// it: they each hold a reference until they switch away from it.
+//
+void
+pgdir_free(pde_t *pgdir)
+{
+	struct PageInfo *pp = pa2page(PADDR(pgdir));
+	struct CpuInfo *c;
+
+	if (thiscpu->cpu_pgdir == pgdir)
+		pgdir_switch(kern_pgdir);
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c->cpu_pgdir == pgdir) {
+			c->cpu_pgdir_freed = 1;
+			pp->pp_ref++;
+		}
+	page_decref(pp);
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// If the address space is shared by several environments (threads),
+// the other CPUs running it are asked to flush their TLBs as well.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	if (!curenv || thiscpu->cpu_pgdir == pgdir)
 		invlpg(va);
+	tlb_shootdown(pgdir);
+}
+
+//
+// Make every other CPU that has 'pgdir' loaded flush its TLB.
+//
+// CPUs that are in the kernel are only marked: they flush once they get
+// the big kernel lock (which we hold), or when they switch page tables.
+// Idle CPUs keep the page directory they last ran on loaded, so they
+// are marked too, even if 'pgdir' belongs to a single environment.
+// CPUs running in user mode get a T_TLBSHOOT IPI, and we wait until
+// they have flushed, so the caller can free or reuse the page as soon
+// as we return.
+//
+void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct CpuInfo *c;
+	int sent = 0;
+
+	// The kernel's mappings only change where they weren't used yet
+	if (pgdir == kern_pgdir)
+		return;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || c->cpu_pgdir != pgdir)
+			continue;
+		c->cpu_tlb_pending = 1;
+		if (c->cpu_in_user) {
+			lapic_ipi_cpu(c->cpu_id, T_TLBSHOOT);
+			sent = 1;
+		}
+	}
+	if (!sent)
+		return;
+
+	// Wait for the CPUs in user mode to flush.  A CPU that traps
+	// into the kernel in the meantime stops being in user mode and
+	// will see cpu_tlb_pending after taking the lock.
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_tlb_pending && c->cpu_in_user)
+			asm volatile("pause");
+}
+
+//
+// Serve a TLB shootdown request on this CPU.
+// The caller acknowledges the IPI, if there was one.
+//
+void
+tlb_shootdown_ack(void)
+{
+	tlbflush();
+	thiscpu->cpu_tlb_pending = 0;
 }
 
 //
@@ -646,7 +1035,8 @@ mmio_map_region(physaddr_t pa, size_t size)
 	uintptr_t va = base + PGOFF(pa);
 
 	// Map region. va and pa page aligned. map_size multiple of size.
-	boot_map_region(kern_pgdir, va, map_size, pa, PTE_W | PTE_PCD | PTE_PWT);
+	boot_map_region(kern_pgdir, va, map_size, pa,
+			PTE_W | PTE_PCD | PTE_PWT | (pge ? PTE_G : 0));
 
 	// Update base
 	base += map_size;
@@ -891,10 +1281,15 @@ check_kern_pgdir(void)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
 	// check envs array (new test for lab 3)
-	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
+	n = ROUNDUP(nenv*sizeof(struct Env), PGSIZE);
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+	// check kernel statistics
+	n = ROUNDUP(sizeof(struct KernStats), PGSIZE);
+	for (i = 0; i < n; i += PGSIZE)
+		assert(check_va2pa(pgdir, USTATS + i) == PADDR(&kstats) + i);
+
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
@@ -945,6 +1340,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_PS_ADDR(*pgdir) + PTX(va) * PGSIZE;
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -1170,3 +1567,67 @@ check_page_installed_pgdir(void)
 
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
+
+// check page_alloc_large and 4MB mappings, with an installed kern_pgdir
+static void
+check_page_large(void)
+{
+	struct PageInfo *pp, *pp0, *fl;
+	pte_t *ptep;
+	uintptr_t va = PTSIZE;
+	int nfree = 0, n;
+
+	for (fl = page_free_list; fl; fl = fl->pp_link)
+		nfree++;
+
+	assert((pp = page_alloc_large(ALLOC_ZERO)));
+	assert(page2pa(pp) % PTSIZE == 0);
+	n = 0;
+	for (fl = page_free_list; fl; fl = fl->pp_link) {
+		assert(fl < pp || fl >= pp + NPTENTRIES);
+		n++;
+	}
+	assert(n == nfree - NPTENTRIES);
+
+	// a 4MB mapping needs no page table
+	assert(kern_pgdir[PDX(va)] == 0);
+	assert(page_insert(kern_pgdir, pp, (void *) va, PTE_W|PTE_PS) == 0);
+	assert(pp->pp_ref == 1);
+	assert(kern_pgdir[PDX(va)] & PTE_PS);
+	assert(check_va2pa(kern_pgdir, va + 5 * PGSIZE) == page2pa(pp) + 5 * PGSIZE);
+	assert(pgdir_walk(kern_pgdir, (void *) (va + 5 * PGSIZE), 0) == &kern_pgdir[PDX(va)]);
+	assert(page_lookup(kern_pgdir, (void *) (va + 5 * PGSIZE), &ptep) == pp + 5);
+	assert(ptep == &kern_pgdir[PDX(va)]);
+
+	// it is really there
+	assert(*(uint32_t *) (va + PTSIZE - 4) == 0);
+	*(uint32_t *) (va + 5 * PGSIZE) = 0x05050505U;
+	assert(*(uint32_t *) page2kva(pp + 5) == 0x05050505U);
+
+	// re-inserting changes just the permissions
+	assert(page_insert(kern_pgdir, pp, (void *) va, PTE_PS) == 0);
+	assert(pp->pp_ref == 1);
+	assert(!(kern_pgdir[PDX(va)] & PTE_W));
+
+	// removing any page of it removes all of it, and frees it
+	page_remove(kern_pgdir, (void *) (va + 7 * PGSIZE));
+	assert(kern_pgdir[PDX(va)] == 0);
+	assert(pp->pp_ref == 0);
+	n = 0;
+	for (fl = page_free_list; fl; fl = fl->pp_link)
+		n++;
+	assert(n == nfree);
+
+	// a 4MB mapping replaces the 4KB pages mapped there
+	assert((pp0 = page_alloc(0)));
+	assert(page_insert(kern_pgdir, pp0, (void *) (va + PGSIZE), PTE_W) == 0);
+	assert((pp = page_alloc_large(0)));
+	assert(page_insert(kern_pgdir, pp, (void *) va, PTE_W|PTE_PS) == 0);
+	assert(pp0->pp_ref == 0);
+	assert(check_va2pa(kern_pgdir, va + PGSIZE) == page2pa(pp) + PGSIZE);
+	page_remove(kern_pgdir, (void *) va);
+	assert(pp->pp_ref == 0);
+	assert(kern_pgdir[PDX(va)] == 0);
+
+	cprintf("check_page_large() succeeded!\n");
+}
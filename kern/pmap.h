@@ -52,16 +52,27 @@ enum {
 };
 
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+void	page_free_batch(struct PageInfo *list);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+struct PageInfo *page_alloc_large(int alloc_flags);
+void	page_free_large(struct PageInfo *pp);
+
+int	page_cow(pde_t *pgdir, void *va);
+
+void	pgdir_switch(pde_t *pgdir);
+void	pgdir_free(pde_t *pgdir);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_shootdown(pde_t *pgdir);
+void	tlb_shootdown_ack(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
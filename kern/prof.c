@@ -0,0 +1,272 @@
+// Sampling profiler.
+//
+// While it is on, each CPU takes a sample every prof_period nanoseconds
+// from its timer interrupt (timer_arm programs the LAPIC timer for the
+// next sample too): the interrupted EIP and the return addresses found
+// by following the saved frame pointers, the running environment and
+// whether it was in user mode.  Samples with the same call chain are
+// counted together in a per-CPU table, so the profiler can run for as
+// long as it likes in a fixed amount of memory.
+//
+// The kernel runs with interrupts off, so a timer interrupt that comes
+// while it is busy is only taken when it returns to user mode or goes
+// idle.  The kernel samples are therefore all of the idle loop, and
+// time spent in system calls is charged to the code that made them.
+//
+// 'prof' in the kernel monitor prints a flat profile, and 'prof dump'
+// prints the call chains for prof2flame.py to make a flame graph of.
+
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/trap.h>
+
+#include <kern/prof.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/kdebug.h>
+#include <kern/pmap.h>
+#include <kern/time.h>
+
+#define PROF_DEPTH	6	// EIPs kept per sample
+#define PROF_NSTACKS	512	// Different call chains kept per CPU
+
+struct ProfStack {
+	envid_t ps_env;			// Running environment, 0 if idle
+	bool ps_user;			// Sampled in user mode
+	uint8_t ps_depth;		// Number of EIPs in ps_eip
+	uint32_t ps_count;		// Samples with this call chain, 0 if free
+	uintptr_t ps_eip[PROF_DEPTH];	// Interrupted EIP, then its callers
+};
+
+struct ProfBuf {
+	struct ProfStack pb_stacks[PROF_NSTACKS];
+	uint32_t pb_samples;		// Samples taken
+	uint32_t pb_dropped;		// Samples that found pb_stacks full
+};
+
+static struct ProfBuf prof_bufs[NCPU];
+static unsigned int prof_hz;
+
+uint64_t prof_period;
+
+// Start profiling 'hz' times a second on every CPU, throwing away the
+// samples taken so far.
+void
+prof_start(unsigned int hz)
+{
+	uint64_t now = time_nsec();
+	int i;
+
+	memset(prof_bufs, 0, sizeof(prof_bufs));
+	for (i = 0; i < NCPU; i++)
+		cpus[i].cpu_prof_next = now;
+	prof_hz = hz;
+	prof_period = 1000000000 / hz;
+}
+
+void
+prof_stop(void)
+{
+	prof_period = 0;
+}
+
+// Read the word at 'va' into *val, if 'pgdir' maps it with 'perm'.
+static bool
+read_word(pde_t *pgdir, uintptr_t va, int perm, uintptr_t *val)
+{
+	pte_t *pte;
+
+	if (va & 3)
+		return 0;
+	pte = pgdir_walk(pgdir, (void *) va, 0);
+	if (!pte || (*pte & perm) != perm)
+		return 0;
+	*val = *(uintptr_t *) va;
+	return 1;
+}
+
+// Read a word of the interrupted stack.  In user mode that is the
+// current environment's, which is what is loaded.
+static bool
+stack_word(struct ProfStack *s, uintptr_t va, uintptr_t *val)
+{
+	if (s->ps_user)
+		return va < ULIM && read_word(curenv->env_pgdir, va, PTE_P|PTE_U, val);
+	return va >= ULIM && read_word(kern_pgdir, va, PTE_P, val);
+}
+
+static bool
+same_stack(struct ProfStack *a, struct ProfStack *b)
+{
+	return a->ps_env == b->ps_env && a->ps_user == b->ps_user
+		&& a->ps_depth == b->ps_depth
+		&& memcmp(a->ps_eip, b->ps_eip, sizeof(a->ps_eip)) == 0;
+}
+
+// Called on every timer interrupt: take a sample of what 'tf'
+// interrupted, if one is due.
+void
+prof_tick(struct Trapframe *tf)
+{
+	struct ProfBuf *pb = &prof_bufs[cpunum()];
+	struct CpuInfo *c = thiscpu;
+	struct ProfStack s, *ps;
+	uintptr_t ebp, next, eip;
+	uint64_t now;
+	uint32_t h;
+	int i;
+
+	if (!prof_period || (now = time_nsec()) < c->cpu_prof_next)
+		return;
+	c->cpu_prof_next = now + prof_period;
+
+	memset(&s, 0, sizeof(s));
+	s.ps_env = curenv ? curenv->env_id : 0;
+	s.ps_user = (tf->tf_cs & 3) == 3;
+	s.ps_eip[s.ps_depth++] = tf->tf_eip;
+
+	// Each frame starts with the caller's ebp and the return address
+	ebp = tf->tf_regs.reg_ebp;
+	while (s.ps_depth < PROF_DEPTH && ebp
+	       && stack_word(&s, ebp, &next) && stack_word(&s, ebp + 4, &eip)) {
+		s.ps_eip[s.ps_depth++] = eip;
+		// Stacks grow down, so anything else is garbage
+		if (next <= ebp)
+			break;
+		ebp = next;
+	}
+
+	h = s.ps_env;
+	for (i = 0; i < s.ps_depth; i++)
+		h = h * 31 + s.ps_eip[i];
+
+	pb->pb_samples++;
+	for (i = 0; i < PROF_NSTACKS; i++) {
+		ps = &pb->pb_stacks[(h + i) % PROF_NSTACKS];
+		if (!ps->ps_count) {
+			*ps = s;
+			ps->ps_count = 1;
+			return;
+		}
+		if (same_stack(ps, &s)) {
+			ps->ps_count++;
+			return;
+		}
+	}
+	pb->pb_dropped++;
+}
+
+//
+// Reports
+//
+
+// Flat profile entry: a kernel function, or all of an environment's
+// user mode samples, since only the host has the user programs' symbols.
+struct ProfEntry {
+	envid_t pe_env;
+	uintptr_t pe_fn;		// Kernel function address, 0 for user
+	uint32_t pe_count;
+};
+
+static struct ProfEntry prof_flat[PROF_NSTACKS];
+
+// Print the 'n' places with the most samples.
+void
+prof_print(int n)
+{
+	struct ProfStack *ps;
+	struct ProfEntry pe, *e;
+	struct Eipdebuginfo info;
+	uint32_t samples = 0, dropped = 0, other = 0;
+	int i, j, nflat = 0;
+
+	for (i = 0; i < NCPU; i++) {
+		samples += prof_bufs[i].pb_samples;
+		dropped += prof_bufs[i].pb_dropped;
+		for (j = 0; j < PROF_NSTACKS; j++) {
+			ps = &prof_bufs[i].pb_stacks[j];
+			if (!ps->ps_count)
+				continue;
+			pe.pe_env = ps->ps_env;
+			pe.pe_fn = 0;
+			pe.pe_count = ps->ps_count;
+			if (!ps->ps_user) {
+				debuginfo_eip(ps->ps_eip[0], &info);
+				pe.pe_fn = info.eip_fn_addr;
+			}
+			for (e = prof_flat; e < prof_flat + nflat; e++)
+				if (e->pe_env == pe.pe_env && e->pe_fn == pe.pe_fn)
+					break;
+			if (e < prof_flat + nflat)
+				e->pe_count += pe.pe_count;
+			else if (nflat < PROF_NSTACKS)
+				prof_flat[nflat++] = pe;
+			else
+				other += pe.pe_count;
+		}
+	}
+
+	// Most samples first
+	for (i = 1; i < nflat; i++) {
+		pe = prof_flat[i];
+		for (j = i; j > 0 && prof_flat[j - 1].pe_count < pe.pe_count; j--)
+			prof_flat[j] = prof_flat[j - 1];
+		prof_flat[j] = pe;
+	}
+
+	cprintf("%u samples at %u Hz, %u dropped%s\n", samples, prof_hz,
+		dropped, prof_period ? "" : " (stopped)");
+	if (!samples)
+		return;
+	cprintf(" samples      %%  where\n");
+	for (i = 0; i < nflat && i < n; i++) {
+		e = &prof_flat[i];
+		cprintf("%8u %3u.%u%%  ", e->pe_count,
+			e->pe_count * 100 / samples,
+			e->pe_count * 1000 / samples % 10);
+		if (!e->pe_fn)
+			cprintf("env %08x (user)\n", e->pe_env);
+		else {
+			debuginfo_eip(e->pe_fn, &info);
+			cprintf("%.*s", info.eip_fn_namelen, info.eip_fn_name);
+			if (e->pe_env)
+				cprintf(" (env %08x)", e->pe_env);
+			cprintf("\n");
+		}
+	}
+	for (; i < nflat; i++)
+		other += prof_flat[i].pe_count;
+	if (other)
+		cprintf("%8u          elsewhere\n", other);
+}
+
+// Print every call chain on a line of its own,
+//	PROF <cpu> <env> <k|u> <count> <eip> <caller> <caller's caller> ...
+// between a "PROF BEGIN" and a "PROF END" line.  prof2flame.py reads
+// them from the serial console output.
+void
+prof_dump(void)
+{
+	struct ProfStack *ps;
+	uint32_t samples = 0, dropped = 0;
+	int i, j, k;
+
+	cprintf("PROF BEGIN %u Hz\n", prof_hz);
+	for (i = 0; i < NCPU; i++) {
+		samples += prof_bufs[i].pb_samples;
+		dropped += prof_bufs[i].pb_dropped;
+		for (j = 0; j < PROF_NSTACKS; j++) {
+			ps = &prof_bufs[i].pb_stacks[j];
+			if (!ps->ps_count)
+				continue;
+			cprintf("PROF %d %08x %c %u", i, ps->ps_env,
+				ps->ps_user ? 'u' : 'k', ps->ps_count);
+			for (k = 0; k < ps->ps_depth; k++)
+				cprintf(" %08x", ps->ps_eip[k]);
+			cprintf("\n");
+		}
+	}
+	cprintf("PROF END %u samples %u dropped\n", samples, dropped);
+}
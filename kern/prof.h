@@ -0,0 +1,23 @@
+#ifndef JOS_KERN_PROF_H
+#define JOS_KERN_PROF_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Trapframe;
+
+// Default sampling rate, ten times the scheduler's
+#define PROF_HZ_DEFAULT	1000
+
+// Nanoseconds between samples, 0 if the profiler is off
+extern uint64_t prof_period;
+
+void prof_start(unsigned int hz);
+void prof_stop(void);
+void prof_tick(struct Trapframe *tf);
+void prof_print(int n);
+void prof_dump(void);
+
+#endif /* JOS_KERN_PROF_H */
@@ -4,6 +4,9 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/cpu.h>
+#include <kern/time.h>
+#include <kern/trace.h>
 
 void sched_halt(void);
 
@@ -18,6 +21,8 @@ sched_yield(void)
 	// Search through 'envs' for an ENV_RUNNABLE environment in
 	// circular fashion starting just after the env this CPU was
 	// last running.  Switch to the first such environment found.
+	// Only the allocated environments are looked at, going around
+	// env_ring, so how long this takes doesn't depend on 'nenv'.
 	//
 	// If no envs are runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
@@ -31,14 +36,11 @@ sched_yield(void)
 	// LAB 4: Your code here.
 	//cprintf("DEBUG-SCHED: CPU %d - In scheduler, curenv = %p\n", cpunum(), curenv);
 	struct Env *e;
+
+	// Whatever we pick gets a new time slice
+	thiscpu->cpu_slice_end = 0;
 	if (curenv) {
-		for (e = curenv + 1; e < envs + NENV; e++) {
-			if (e->env_status == ENV_RUNNABLE) {
-				//cprintf("DEBUG-SCHED: CPU %d: going to run env %p\n", cpunum(), e);
-				env_run(e);
-			}
-		}
-		for (e = envs; e < curenv; e++) {
+		for (e = curenv->env_next; e != curenv; e = e->env_next) {
 			if (e->env_status == ENV_RUNNABLE) {
 				//cprintf("DEBUG-SCHED: CPU %d: going to run env %p\n", cpunum(), e);
 				env_run(e);
@@ -49,13 +51,13 @@ sched_yield(void)
 			//cprintf("DEBUG-SCHED: CPU %d: going to run env %p\n", cpunum(), curenv);
 			env_run(curenv);
 		}
-	} else {
-		for (e = envs; e < envs + NENV; e++) {
+	} else if ((e = env_ring)) {
+		do {
 			if (e->env_status == ENV_RUNNABLE) {
 				//cprintf("DEBUG-SCHED: CPU %d: going to run env %p\n", cpunum(), e);
 				env_run(e);
 			}
-		}
+		} while ((e = e->env_next) != env_ring);
 	}
 
 	// sched_halt never returns
@@ -63,31 +65,74 @@ sched_yield(void)
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// An environment just became runnable, or there is work for idle CPUs
+// (see env_reclaim): wake up a halted CPU, if there is one, so it
+// doesn't wait for its next timer interrupt to get to it.
+// Must be called with the big kernel lock held, which keeps CPUs from
+// changing in or out of the halted state under us.
+void
+sched_wakeup(void)
+{
+	static int next;
+	int i, c;
+
+	// Rotate through the halted CPUs, so that several wakeups in a
+	// row don't all go to the same CPU
+	for (i = 0; i < ncpu; i++) {
+		c = (next + i) % ncpu;
+		if (&cpus[c] != thiscpu && cpus[c].cpu_status == CPU_HALTED) {
+			next = c + 1;
+			lapic_ipi_cpu(cpus[c].cpu_id, T_RESCHED);
+			return;
+		}
+	}
+}
+
+// Halt this CPU when there is nothing to do. Wait until a timer
+// interrupt or a reschedule IPI wakes it up. This function never returns.
 //
 void
 sched_halt(void)
 {
-	int i;
+	struct Env *e;
+	bool busy = 0;
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
-			break;
+	if ((e = env_ring)) {
+		do {
+			if ((e->env_status == ENV_RUNNABLE ||
+			     e->env_status == ENV_RUNNING ||
+			     e->env_status == ENV_DYING ||
+			     e->env_sleep_until)) {
+				busy = 1;
+				break;
+			}
+		} while ((e = e->env_next) != env_ring);
 	}
-	if (i == NENV) {
+	if (!busy) {
+		env_reclaim(-1);
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on this CPU
+	// Mark that no environment is running on this CPU.  Its address
+	// space stays loaded: if it runs here again next, env_run has
+	// nothing to switch (see pgdir_switch).
 	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	trace(TRACE_SCHED, TR_IDLE, 0, 0);
+
+	// Put the idle time to use tearing down the address spaces of
+	// freed environments (see env_free), a slice at a time.  If there
+	// is more, a reschedule IPI to ourselves brings us back through
+	// trap() as soon as interrupts are on, which leaves the big kernel
+	// lock free for the other CPUs in between.
+	if (env_reclaim(ENV_RECLAIM_SLICE))
+		lapic_ipi_cpu(thiscpu->cpu_id, T_RESCHED);
+
+	// Only wake up for the sleeping environments of this CPU
+	timer_arm(0);
 
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
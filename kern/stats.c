@@ -0,0 +1,40 @@
+// Statistics for user programs to read; see inc/stats.h.
+// Everything here is updated with the big kernel lock held.
+
+#include <inc/mmu.h>
+
+#include <kern/stats.h>
+#include <kern/env.h>
+
+struct KernStats kstats __attribute__ ((aligned(PGSIZE)));
+
+// Count a time of 'cycles' in 'h'.
+void
+histogram_add(struct Histogram *h, uint64_t cycles)
+{
+	int i = 0;
+
+	while (i < NHISTBUCKETS - 1 && cycles >= (2ULL << i))
+		i++;
+	h->h_count++;
+	h->h_cycles += cycles;
+	h->h_buckets[i]++;
+}
+
+// The current environment's system call 'syscallno' took 'cycles'.
+void
+stats_syscall(uint32_t syscallno, uint64_t cycles)
+{
+	curenv->env_stats.es_cycles += cycles;
+	if (syscallno < NSYSCALLS)
+		histogram_add(&kstats.ks_syscalls[syscallno], cycles);
+}
+
+// The kernel took 'cycles' for a page fault of the current environment.
+void
+stats_pgfault(uint64_t cycles)
+{
+	curenv->env_stats.es_cycles += cycles;
+	curenv->env_stats.es_pgfaults++;
+	histogram_add(&kstats.ks_pgfaults, cycles);
+}
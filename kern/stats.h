@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_STATS_H
+#define JOS_KERN_STATS_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/stats.h>
+
+// Mapped read-only at USTATS
+extern struct KernStats kstats;
+
+void histogram_add(struct Histogram *h, uint64_t cycles);
+void stats_syscall(uint32_t syscallno, uint64_t cycles);
+void stats_pgfault(uint64_t cycles);
+
+#endif /* !JOS_KERN_STATS_H */
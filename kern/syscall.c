@@ -13,6 +13,7 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/trace.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -27,7 +28,7 @@ sys_cputs(const char *s, size_t len)
 	user_mem_assert(curenv, s, len, 0);
 
 	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	cons_user_write(s, len);
 }
 
 // Read a character from the system console without blocking.
@@ -98,6 +99,44 @@ sys_exofork(void)
 	// eax holds the return value of the system call, so just make it zero.
 	e->env_tf.tf_regs.reg_eax = 0;
 
+	// The child inherits the way copy-on-write faults are handled
+	e->env_kern_cow = curenv->env_kern_cow;
+
+	return e->env_id;
+}
+
+// Create a new environment that shares the caller's address space: a
+// thread.  It starts running at 'eip' with stack pointer 'esp', and its
+// page fault upcalls use the exception stack ending at 'uxstacktop'.
+// The thread inherits the caller's page fault upcall, copy-on-write mode,
+// type and I/O privileges, and is runnable right away.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_INVAL if eip, esp or uxstacktop is not below UTOP,
+//		or uxstacktop is not page-aligned.
+//	-E_NO_FREE_ENV if no free environment is available.
+static envid_t
+sys_sfork(uintptr_t eip, uintptr_t esp, uintptr_t uxstacktop)
+{
+	struct Env *e;
+	int error;
+
+	if (eip >= UTOP || esp > UTOP || uxstacktop > UTOP ||
+	    uxstacktop % PGSIZE)
+		return -E_INVAL;
+
+	if ((error = env_alloc_shared(&e, curenv)) < 0)
+		return error;
+
+	e->env_type = curenv->env_type;
+	e->env_tf.tf_eip = eip;
+	e->env_tf.tf_esp = esp;
+	e->env_tf.tf_eflags |= curenv->env_tf.tf_eflags & FL_IOPL_MASK;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	e->env_kern_cow = curenv->env_kern_cow;
+	e->env_uxstacktop = uxstacktop;
+	sched_wakeup();
+
 	return e->env_id;
 }
 
@@ -132,6 +171,11 @@ sys_env_set_status(envid_t envid, int status)
 
 	// Set the environment status
 	e->env_status = status;
+	if (status == ENV_RUNNABLE) {
+		// Cut its sleep short, if it was sleeping
+		timer_cancel(e);
+		sched_wakeup();
+	}
 	return 0;
 }
 
@@ -193,6 +237,31 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	return 0;
 }
 
+// Ask the kernel to resolve copy-on-write faults of 'envid' itself
+// (enable != 0), or to deliver them to the page fault upcall like any
+// other fault (enable == 0).  When enabled, a write fault on a PTE_COW
+// page is fixed up in page_fault_handler by copying the page, or by just
+// making it writable again if nobody else maps it, and the upcall only
+// sees faults that are not copy-on-write.  Children created with
+// sys_exofork inherit the setting.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+static int
+sys_env_set_kern_cow(envid_t envid, int enable)
+{
+	// Tries to retrieve the environment
+	struct Env *e;
+	envid2env(envid, &e, 1);
+	if (!e) {
+		return -E_BAD_ENV;
+	}
+
+	e->env_kern_cow = (enable != 0);
+	return 0;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -202,11 +271,18 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
 //
+// With PTE_PS in perm, a 4MB page is allocated instead, and mapped at
+// the 4MB-aligned 'va' with a single page directory entry.  Whatever
+// was mapped in the 4MB range is unmapped.  It can then only be mapped
+// elsewhere whole (see sys_page_map), and unmapping any page of it
+// unmaps all of it.
+//
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
 //	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if perm has PTE_PS and va is not 4MB-aligned.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
@@ -227,8 +303,13 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 		return -E_BAD_ENV;
 	}
 
+	// Asking for a 4MB page?
+	int large = perm & PTE_PS;
+	perm &= ~PTE_PS;
+
 	// Checks if va is as expected
-	if (((uint32_t)va >= UTOP) || ((uint32_t) va)%PGSIZE != 0) {
+	if (((uint32_t)va >= UTOP) || ((uint32_t) va)%PGSIZE != 0 ||
+	    (large && ((uint32_t) va)%PTSIZE != 0)) {
 		return -E_INVAL;
 	}
 
@@ -239,20 +320,75 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	}
 
 	// Tries to allocate a physical page
-	struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+	struct PageInfo *pp = large ? page_alloc_large(ALLOC_ZERO)
+				    : page_alloc(ALLOC_ZERO);
 	if (!pp) {
 		return -E_NO_MEM;
 	}
 
 	// Tries to map the physical page at va
-	int error = page_insert(e->env_pgdir, pp, va, perm);
+	int error = page_insert(e->env_pgdir, pp, va, perm | large);
 	if (error < 0) {
-		page_free(pp);
+		if (large)
+			page_free_large(pp);
+		else
+			page_free(pp);
 		return -E_NO_MEM;
 	}
 	return 0;
 }
 
+// Allocate and map the 'len / PGSIZE' pages starting at 'va' in the
+// address space of 'envid', all with permission 'perm', in one system call.
+// This is the batched version of sys_page_alloc used by malloc for large
+// allocations.  The pages' contents are set to 0.  Pages already mapped in
+// the range are unmapped as a side effect.
+//
+// Return 0 on success, < 0 on error.  Errors are as for sys_page_alloc,
+// plus:
+//	-E_INVAL if len is not a multiple of PGSIZE, or [va, va+len) does
+//		not lie below UTOP.
+// On error, no page in the range is left mapped by this call.
+static int
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
+{
+	// Tries to retrieve the environment
+	struct Env *e;
+	envid2env(envid, &e, 1);
+	if (!e) {
+		return -E_BAD_ENV;
+	}
+
+	// Checks if the range is as expected (careful with overflow)
+	uint32_t start = (uint32_t) va;
+	if (start % PGSIZE != 0 || len % PGSIZE != 0 ||
+	    start >= UTOP || len > UTOP - start) {
+		return -E_INVAL;
+	}
+
+	// Checks if permission is appropiate
+	if ((perm & (~PTE_SYSCALL)) != 0 ||
+	    (perm & (PTE_U | PTE_P)) == 0) {
+		return -E_INVAL;
+	}
+
+	// Allocate and map each page, undoing everything on failure
+	uint32_t off;
+	for (off = 0; off < len; off += PGSIZE) {
+		struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+		if (!pp || page_insert(e->env_pgdir, pp, (void *) (start + off), perm) < 0) {
+			if (pp)
+				page_free(pp);
+			while (off > 0) {
+				off -= PGSIZE;
+				page_remove(e->env_pgdir, (void *) (start + off));
+			}
+			return -E_NO_MEM;
+		}
+	}
+	return 0;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -268,6 +404,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is in a 4MB page, and srcva or dstva is not
+//		4MB-aligned: 4MB pages are mapped whole, as 4MB pages.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -315,6 +453,13 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_INVAL;
 	}
 
+	// A 4MB page goes whole
+	if (*pte & PTE_PS) {
+		if (((uint32_t) srcva)%PTSIZE != 0 || ((uint32_t) dstva)%PTSIZE != 0)
+			return -E_INVAL;
+		perm |= PTE_PS;
+	}
+
 	// Tries to map the physical page at dstva on dstenv address space
 	// Fails if there is no memory to allocate a page table, if needed
 	int error = page_insert(dstenv->env_pgdir, pp, dstva, perm);
@@ -326,6 +471,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
 // If no page is mapped, the function silently succeeds.
+// If 'va' is in a 4MB page, all of the 4MB page is unmapped.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -387,7 +533,7 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
-//		address space.
+//		address space, or is in a 4MB page.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
@@ -403,8 +549,11 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		return -E_BAD_ENV;
 	}
 
-	// Checks if the receiver is receiving
-	if (!e->env_ipc_recving) {
+	// Checks if the receiver is receiving, from us
+	if (!e->env_ipc_recving ||
+	    (e->env_ipc_recv_from && e->env_ipc_recv_from != curenv->env_id)) {
+		curenv->env_stats.es_ipc_not_recv++;
+		trace(TRACE_IPC, TR_IPC_SEND, envid, -E_IPC_NOT_RECV);
 		return -E_IPC_NOT_RECV;
 	}
 
@@ -425,7 +574,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		// If srcva is not mapped in srcenv address space, pp is null
 		pte_t *pte;
 		struct PageInfo *pp = page_lookup(curenv->env_pgdir, srcva, &pte);
-		if (!pp) {
+		if (!pp || (*pte & PTE_PS)) {	// 4MB pages can't be sent
 			return -E_INVAL;
 		}
 
@@ -453,9 +602,16 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	e->env_ipc_recving = 0;
 	e->env_ipc_from = curenv->env_id;
 	e->env_ipc_value = value;
-
-	// The receiver has successfully received. Make it runnable
+	curenv->env_stats.es_ipc_sent++;
+	e->env_stats.es_ipc_recvd++;
+	trace(TRACE_IPC, TR_IPC_SEND, e->env_id, 0);
+
+	// The receiver has successfully received. Make it runnable,
+	// on another CPU if one is idle, and cut short its timeout if
+	// it had one
+	timer_cancel(e);
 	e->env_status = ENV_RUNNABLE;
+	sched_wakeup();
 	return 0;
 }
 
@@ -481,7 +637,9 @@ sys_ipc_recv(void *dstva)
 
 	// Record that you want to receive
 	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_recv_from = 0;
 	curenv->env_ipc_dstva = dstva;
+	trace(TRACE_IPC, TR_IPC_RECV, 0, 0);
 
 	// Put the return value manually, since this never returns
 	curenv->env_tf.tf_regs.reg_eax = 0;
@@ -492,6 +650,60 @@ sys_ipc_recv(void *dstva)
 	return 0;
 }
 
+// Like sys_ipc_recv, but give up when time_nsec() reaches 'deadline'.
+//
+// Returns 0 if a value was received, and -E_TIMEOUT if the deadline
+// passed first (right away if it has already passed).
+static int
+sys_ipc_recv_until(void *dstva, uint64_t deadline)
+{
+	if (((uint32_t) dstva < UTOP) &&  (((uint32_t) dstva) % PGSIZE != 0))
+		return -E_INVAL;
+	if (deadline <= time_nsec())
+		return -E_TIMEOUT;
+
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_recv_from = 0;
+	curenv->env_ipc_dstva = dstva;
+	trace(TRACE_IPC, TR_IPC_RECV, 0, 0);
+
+	// Put the return value manually, since this never returns.
+	// timer_expire changes it if nobody sends before the deadline.
+	curenv->env_tf.tf_regs.reg_eax = 0;
+
+	timer_sleep(curenv, deadline);
+	sched_yield();
+	return 0;
+}
+
+// Like sys_ipc_recv, but only accept a value from environment 'from'.
+// Anyone else trying to send gets -E_IPC_NOT_RECV meanwhile, as if we
+// weren't receiving.
+//
+// Returns < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if 'from' is 0.
+static int
+sys_ipc_recv_from(void *dstva, envid_t from)
+{
+	if (((uint32_t) dstva < UTOP) &&  (((uint32_t) dstva) % PGSIZE != 0))
+		return -E_INVAL;
+	if (from == 0)
+		return -E_INVAL;
+
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_recv_from = from;
+	curenv->env_ipc_dstva = dstva;
+	trace(TRACE_IPC, TR_IPC_RECV, from, 0);
+
+	// Put the return value manually, since this never returns
+	curenv->env_tf.tf_regs.reg_eax = 0;
+
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+	return 0;
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -500,11 +712,42 @@ sys_time_msec(void)
 	return time_msec();
 }
 
+// Store the current time, in nanoseconds since boot, in *time_store.
+//
+// Returns 0.  The environment is destroyed if time_store is not writable.
+static int
+sys_time_nsec(uint64_t *time_store)
+{
+	user_mem_assert(curenv, time_store, sizeof(uint64_t), PTE_U | PTE_W);
+	*time_store = time_nsec();
+	return 0;
+}
+
+// Block until the time, in nanoseconds since boot (see sys_time_nsec),
+// reaches 'deadline'.  The environment sleeps on this CPU's timer queue,
+// so no CPU has to poll for it.
+//
+// Returns 0, right away if the deadline has already passed.
+static int
+sys_sleep_until(uint64_t deadline)
+{
+	if (deadline <= time_nsec())
+		return 0;
+
+	// Put the return value manually, since this never returns
+	curenv->env_tf.tf_regs.reg_eax = 0;
+
+	timer_sleep(curenv, deadline);
+	sched_yield();
+	return 0;
+}
+
 // Asks the driver to transmit a packet. The packet may be dropped if
 // E1000 transmission ring is full, but it still counts as success.
+// If 'csum' is not null, it tells the E1000 which checksums to fill in.
 // Returns 0 on success, -E_INVAL if invalid arguments
 static int
-sys_transmit_packet(void *buf, size_t size) {
+sys_transmit_packet(void *buf, size_t size, struct nic_csum *csum) {
 	// Check arguments
 	// buf should be in user space
 	if (!buf || ((uint32_t) buf) > UTOP)
@@ -512,20 +755,27 @@ sys_transmit_packet(void *buf, size_t size) {
 	// size should not exceed the maximum
 	if (size > MAX_PACKET_SIZE)
 		return -E_INVAL;
+	// csum is optional, but should be in user space too
+	if (((uint32_t) csum) > UTOP)
+		return -E_INVAL;
 
-	transmit_packet(buf, size);
+	transmit_packet(buf, size, csum);
 	return 0;
 }
 
+// Receives a packet, if there is one.  If 'csum_store' is not null, it
+// is told which checksums of the packet the E1000 already verified.
 static int
-sys_receive_packet(void *buf, size_t *size_store) {
+sys_receive_packet(void *buf, size_t *size_store, struct nic_csum *csum_store) {
 	// Check pointers provided by user
 	if (!buf || ((uint32_t) buf) > UTOP)
 		return -E_INVAL;
 	if (!size_store || ((uint32_t) size_store) > UTOP)
 		return -E_INVAL;
+	if (((uint32_t) csum_store) > UTOP)
+		return -E_INVAL;
 
-	receive_packet(buf, size_store);
+	receive_packet(buf, size_store, csum_store);
 	return 0;
 }
 
@@ -542,6 +792,70 @@ sys_get_mac_address(void *buf) {
 	return 0;
 }
 
+// Trace the events of the categories in 'mask' from now on (see
+// inc/trace.h).  If 'drain' is set, first write out what was traced so
+// far over the serial port, which empties the trace buffers.
+//
+// Returns the categories traced before, or -E_INVAL if 'mask' has bits
+// of no category.
+static int
+sys_trace(uint32_t mask, int drain)
+{
+	uint32_t old = trace_mask;
+
+	if (mask & ~TRACE_ALL)
+		return -E_INVAL;
+	if (drain)
+		trace_drain();
+	trace_mask = mask;
+	return old;
+}
+
+// Copy the service name 'name', 'len' bytes long, from user space into
+// 'buf', SERVICE_NAMELEN bytes long, and null-terminate it.
+// Returns 0 on success, -E_INVAL if the name is too long or empty.
+static int
+copy_service_name(char *buf, const char *name, size_t len)
+{
+	if (len == 0 || len >= SERVICE_NAMELEN)
+		return -E_INVAL;
+	user_mem_assert(curenv, name, len, PTE_U);
+	memmove(buf, name, len);
+	buf[len] = '\0';
+	return 0;
+}
+
+// Register the calling environment as the service called 'name' (of
+// length 'len'), for other environments to find with
+// sys_service_lookup.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the name is too long, or taken by another environment.
+//	-E_NO_MEM if there are too many services.
+static int
+sys_service_register(const char *name, size_t len)
+{
+	char buf[SERVICE_NAMELEN];
+	int r;
+
+	if ((r = copy_service_name(buf, name, len)) < 0)
+		return r;
+	return service_register(buf, curenv);
+}
+
+// Returns the envid of the service called 'name' (of length 'len'),
+// or -E_NOT_FOUND if there is none.
+static envid_t
+sys_service_lookup(const char *name, size_t len)
+{
+	char buf[SERVICE_NAMELEN];
+	int r;
+
+	if ((r = copy_service_name(buf, name, len)) < 0)
+		return r;
+	return service_lookup(buf);
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -551,6 +865,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// LAB 3: Your code here.
 	int32_t ret = 0;
 
+	if (syscallno < NSYSCALLS)
+		curenv->env_stats.es_syscalls[syscallno]++;
+
 	switch (syscallno) {
 	case SYS_cputs:
 		//cprintf("DEBUG-SYSCALL: Calling sys_cputs!\n");
@@ -617,16 +934,60 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		break;
 	case SYS_transmit_packet:
 		//cprintf("DEBUG-SYSCALL: Calling sys_transmit_packet!\n");
-		ret = (int32_t) sys_transmit_packet((void *) a1, (size_t) a2);
+		ret = (int32_t) sys_transmit_packet((void *) a1, (size_t) a2,
+						    (struct nic_csum *) a3);
 		break;
 	case SYS_receive_packet:
 		//cprintf("DEBUG-SYSCALL: Calling sys_receive_packet!\n");
-		ret = (int32_t) sys_receive_packet((void *) a1, (size_t *) a2);
+		ret = (int32_t) sys_receive_packet((void *) a1, (size_t *) a2,
+						   (struct nic_csum *) a3);
 		break;
 	case SYS_get_mac_address:
 		//cprintf("DEBUG-SYSCALL: Calling sys_get_mac_address!\n");
 		ret = (int32_t) sys_get_mac_address((void *) a1);
 		break;
+	case SYS_sfork:
+		//cprintf("DEBUG-SYSCALL: Calling sys_sfork!\n");
+		ret = (int32_t) sys_sfork(a1, a2, a3);
+		break;
+	case SYS_time_nsec:
+		//cprintf("DEBUG-SYSCALL: Calling sys_time_nsec!\n");
+		ret = (int32_t) sys_time_nsec((uint64_t *) a1);
+		break;
+	case SYS_sleep_until:
+		//cprintf("DEBUG-SYSCALL: Calling sys_sleep_until!\n");
+		ret = (int32_t) sys_sleep_until(((uint64_t) a2 << 32) | a1);
+		break;
+	case SYS_ipc_recv_until:
+		//cprintf("DEBUG-SYSCALL: Calling sys_ipc_recv_until!\n");
+		ret = (int32_t) sys_ipc_recv_until((void *) a1,
+						   ((uint64_t) a3 << 32) | a2);
+		break;
+	case SYS_ipc_recv_from:
+		//cprintf("DEBUG-SYSCALL: Calling sys_ipc_recv_from!\n");
+		ret = (int32_t) sys_ipc_recv_from((void *) a1, (envid_t) a2);
+		break;
+	case SYS_env_set_kern_cow:
+		//cprintf("DEBUG-SYSCALL: Calling sys_env_set_kern_cow!\n");
+		ret = (int32_t) sys_env_set_kern_cow((envid_t) a1, (int) a2);
+		break;
+	case SYS_page_alloc_range:
+		//cprintf("DEBUG-SYSCALL: Calling sys_page_alloc_range!\n");
+		ret = (int32_t) sys_page_alloc_range((envid_t) a1, (void *) a2,
+						     (size_t) a3, (int) a4);
+		break;
+	case SYS_trace:
+		//cprintf("DEBUG-SYSCALL: Calling sys_trace!\n");
+		ret = (int32_t) sys_trace(a1, (int) a2);
+		break;
+	case SYS_service_register:
+		//cprintf("DEBUG-SYSCALL: Calling sys_service_register!\n");
+		ret = (int32_t) sys_service_register((const char *) a1, (size_t) a2);
+		break;
+	case SYS_service_lookup:
+		//cprintf("DEBUG-SYSCALL: Calling sys_service_lookup!\n");
+		ret = (int32_t) sys_service_lookup((const char *) a1, (size_t) a2);
+		break;
 	default:
 		return -E_INVAL;
 	}
@@ -1,26 +1,161 @@
 #include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/prof.h>
+#include <kern/stats.h>
 #include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
 
-static unsigned int ticks;
+// Time is kept by the TSC, calibrated against the 8254 PIT at boot.
+//
+// Timer interrupts come from the LAPIC timer, programmed one-shot for
+// the next event of each CPU: the end of the running environment's time
+// slice, or the earliest deadline in the CPU's sleep queue.  An idle CPU
+// with nobody to wake up gets no timer interrupts at all.
+
+#define PIT_HZ		1193182		// 8254 input clock
+#define CALIBRATE_MS	50
+
+static uint64_t tsc_hz;		// TSC ticks per second
+static uint64_t tsc_boot;	// TSC value at time 0
+
+// Count TSC ticks while PIT channel 2 counts down for CALIBRATE_MS.
+// Channel 2 is gated through port 0x61, which also tells when its
+// output goes high at the end of the count.
+static uint64_t
+tsc_calibrate(void)
+{
+	uint32_t latch = PIT_HZ * CALIBRATE_MS / 1000;
+	uint64_t start;
+
+	outb(0x61, (inb(0x61) & ~0x02) | 0x01);	// gate on, speaker off
+	outb(0x43, 0xb0);			// channel 2, mode 0, lo/hi byte
+	outb(0x42, latch & 0xff);
+	outb(0x42, latch >> 8);
+	start = read_tsc();
+	while (!(inb(0x61) & 0x20))
+		;
+	return (read_tsc() - start) * 1000 / CALIBRATE_MS;
+}
 
 void
 time_init(void)
 {
-	ticks = 0;
+	tsc_hz = tsc_calibrate();
+	tsc_boot = read_tsc();
+	kstats.ks_tsc_hz = tsc_hz;
+	lapic_timer_calibrate(tsc_hz);
+	cprintf("time: TSC %u MHz\n", (uint32_t) (tsc_hz / 1000000));
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
-void
-time_tick(void)
+// Nanoseconds since boot
+uint64_t
+time_nsec(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	uint64_t t = read_tsc() - tsc_boot;
+
+	// Split the conversion so it can't overflow
+	return t / tsc_hz * 1000000000ULL + t % tsc_hz * 1000000000ULL / tsc_hz;
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return time_nsec() / 1000000;
+}
+
+//
+// Per-CPU sleep queues, kept sorted by deadline.
+// A sleeping environment is on the queue of the CPU it last ran on
+// (env_cpunum), and has a nonzero env_sleep_until.
+//
+
+// Put 'e', which must be the current environment, to sleep until
+// time_nsec() reaches 'deadline'.
+void
+timer_sleep(struct Env *e, uint64_t deadline)
+{
+	struct Env **pp;
+
+	assert(e == curenv && deadline > 0);
+	e->env_status = ENV_NOT_RUNNABLE;
+	e->env_sleep_until = deadline;
+	pp = &thiscpu->cpu_sleepq;
+	while (*pp && (*pp)->env_sleep_until <= deadline)
+		pp = &(*pp)->env_sleep_link;
+	e->env_sleep_link = *pp;
+	*pp = e;
+}
+
+// Take 'e' off its sleep queue, if it is sleeping.
+void
+timer_cancel(struct Env *e)
+{
+	struct Env **pp;
+
+	if (!e->env_sleep_until)
+		return;
+	for (pp = &cpus[e->env_cpunum].cpu_sleepq; *pp; pp = &(*pp)->env_sleep_link)
+		if (*pp == e) {
+			*pp = e->env_sleep_link;
+			break;
+		}
+	e->env_sleep_until = 0;
+	e->env_sleep_link = NULL;
+}
+
+// Called on every timer interrupt: make the environments whose deadline
+// has passed runnable again.
+void
+timer_expire(void)
+{
+	struct CpuInfo *c = thiscpu;
+	uint64_t now = time_nsec();
+	struct Env *e;
+
+	c->cpu_timer_armed = 0;
+	while ((e = c->cpu_sleepq) && e->env_sleep_until <= now) {
+		c->cpu_sleepq = e->env_sleep_link;
+		e->env_sleep_until = 0;
+		e->env_sleep_link = NULL;
+		// A timed IPC receive that nobody sent to
+		if (e->env_ipc_recving) {
+			e->env_ipc_recving = 0;
+			e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+		}
+		e->env_status = ENV_RUNNABLE;
+		// If we are idle we'll run it ourselves
+		if (curenv)
+			sched_wakeup();
+	}
+}
+
+// Program this CPU's timer for its next event.  'slice_end' is the end
+// of the running environment's time slice, or 0 if the CPU goes idle.
+// The profiler, when on, wants a sample every prof_period too.
+void
+timer_arm(uint64_t slice_end)
+{
+	struct CpuInfo *c = thiscpu;
+	uint64_t deadline = slice_end, now;
+
+	if (c->cpu_sleepq && (!deadline || c->cpu_sleepq->env_sleep_until < deadline))
+		deadline = c->cpu_sleepq->env_sleep_until;
+	if (prof_period && (!deadline || c->cpu_prof_next < deadline))
+		deadline = c->cpu_prof_next;
+
+	// Most kernel exits don't change anything
+	if (deadline == c->cpu_timer_armed)
+		return;
+	c->cpu_timer_armed = deadline;
+
+	if (!deadline) {
+		lapic_timer_stop();
+		return;
+	}
+	now = time_nsec();
+	lapic_timer_oneshot(deadline > now ? deadline - now : 0);
 }
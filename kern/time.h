@@ -4,8 +4,20 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Env;
+
+// Length of the time slice given to an environment by the scheduler
+#define TIME_SLICE_NSEC	10000000
+
 void time_init(void);
-void time_tick(void);
+uint64_t time_nsec(void);
 unsigned int time_msec(void);
 
+void timer_sleep(struct Env *e, uint64_t deadline);
+void timer_cancel(struct Env *e);
+void timer_expire(void);
+void timer_arm(uint64_t slice_end);
+
 #endif /* JOS_KERN_TIME_H */
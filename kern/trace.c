@@ -0,0 +1,112 @@
+// Kernel event tracing; see inc/trace.h.
+//
+// Each CPU has a ring of the last TRACE_NREC events it recorded, which
+// only it writes to, so recording takes no lock and never waits.  When
+// events come faster than the ring is drained the oldest are lost, and
+// counted.
+//
+// trace_drain writes the rings out to the serial port only, as
+//	TRACE BEGIN <TSC Hz>
+//	TRACE LOST <cpu> <events lost>
+//	TRACE <hex bytes of a struct TraceRec>
+//	...
+//	TRACE END
+// for trace2json.py to read from the serial output.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/trace.h>
+#include <kern/console.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/stats.h>
+
+#define TRACE_NREC	2048
+
+struct TraceBuf {
+	struct TraceRec tb_recs[TRACE_NREC];
+	uint32_t tb_head;		// Events recorded
+	uint32_t tb_tail;		// Events drained, or lost
+};
+
+static struct TraceBuf trace_bufs[NCPU];
+
+uint32_t trace_mask;
+
+void
+trace_record(int type, uint32_t arg0, uint32_t arg1)
+{
+	int cpu = cpunum();
+	struct TraceBuf *tb = &trace_bufs[cpu];
+	struct TraceRec *r = &tb->tb_recs[tb->tb_head++ % TRACE_NREC];
+
+	r->tr_tsc = read_tsc();
+	r->tr_type = type;
+	r->tr_cpu = cpu;
+	r->tr_pad = 0;
+	r->tr_env = curenv ? curenv->env_id : 0;
+	r->tr_arg[0] = arg0;
+	r->tr_arg[1] = arg1;
+}
+
+// Write out and empty every CPU's ring.  The other CPUs only record
+// events with the big kernel lock held, like we are now.
+void
+trace_drain(void)
+{
+	static const char hex[] = "0123456789abcdef";
+	char line[8 + 2 * sizeof(struct TraceRec)];
+	struct TraceBuf *tb;
+	const uint8_t *p;
+	uint32_t lost;
+	int i, j, n;
+
+	n = snprintf(line, sizeof(line), "TRACE BEGIN %llu\n", kstats.ks_tsc_hz);
+	serial_write(line, n);
+	for (i = 0; i < ncpu; i++) {
+		tb = &trace_bufs[i];
+		if (tb->tb_head - tb->tb_tail > TRACE_NREC) {
+			lost = tb->tb_head - tb->tb_tail - TRACE_NREC;
+			tb->tb_tail += lost;
+			n = snprintf(line, sizeof(line), "TRACE LOST %d %u\n", i, lost);
+			serial_write(line, n);
+		}
+		for (; tb->tb_tail != tb->tb_head; tb->tb_tail++) {
+			p = (const uint8_t *) &tb->tb_recs[tb->tb_tail % TRACE_NREC];
+			memcpy(line, "TRACE ", 6);
+			n = 6;
+			for (j = 0; j < sizeof(struct TraceRec); j++) {
+				line[n++] = hex[p[j] >> 4];
+				line[n++] = hex[p[j] & 0xf];
+			}
+			line[n++] = '\n';
+			serial_write(line, n);
+		}
+	}
+	serial_write("TRACE END\n", 10);
+}
+
+// Show what is being traced, and how much is waiting to be drained.
+void
+trace_print(void)
+{
+	uint32_t n;
+	int i;
+
+	cprintf("tracing:%s%s%s%s%s%s\n",
+		trace_mask & TRACE_SCHED ? " sched" : "",
+		trace_mask & TRACE_IPC ? " ipc" : "",
+		trace_mask & TRACE_SYSCALL ? " syscall" : "",
+		trace_mask & TRACE_PGFAULT ? " pgfault" : "",
+		trace_mask & TRACE_IRQ ? " irq" : "",
+		trace_mask ? "" : " nothing");
+	for (i = 0; i < ncpu; i++) {
+		n = trace_bufs[i].tb_head - trace_bufs[i].tb_tail;
+		cprintf("  CPU %d: %u events", i, n > TRACE_NREC ? TRACE_NREC : n);
+		if (n > TRACE_NREC)
+			cprintf(", %u lost", n - TRACE_NREC);
+		cprintf("\n");
+	}
+}
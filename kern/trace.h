@@ -0,0 +1,25 @@
+#ifndef JOS_KERN_TRACE_H
+#define JOS_KERN_TRACE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/trace.h>
+
+// Categories being traced
+extern uint32_t trace_mask;
+
+void trace_record(int type, uint32_t arg0, uint32_t arg1);
+void trace_drain(void);
+void trace_print(void);
+
+// Record an event of 'category', if it is being traced.  Cheap enough
+// to leave everywhere when it isn't.
+static inline void
+trace(uint32_t category, int type, uint32_t arg0, uint32_t arg1)
+{
+	if (trace_mask & category)
+		trace_record(type, arg0, arg1);
+}
+
+#endif /* !JOS_KERN_TRACE_H */
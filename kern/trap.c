@@ -14,9 +14,21 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/prof.h>
+#include <kern/stats.h>
+#include <kern/trace.h>
 
 static struct Taskstate ts;
 
+// Model-specific registers SYSENTER loads the kernel's %cs, %esp and
+// %eip from (its %ss is the descriptor after %cs)
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
+
+// Feature bit of cpuid(1), in %edx
+#define CPUID_SEP	0x00000800	// SYSENTER and SYSEXIT
+
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
  * additional information in the latter case.
@@ -61,12 +73,19 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == T_TLBSHOOT)
+		return "TLB shootdown";
+	if (trapno == T_RESCHED)
+		return "Reschedule";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
 	return "(unknown trap)";
 }
 
 extern void* handler_syscall;
+extern void* sysenter_handler;
+extern void* handler_tlbshoot;
+extern void* handler_resched;
 extern uint32_t handlers[];
 extern uint32_t handlers_irq[];
 void
@@ -85,11 +104,25 @@ trap_init(void)
 	// For system call
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, &handler_syscall, 3);
 
+	// TLB shootdown IPIs, only sent by other CPUs
+	SETGATE(idt[T_TLBSHOOT], 0, GD_KT, &handler_tlbshoot, 0);
+
+	// Reschedule IPIs, sent to halted CPUs when work shows up
+	SETGATE(idt[T_RESCHED], 0, GD_KT, &handler_resched, 0);
+
 	// External interrupts
 	for (i = 0; i <= 15; i++) {
 		SETGATE(idt[IRQ_OFFSET + i], 0, GD_KT, handlers_irq[i],0);
 	}
 
+	// Fast system calls with SYSENTER, if the CPU has it.  The first
+	// Pentium Pros say they do, but don't (their signature is below
+	// 0x633).  The system call gate above stays for the rest.
+	uint32_t signature, features;
+	cpuid(1, &signature, NULL, NULL, &features);
+	kstats.ks_sysenter = (features & CPUID_SEP)
+		&& (signature & 0x0FFF3FFF) >= 0x633;
+
 	// Per-CPU setup 
 	trap_init_percpu();
 }
@@ -158,6 +191,13 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	// SYSENTER goes to sysenter_handler, on the same stack as traps
+	if (kstats.ks_sysenter) {
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, thiscpu->cpu_ts.ts_esp0);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t) &sysenter_handler);
+	}
 }
 
 void
@@ -206,6 +246,22 @@ print_regs(struct PushRegs *regs)
 	cprintf("  eax  0x%08x\n", regs->reg_eax);
 }
 
+// Make system call 'num', traced and timed, for either way into the
+// kernel (the T_SYSCALL gate or SYSENTER).
+static int32_t
+trap_syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+	     uint32_t a4, uint32_t a5)
+{
+	uint64_t start = read_tsc();
+	int32_t ret;
+
+	trace(TRACE_SYSCALL, TR_SYSCALL, num, a1);
+	ret = syscall(num, a1, a2, a3, a4, a5);
+	trace(TRACE_SYSCALL, TR_SYSCALL_RET, num, ret);
+	stats_syscall(num, read_tsc() - start);
+	return ret;
+}
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
@@ -214,6 +270,9 @@ trap_dispatch(struct Trapframe *tf)
 	// TODO: Start using T_* instead of interrupt numbers
 	// TODO: Use a switch
 	// TODO: Remove debugging printings
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + 16)
+		trace(TRACE_IRQ, TR_IRQ, tf->tf_trapno - IRQ_OFFSET, tf->tf_eip);
+
 	if (tf->tf_trapno == 3) {
 		//cprintf("DEBUG-TRAP: Trap dispatch - Breakpoint\n");
 		monitor(tf);
@@ -221,14 +280,29 @@ trap_dispatch(struct Trapframe *tf)
 	}
 	if (tf->tf_trapno == 14) {
 		//cprintf("DEBUG-TRAP: Trap dispatch - Page fault\n");
+		uint32_t va = rcr2();
+		trace(TRACE_PGFAULT, TR_PGFAULT, va, tf->tf_eip);
 		page_fault_handler(tf);
 		return;
 	}
+	if (tf->tf_trapno == T_TLBSHOOT) {
+		// Only reached from kernel mode, by a CPU that was halted
+		// when the IPI was delivered.
+		tlb_shootdown_ack();
+		lapic_eoi();
+		return;
+	}
+	if (tf->tf_trapno == T_RESCHED) {
+		// Nothing else to do: if we were halted, trap() will find
+		// no current environment and call the scheduler.
+		lapic_eoi();
+		return;
+	}
 	if (tf->tf_trapno == T_SYSCALL) {
 		//cprintf("DEBUG-TRAP: Trap dispatch - System Call\n");
 		struct PushRegs regs = tf->tf_regs;
 		int32_t retValue;
-		retValue = syscall(regs.reg_eax,// system call number - eax
+		retValue = trap_syscall(regs.reg_eax,// system call number - eax
 				regs.reg_edx,	// a1 - edx
 				regs.reg_ecx,	// a2 - ecx
 				regs.reg_ebx,	// a3 - ebx
@@ -257,14 +331,16 @@ trap_dispatch(struct Trapframe *tf)
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		//cprintf("DEBUG-TRAP: Trap dispatch - Clock interrupt\n");
 
-		// Since clock interrupts are triggered on every cpu, only
-		// increment time on CPU 0
-		if (cpunum() == 0)
-			time_tick();
-
-		// Acknowledge the interrupt and call the scheduler
+		// The timer is one-shot, set for this CPU's next event:
+		// either some environment has to wake up, or the running
+		// one's time slice is over, or the profiler wants a sample.
+		// Time itself comes from the TSC.
 		lapic_eoi();
-		sched_yield();
+		prof_tick(tf);
+		timer_expire();
+		if (!curenv || time_nsec() >= thiscpu->cpu_slice_end)
+			sched_yield();
+		return;
 	}
 
 	// Handle keyboard and serial interrupts.
@@ -295,15 +371,45 @@ trap_dispatch(struct Trapframe *tf)
 void
 trap(struct Trapframe *tf)
 {
+	uint64_t entered;
+
 	// The environment may have set DF and some versions
 	// of GCC rely on DF being clear
 	asm volatile("cld" ::: "cc");
+	entered = read_tsc();
 
 	// Halt the CPU if some other CPU has called panic()
 	extern char *panicstr;
 	if (panicstr)
 		asm volatile("hlt");
 
+	// SYSENTER doesn't clear TF, like an interrupt gate would, so an
+	// environment single-stepping into a system call traps on the
+	// first instruction of sysenter_handler.  Go on with the system
+	// call without TF; sysenter_trap gives it back to the environment.
+	if (tf->tf_trapno == T_DEBUG && tf->tf_cs == GD_KT &&
+	    tf->tf_eip == (uintptr_t) &sysenter_handler) {
+		tf->tf_eflags &= ~FL_TF;
+		thiscpu->cpu_sysenter_tf = 1;
+		env_pop_tf(tf);
+	}
+
+	if ((tf->tf_cs & 3) == 3) {
+		// We left user mode: CPUs changing our address space
+		// don't need to wait for us to flush the TLB anymore.
+		thiscpu->cpu_in_user = 0;
+
+		// A TLB shootdown is served without taking the big kernel
+		// lock, since the CPU that asked for it holds the lock
+		// while it waits for us.
+		if (tf->tf_trapno == T_TLBSHOOT) {
+			tlb_shootdown_ack();
+			lapic_eoi();
+			thiscpu->cpu_in_user = 1;
+			env_pop_tf(tf);
+		}
+	}
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -321,6 +427,14 @@ trap(struct Trapframe *tf)
 		assert(curenv);
 		lock_kernel();
 
+		// Charge it for the time it ran in user mode
+		curenv->env_stats.es_cycles += entered - thiscpu->cpu_user_start;
+
+		// Our address space may have changed while we were
+		// waiting for the lock
+		if (thiscpu->cpu_tlb_pending)
+			tlb_shootdown_ack();
+
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
 			env_free(curenv);
@@ -353,9 +467,21 @@ trap(struct Trapframe *tf)
 }
 
 
+// Trace the end of curenv's page fault at 'fault_va', which started at
+// 'start', count it and charge it the time.  page_fault_handler never
+// returns (it leaves through env_run or env_destroy), so it calls this
+// before each way out.
+static void
+pgfault_done(uint32_t fault_va, uint64_t start)
+{
+	trace(TRACE_PGFAULT, TR_PGFAULT_DONE, fault_va, 0);
+	stats_pgfault(read_tsc() - start);
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
+	uint64_t start = read_tsc();
 	uint32_t fault_va;
 
 	// Read processor's CR2 register to find the faulting address
@@ -400,20 +526,39 @@ page_fault_handler(struct Trapframe *tf)
 	//   (the 'tf' variable points at 'curenv->env_tf').
 
 	// LAB 4: Your code here.
+	// Copy-on-write faults are resolved right here if the environment
+	// asked for it, saving the round trip through the upcall.  Those on
+	// 4MB pages always are: user space has nowhere to copy them to.
+	if ((curenv->env_kern_cow ||
+	     (curenv->env_pgdir[PDX(fault_va)] & PTE_PS)) &&
+	    (tf->tf_err & FEC_WR) &&
+	    page_cow(curenv->env_pgdir, (void *) fault_va) == 0) {
+		pgfault_done(fault_va, start);
+		env_run(curenv);
+	}
+
 	if (curenv->env_pgfault_upcall) {
 		struct UTrapframe *utf;
 
 		// Recursive case. Pgfault handler pgfaulted.
-		if (UXSTACKTOP-PGSIZE <= tf->tf_esp && tf->tf_esp < UXSTACKTOP) {
+		// Threads sharing an address space each have their own
+		// exception stack, ending at env_uxstacktop.
+		uintptr_t uxstacktop = curenv->env_uxstacktop;
+		if (uxstacktop-PGSIZE <= tf->tf_esp && tf->tf_esp < uxstacktop) {
 			utf = (struct UTrapframe *) (tf->tf_esp - 4); // Gap
 		// Normal case
 		} else {
-			utf = (struct UTrapframe *) UXSTACKTOP;
+			utf = (struct UTrapframe *) uxstacktop;
 		}
 
 		// Make utf point to the new top of the exception stack
 		utf--;
-		user_mem_assert(curenv, utf, sizeof(struct UTrapframe), PTE_W);
+		if (user_mem_check(curenv, utf, sizeof(struct UTrapframe),
+				   PTE_U | PTE_W) < 0) {
+			pgfault_done(fault_va, start);
+			user_mem_assert(curenv, utf, sizeof(struct UTrapframe),
+					PTE_W);
+		}
 
 		// "Push" the info
 		utf->utf_fault_va = fault_va;
@@ -426,6 +571,7 @@ page_fault_handler(struct Trapframe *tf)
 		// Branch to curenv->env_pgfault_upcall: back to user mode!
 		tf->tf_esp = (uintptr_t) utf;
 		tf->tf_eip = (uintptr_t) curenv->env_pgfault_upcall;
+		pgfault_done(fault_va, start);
 		env_run(curenv);
 
 		return;
@@ -435,6 +581,85 @@ page_fault_handler(struct Trapframe *tf)
 	cprintf("[%08x] user fault va %08x ip %08x\n",
 		curenv->env_id, fault_va, tf->tf_eip);
 	print_trapframe(tf);
+	pgfault_done(fault_va, start);
 	env_destroy(curenv);
 }
 
+
+// Fast system call entry, from sysenter_handler in kern/trapentry.S,
+// which passes the user's registers: the system call number, four
+// parameters, then where the user stub (lib/syscall.c) wants to return
+// to and its stack pointer, and the flags.
+//
+// Like trap() for a T_SYSCALL, except that only the registers the
+// environment could need again go into curenv->env_tf (in case the call
+// doesn't come back here, or copies env_tf, like sys_exofork), and the
+// common case returns to sysenter_handler, which uses SYSEXIT instead
+// of env_pop_tf's iret.
+int32_t
+sysenter_trap(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+	      uint32_t a4, uint32_t eip, uint32_t esp, uint32_t eflags)
+{
+	uint64_t entered = read_tsc();
+	struct Trapframe *tf;
+	int32_t ret;
+
+	// Halt the CPU if some other CPU has called panic()
+	extern char *panicstr;
+	if (panicstr)
+		asm volatile("hlt");
+
+	// The environment was single-stepping (see trap())
+	if (thiscpu->cpu_sysenter_tf) {
+		thiscpu->cpu_sysenter_tf = 0;
+		eflags |= FL_TF;
+	}
+
+	thiscpu->cpu_in_user = 0;
+	lock_kernel();
+	assert(curenv);
+	curenv->env_stats.es_cycles += entered - thiscpu->cpu_user_start;
+	if (thiscpu->cpu_tlb_pending)
+		tlb_shootdown_ack();
+	if (curenv->env_status == ENV_DYING) {
+		env_free(curenv);
+		curenv = NULL;
+		sched_yield();
+	}
+
+	tf = &curenv->env_tf;
+	tf->tf_regs.reg_eax = num;
+	tf->tf_regs.reg_edx = a1;
+	tf->tf_regs.reg_ecx = a2;
+	tf->tf_regs.reg_ebx = a3;
+	tf->tf_regs.reg_edi = a4;
+	tf->tf_regs.reg_esi = eip;
+	tf->tf_regs.reg_ebp = esp;
+	tf->tf_trapno = T_SYSCALL;
+	tf->tf_err = 0;
+	tf->tf_eip = eip;
+	tf->tf_esp = esp;
+	tf->tf_eflags = eflags | FL_IF;
+	last_tf = tf;
+
+	ret = trap_syscall(num, a1, a2, a3, a4, 0);
+	tf->tf_regs.reg_eax = ret;
+
+	// Go back the slow way if the environment shouldn't just carry on
+	// where it left off (sys_env_set_trapframe may have moved it), or
+	// is single-stepping: SYSEXIT can't set TF for it
+	if (!curenv || curenv->env_status != ENV_RUNNING)
+		sched_yield();
+	if (tf->tf_eip != eip || tf->tf_esp != esp ||
+	    (tf->tf_eflags & FL_TF))
+		env_run(curenv);
+
+	// What env_run does, but for SYSEXIT
+	curenv->env_runs += 1;
+	curenv->env_cpunum = cpunum();
+	timer_arm(thiscpu->cpu_slice_end);
+	thiscpu->cpu_in_user = 1;
+	unlock_kernel();
+	thiscpu->cpu_user_start = read_tsc();
+	return ret;
+}
@@ -15,6 +15,8 @@ extern struct Pseudodesc idt_pd;
 
 void trap_init(void);
 void trap_init_percpu(void);
+int32_t sysenter_trap(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+		      uint32_t a4, uint32_t eip, uint32_t esp, uint32_t eflags);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
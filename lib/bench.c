@@ -0,0 +1,30 @@
+// Helpers for the benchmark programs, user/bench*.c.
+
+#include <inc/lib.h>
+
+// Print a result of a benchmark, as a line
+//	BENCH <name> <value> <unit>
+// for `make bench` (see bench-jos) to collect.  Units that end in "/s"
+// are better when higher, the others (cycles, ms) when lower.
+void
+bench_report(const char *name, uint64_t value, const char *unit)
+{
+	cprintf("BENCH %s %llu %s\n", name, value, unit);
+}
+
+// Sort the 'n' samples in place and return their median, which a
+// timer interrupt or two in the middle of a run doesn't move.
+uint32_t
+bench_median(uint32_t *samples, int n)
+{
+	int i, j;
+	uint32_t x;
+
+	for (i = 1; i < n; i++) {
+		x = samples[i];
+		for (j = i; j > 0 && samples[j - 1] > x; j--)
+			samples[j] = samples[j - 1];
+		samples[j] = x;
+	}
+	return samples[n / 2];
+}
@@ -38,6 +38,7 @@ static ssize_t devcons_read(struct Fd*, void*, size_t);
 static ssize_t devcons_write(struct Fd*, const void*, size_t);
 static int devcons_close(struct Fd*);
 static int devcons_stat(struct Fd*, struct Stat*);
+static int devcons_poll(struct Fd*, int);
 
 struct Dev devcons =
 {
@@ -46,7 +47,8 @@ struct Dev devcons =
 	.dev_read =	devcons_read,
 	.dev_write =	devcons_write,
 	.dev_close =	devcons_close,
-	.dev_stat =	devcons_stat
+	.dev_stat =	devcons_stat,
+	.dev_poll =	devcons_poll
 };
 
 int
@@ -83,8 +85,13 @@ devcons_read(struct Fd *fd, void *vbuf, size_t n)
 	if (n == 0)
 		return 0;
 
-	while ((c = sys_cgetc()) == 0)
-		sys_yield();
+	// Take the character poll read ahead, if any
+	if (fd->fd_cons.cons_peek) {
+		c = fd->fd_cons.cons_peek - 1;
+		fd->fd_cons.cons_peek = 0;
+	} else
+		while ((c = sys_cgetc()) == 0)
+			sys_yield();
 	if (c < 0)
 		return c;
 	if (c == 0x04)	// ctl-d is eof
@@ -111,6 +118,19 @@ devcons_write(struct Fd *fd, const void *vbuf, size_t n)
 	return tot;
 }
 
+// There is no way to ask the kernel whether a character is waiting
+// without taking it, so read it ahead and keep it for devcons_read.
+static int
+devcons_poll(struct Fd *fd, int events)
+{
+	int c;
+
+	if ((events & POLLIN) && !fd->fd_cons.cons_peek
+	    && (c = sys_cgetc()) > 0)
+		fd->fd_cons.cons_peek = c + 1;
+	return (fd->fd_cons.cons_peek ? POLLIN : 0) | POLLOUT;
+}
+
 static int
 devcons_close(struct Fd *fd)
 {
@@ -307,6 +307,66 @@ fstat(int fdnum, struct Stat *stat)
 	return (*dev->dev_stat)(fd, stat);
 }
 
+// Wait until some of the file descriptors in 'fds' are ready for the
+// events requested in their 'events' fields, for at most 'timeout' ms,
+// or forever if timeout < 0.  Sets the 'revents' fields.
+// Returns the number of ready file descriptors, 0 on timeout.
+//
+// Pipes and the console can only be checked by polling them.  When all
+// we are waiting for is sockets, we block in the network server, which
+// replies as soon as one of them changes.
+int
+poll(struct pollfd *fds, int nfds, int timeout)
+{
+	struct Dev *dev;
+	struct Fd *fd;
+	unsigned now, deadline = 0;
+	int i, n, nsocks, nothers, r;
+
+	if (timeout > 0)
+		deadline = sys_time_msec() + timeout;
+
+	while (1) {
+		n = nsocks = nothers = 0;
+		for (i = 0; i < nfds; i++) {
+			fds[i].revents = 0;
+			if (fds[i].fd < 0)
+				continue;
+			if (fd_lookup(fds[i].fd, &fd) < 0
+			    || dev_lookup(fd->fd_dev_id, &dev) < 0) {
+				fds[i].revents = POLLNVAL;
+				n++;
+				continue;
+			}
+			if (dev->dev_poll)
+				fds[i].revents = (*dev->dev_poll)(fd, fds[i].events)
+					& (fds[i].events | POLLERR | POLLHUP | POLLNVAL);
+			else
+				fds[i].revents = fds[i].events & (POLLIN | POLLOUT);
+			if (fds[i].revents)
+				n++;
+			else if (dev == &devsock)
+				nsocks++;
+			else
+				nothers++;
+		}
+
+		if (n > 0 || timeout == 0)
+			return n;
+		now = sys_time_msec();
+		if (timeout > 0 && now >= deadline)
+			return 0;
+
+		if (nsocks > 0 && nothers == 0) {
+			r = socket_poll_wait(fds, nfds,
+					     timeout < 0 ? -1 : deadline - now);
+			if (r < 0)
+				return r;
+		} else
+			sys_yield();
+	}
+}
+
 int
 stat(const char *path, struct Stat *stat)
 {
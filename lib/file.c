@@ -6,26 +6,38 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// fmapblock has a request page of its own, since it is called from the
+// page fault handler of mmap(), which may interrupt another request
+// while its reply is still in fsipcbuf.
+static union Fsipc fsmapbuf __attribute__((aligned(PGSIZE)));
+
 // Send an inter-environment request to the file server, and wait for
-// a reply.  The request body should be in fsipcbuf, and parts of the
-// response may be written back to fsipcbuf.
+// a reply.  The request body should be in 'buf', and parts of the
+// response may be written back to 'buf'.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc_buf(unsigned type, union Fsipc *buf, void *dstva)
 {
 	static envid_t fsenv;
 	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
+		fsenv = ipc_lookup("fs");
 
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
 	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)buf);
+
+	return fsipc_call(fsenv, type, buf, dstva ? dstva : (void *) UTOP,
+			  thisenv);
+}
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+// Send a request whose body is in fsipcbuf
+static int
+fsipc(unsigned type, void *dstva)
+{
+	return fsipc_buf(type, &fsipcbuf, dstva);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -200,3 +212,37 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+
+// Map the file server's cached copy of the block of file 'fdnum' that
+// holds byte 'offset' at 'dstva', read-only.  Returns the number of
+// bytes of the file from 'offset' to the end of that block, 0 at the
+// end of the file (with nothing mapped), or < 0 on error.
+int
+fmapblock(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+
+	fsmapbuf.map.req_fileid = fd->fd_file.id;
+	fsmapbuf.map.req_offset = offset;
+	return fsipc_buf(FSREQ_MAP, &fsmapbuf, dstva);
+}
+
+// Write the data and metadata of file 'fdnum' to disk
+int
+fsync(int fdnum)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	return devfile_flush(fd);
+}
@@ -3,13 +3,11 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
+// Environments that called sys_env_set_kern_cow(0, 1) have their
+// copy-on-write faults resolved by the kernel and never get here.
 //
 static void
 pgfault(struct UTrapframe *utf)
@@ -63,6 +61,9 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// A 4MB page (PTE_PS in its page directory entry) is duplicated whole,
+// at its first page.  The kernel resolves copy-on-write faults on it.
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
@@ -74,8 +75,15 @@ duppage(envid_t envid, unsigned pn)
 	if (!(uvpd[pn/NPTENTRIES] & PTE_P))
 		return 0;
 
-	// Retrieve the PTE using UVPT
-	pte_t pte = uvpt[pn];
+	// Retrieve the PTE using UVPT, or the PDE of a 4MB page, which has
+	// no page table for UVPT to show
+	pte_t pte;
+	if (uvpd[pn/NPTENTRIES] & PTE_PS) {
+		if (pn % NPTENTRIES != 0)
+			return 0;
+		pte = uvpd[pn/NPTENTRIES];
+	} else
+		pte = uvpt[pn];
 
 	// If the page is present, duplicate according to it's permissions
 	if (pte & PTE_P) {
@@ -158,9 +166,10 @@ fork(void)
 	// Set page fault handler on the child.
 	// The parent needs to do it, else the child wouldn't be able to handle the
 	// fault when trying to access it's stack (which happens as soon it starts)
-	extern void _pgfault_upcall(void);
+	// It gets our upcall, which may be spawn()'s pager: the child is
+	// missing the same pages of the program as we are.
 	sys_page_alloc(envid, (void *) (UXSTACKTOP-PGSIZE), PTE_P | PTE_U | PTE_W);
-	sys_env_set_pgfault_upcall(envid, (void *) _pgfault_upcall);
+	sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall);
 
 	// Copy our address space to child. Be careful not to copy the exception
 	// stack too, so go until USTACKTOP instead of UTOP.
@@ -179,10 +188,95 @@ fork(void)
 	return envid;
 }
 
-// Challenge!
-int
-sfork(void)
+//
+// Shared-memory fork: start a thread running fn(arg) in our own address
+// space.  Everything is shared with the caller (globals, heap, file
+// descriptors) except the thread's stacks and its 'thisenv'.  The thread
+// exits when fn returns; it must not call exit(), which would close the
+// file descriptors of every thread.
+//
+// Copy-on-write faults of a multi-threaded environment are resolved by
+// the kernel, since pgfault's PFTEMP scratch page can't be shared.
+//
+// Returns the thread's envid, or < 0 on error.
+//
+
+// thread_owner[i] is the envid of the thread using slot i, 0 if the slot
+// was never used, or -1 while it is being set up.
+static volatile envid_t thread_owner[NTHREADS];
+
+static void
+sfork_entry(void (*fn)(void *), void *arg)
+{
+	thisenv = &envs[ENVX(sys_getenvid())];
+	fn(arg);
+	sys_env_destroy(0);
+}
+
+// Claim a thread slot whose owner never existed or has exited
+static int
+thread_slot_alloc(void)
+{
+	envid_t owner;
+	int i;
+
+	for (i = 0; i < NTHREADS; i++) {
+		owner = thread_owner[i];
+		if (owner == -1)
+			continue;
+		if (owner != 0 && envs[ENVX(owner)].env_id == owner
+		    && envs[ENVX(owner)].env_status != ENV_FREE)
+			continue;
+		if (__sync_bool_compare_and_swap(&thread_owner[i], owner, -1))
+			return i;
+	}
+	return -E_NO_FREE_ENV;
+}
+
+envid_t
+sfork(void (*fn)(void *), void *arg)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	uint8_t *slot, *uxstack, *td;
+	uint32_t *esp;
+	envid_t envid;
+	int i, r;
+
+	if ((r = sys_env_set_kern_cow(0, 1)) < 0)
+		return r;
+	if ((i = thread_slot_alloc()) < 0)
+		return i;
+
+	slot = (uint8_t *) UTHREADS + i * THREADSLOT;
+	uxstack = slot + THREADSLOT - 2 * PGSIZE;
+	td = slot + THREADSLOT - PGSIZE;
+
+	// Slots are mapped the first time they are used, and stay mapped.
+	// The exception stack is PTE_SHARE so that fork never makes it
+	// copy-on-write under the thread's feet.
+	if (!(uvpd[PDX(td)] & PTE_P) || !(uvpt[PGNUM(td)] & PTE_P)) {
+		if ((r = sys_page_alloc_range(0, slot + PGSIZE,
+					      THREADSLOT - 3 * PGSIZE,
+					      PTE_P | PTE_U | PTE_W)) < 0
+		    || (r = sys_page_alloc(0, uxstack,
+					   PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0
+		    || (r = sys_page_alloc(0, td, PTE_P | PTE_U | PTE_W)) < 0)
+			goto fail;
+	}
+
+	// Call frame for sfork_entry(fn, arg), with a null return address
+	esp = (uint32_t *) uxstack;
+	*--esp = (uint32_t) arg;
+	*--esp = (uint32_t) fn;
+	*--esp = 0;
+
+	if ((envid = sys_sfork(sfork_entry, esp, uxstack + PGSIZE)) < 0) {
+		r = envid;
+		goto fail;
+	}
+	thread_owner[i] = envid;
+	return envid;
+
+fail:
+	thread_owner[i] = 0;
+	return r;
 }
@@ -2,6 +2,8 @@
 
 #include <inc/lib.h>
 
+static int32_t ipc_result(int r, envid_t *from_env_store, int *perm_store);
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -33,7 +35,25 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	}
 
 	r = sys_ipc_recv(va);
+	return ipc_result(r, from_env_store, perm_store);
+}
+
+// Like ipc_recv, but gives up and returns -E_TIMEOUT if nothing arrives
+// before sys_time_nsec() reaches 'deadline'.
+int32_t
+ipc_recv_until(envid_t *from_env_store, void *pg, int *perm_store,
+	       uint64_t deadline)
+{
+	int r;
+
+	r = sys_ipc_recv_until(pg ? pg : (void *) KERNBASE, deadline);
+	return ipc_result(r, from_env_store, perm_store);
+}
 
+// Finish a receive whose system call returned 'r'
+static int32_t
+ipc_result(int r, envid_t *from_env_store, int *perm_store)
+{
 	if (r < 0) {
 		if (from_env_store)
 			*from_env_store = 0;
@@ -83,15 +103,13 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	}
 }
 
-// Find the first environment of the given type.  We'll use this to
-// find special environments.
+// Find the environment registered as the service called 'name' (see
+// sys_service_register), like "fs" or "ns".
 // Returns 0 if no such environment exists.
 envid_t
-ipc_find_env(enum EnvType type)
+ipc_lookup(const char *name)
 {
-	int i;
-	for (i = 0; i < NENV; i++)
-		if (envs[i].env_type == type)
-			return envs[i].env_id;
-	return 0;
+	envid_t envid = sys_service_lookup(name);
+
+	return envid < 0 ? 0 : envid;
 }
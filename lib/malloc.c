@@ -1,140 +1,410 @@
-
 #include <inc/lib.h>
 
 /*
- * Simple malloc/free.
+ * Size-class slab allocator.
+ *
+ * The heap lives in [mbegin, mend) and is carved into page-aligned
+ * blocks.  Every block starts with a small header (HDRSIZE bytes), so
+ * free() can find out what it is looking at by rounding the pointer
+ * down to its page.
  *
- * Uses the address space to do most of the hard work.
- * The address space from mbegin to mend is scanned
- * in order.  Pages are allocated, used to fill successive
- * malloc requests, and then left alone.  Free decrements
- * a ref count maintained in the page; the page is freed
- * when the ref count hits zero.
+ *  - Small requests are rounded up to one of the size classes below
+ *    and served from slabs: single pages holding objects of a single
+ *    class.  Free objects are threaded through a per-slab free list,
+ *    and the slabs that still have free objects sit on a per-class
+ *    list, so once a slab exists malloc and free make no system calls.
  *
- * If we need to allocate a large amount (more than a page)
- * we can't put a ref count at the end of each page,
- * so we mark the pte entry with the bit PTE_CONTINUED.
+ *  - Larger requests get a span of whole pages, which is mapped with
+ *    a single sys_page_alloc_range call.  realloc tries to grow a span
+ *    in place before falling back to malloc + copy + free.
+ *
+ * Heap address space is tracked with a bitmap of pages and handed out
+ * first fit, so ranges given back by free() are reused.  Physical pages
+ * are returned to the kernel as soon as a span, or a slab that is not
+ * the last one of its class, becomes free.
  */
-enum
-{
-	MAXMALLOC = 1024*1024	/* max size of one allocated chunk */
+
+#define HDRSIZE		32		// space reserved for block headers
+#define SLAB_MAGIC	0x51ab51ab
+#define SPAN_MAGIC	0x59a059a0
+
+// Object sizes of the slab classes.  Everything bigger than the last
+// class gets its own span.
+static const size_t classes[] = {
+	16, 32, 64, 128, 256, 512, 1024, (PGSIZE - HDRSIZE) / 2
 };
+#define NCLASS		(sizeof(classes) / sizeof(classes[0]))
 
-#define PTE_CONTINUED 0x200
+// Header at the start of every slab page
+struct Slab {
+	uint32_t s_magic;	// SLAB_MAGIC
+	uint16_t s_class;	// Index into classes[]
+	uint16_t s_nfree;	// Number of free objects in this slab
+	void *s_free;		// First free object
+	struct Slab *s_next;	// Links in the class' partial list
+	struct Slab *s_prev;
+};
+
+// Header at the start of every span
+struct Span {
+	uint32_t sp_magic;	// SPAN_MAGIC
+	uint32_t sp_npages;	// Number of pages in the span, header included
+};
 
 static uint8_t *mbegin = (uint8_t*) 0x08000000;
 static uint8_t *mend   = (uint8_t*) 0x10000000;
-static uint8_t *mptr;
+
+#define NHEAPPAGES	((0x10000000 - 0x08000000) / PGSIZE)
+
+// One bit per heap page, set if the page's address space is in use
+static uint32_t vamap[NHEAPPAGES / 32];
+static uint32_t vahint;			// no free page below this one
+
+static struct Slab *partial[NCLASS];	// slabs with free objects, per class
+
+#define HEAP_PERM	(PTE_P|PTE_U|PTE_W)
+
+//
+// Heap address space management.
+//
 
 static int
-isfree(void *v, size_t n)
+va_inuse(uint32_t pn)
+{
+	return vamap[pn / 32] & (1U << (pn % 32));
+}
+
+static void
+va_mark(uint32_t pn, size_t npages, int inuse)
+{
+	for (; npages > 0; pn++, npages--) {
+		if (inuse)
+			vamap[pn / 32] |= 1U << (pn % 32);
+		else
+			vamap[pn / 32] &= ~(1U << (pn % 32));
+	}
+}
+
+// Reserve 'npages' contiguous pages of heap address space, first fit.
+// Returns 0 if the heap is out of address space.
+static uint8_t *
+va_alloc(size_t npages)
 {
-	uintptr_t va, end_va = (uintptr_t) v + n;
+	uint32_t pn, run = 0;
 
-	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
-		if (va >= (uintptr_t) mend
-		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
-			return 0;
-	return 1;
+	for (pn = vahint; pn < NHEAPPAGES; pn++) {
+		// Skip over fully used words quickly
+		if (run == 0 && pn % 32 == 0 && vamap[pn / 32] == ~0U) {
+			pn += 31;
+			continue;
+		}
+		if (va_inuse(pn)) {
+			run = 0;
+			continue;
+		}
+		if (++run == npages) {
+			pn = pn + 1 - npages;
+			va_mark(pn, npages, 1);
+			if (pn == vahint)
+				vahint = pn + npages;
+			return mbegin + pn * PGSIZE;
+		}
+	}
+	return 0;
 }
 
-void*
-malloc(size_t n)
+// Reserve exactly [va, va + npages * PGSIZE), if all of it is free.
+// Returns 0 on success, -E_NO_MEM otherwise.
+static int
+va_take(uint8_t *va, size_t npages)
 {
-	int i, cont;
-	int nwrap;
-	uint32_t *ref;
-	void *v;
+	uint32_t pn = (va - mbegin) / PGSIZE, i;
+
+	if (va > mend || npages > (mend - va) / PGSIZE)
+		return -E_NO_MEM;
+	for (i = 0; i < npages; i++)
+		if (va_inuse(pn + i))
+			return -E_NO_MEM;
+	va_mark(pn, npages, 1);
+	return 0;
+}
+
+// Give [va, va + npages * PGSIZE) back to the heap.  The pages must
+// already be unmapped.
+static void
+va_free(uint8_t *va, size_t npages)
+{
+	uint32_t pn = (va - mbegin) / PGSIZE;
+
+	va_mark(pn, npages, 0);
+	if (pn < vahint)
+		vahint = pn;
+}
 
-	if (mptr == 0)
-		mptr = mbegin;
+static void
+pages_unmap(uint8_t *va, size_t npages)
+{
+	size_t i;
 
-	n = ROUNDUP(n, 4);
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, va + i * PGSIZE);
+}
 
-	if (n >= MAXMALLOC)
+// Reserve address space for 'npages' pages and back it with memory.
+// Returns 0 if out of address space or physical memory.
+static uint8_t *
+pages_alloc(size_t npages)
+{
+	uint8_t *va;
+
+	if (!(va = va_alloc(npages)))
+		return 0;
+	if (sys_page_alloc_range(0, va, npages * PGSIZE, HEAP_PERM) < 0) {
+		va_free(va, npages);
 		return 0;
+	}
+	return va;
+}
 
-	if ((uintptr_t) mptr % PGSIZE){
-		/*
-		 * we're in the middle of a partially
-		 * allocated page - can we add this chunk?
-		 * the +4 below is for the ref count.
-		 */
-		ref = (uint32_t*) (ROUNDUP(mptr, PGSIZE) - 4);
-		if ((uintptr_t) mptr / PGSIZE == (uintptr_t) (mptr + n - 1 + 4) / PGSIZE) {
-			(*ref)++;
-			v = mptr;
-			mptr += n;
-			return v;
-		}
-		/*
-		 * stop working on this page and move on.
-		 */
-		free(mptr);	/* drop reference to this page */
-		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
+static void
+pages_free(uint8_t *va, size_t npages)
+{
+	pages_unmap(va, npages);
+	va_free(va, npages);
+}
+
+//
+// Slabs.
+//
+
+static int
+size_class(size_t n)
+{
+	int c;
+
+	for (c = 0; c < NCLASS; c++)
+		if (n <= classes[c])
+			return c;
+	return -1;
+}
+
+static void
+slab_link(struct Slab *s)
+{
+	s->s_prev = 0;
+	s->s_next = partial[s->s_class];
+	if (s->s_next)
+		s->s_next->s_prev = s;
+	partial[s->s_class] = s;
+}
+
+static void
+slab_unlink(struct Slab *s)
+{
+	if (s->s_prev)
+		s->s_prev->s_next = s->s_next;
+	else
+		partial[s->s_class] = s->s_next;
+	if (s->s_next)
+		s->s_next->s_prev = s->s_prev;
+	s->s_next = s->s_prev = 0;
+}
+
+static uint16_t
+slab_nobjs(int c)
+{
+	return (PGSIZE - HDRSIZE) / classes[c];
+}
+
+// Allocate a new slab for class 'c' and put it on the partial list.
+static struct Slab *
+slab_new(int c)
+{
+	struct Slab *s;
+	uint8_t *obj;
+	int i;
+
+	if (!(s = (struct Slab *) pages_alloc(1)))
+		return 0;
+
+	s->s_magic = SLAB_MAGIC;
+	s->s_class = c;
+	s->s_nfree = slab_nobjs(c);
+	s->s_free = 0;
+	// Thread the free list so objects are handed out in address order
+	for (i = s->s_nfree - 1; i >= 0; i--) {
+		obj = (uint8_t *) s + HDRSIZE + i * classes[c];
+		*(void **) obj = s->s_free;
+		s->s_free = obj;
 	}
+	slab_link(s);
+	return s;
+}
 
-	/*
-	 * now we need to find some address space for this chunk.
-	 * if it's less than a page we leave it open for allocation.
-	 * runs of more than a page can't have ref counts so we
-	 * flag the PTE entries instead.
-	 */
-	nwrap = 0;
-	while (1) {
-		if (isfree(mptr, n + 4))
-			break;
-		mptr += PGSIZE;
-		if (mptr == mend) {
-			mptr = mbegin;
-			if (++nwrap == 2)
-				return 0;	/* out of address space */
-		}
+static void *
+slab_alloc(int c)
+{
+	struct Slab *s;
+	void *v;
+
+	if (!(s = partial[c]) && !(s = slab_new(c)))
+		return 0;
+
+	v = s->s_free;
+	s->s_free = *(void **) v;
+	if (--s->s_nfree == 0)
+		slab_unlink(s);
+	return v;
+}
+
+static void
+slab_free(struct Slab *s, void *v)
+{
+	*(void **) v = s->s_free;
+	s->s_free = v;
+	if (s->s_nfree++ == 0) {
+		slab_link(s);
+		return;
 	}
 
-	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
-	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+	// Release the slab once it is empty, unless it is the only slab
+	// of its class, to avoid thrashing on alloc/free pairs.
+	if (s->s_nfree == slab_nobjs(s->s_class)
+	    && (partial[s->s_class] != s || s->s_next)) {
+		slab_unlink(s);
+		s->s_magic = 0;
+		pages_free((uint8_t *) s, 1);
 	}
+}
 
-	ref = (uint32_t*) (mptr + i - 4);
-	*ref = 2;	/* reference for mptr, reference for returned block */
-	v = mptr;
-	mptr += n;
-	return v;
+//
+// Spans.
+//
+
+static size_t
+span_npages(size_t n)
+{
+	return ROUNDUP(n + HDRSIZE, PGSIZE) / PGSIZE;
+}
+
+static void *
+span_alloc(size_t n)
+{
+	struct Span *sp;
+	size_t npages = span_npages(n);
+
+	if (!(sp = (struct Span *) pages_alloc(npages)))
+		return 0;
+	sp->sp_magic = SPAN_MAGIC;
+	sp->sp_npages = npages;
+	return (uint8_t *) sp + HDRSIZE;
+}
+
+//
+// Public interface.
+//
+
+// Find the block header for a pointer returned by malloc.
+static uint32_t *
+block_header(void *v)
+{
+	uint32_t *hdr;
+
+	if (!(mbegin <= (uint8_t*) v && (uint8_t*) v < mend))
+		panic("malloc: bad pointer %08x", v);
+	hdr = (uint32_t *) ROUNDDOWN(v, PGSIZE);
+	if (*hdr != SLAB_MAGIC && *hdr != SPAN_MAGIC)
+		panic("malloc: bad pointer %08x", v);
+	return hdr;
+}
+
+void*
+malloc(size_t n)
+{
+	int c;
+
+	if (n > mend - mbegin)
+		return 0;
+	if ((c = size_class(n)) >= 0)
+		return slab_alloc(c);
+	return span_alloc(n);
 }
 
 void
 free(void *v)
 {
-	uint8_t *c;
-	uint32_t *ref;
+	uint32_t *hdr;
+	struct Span *sp;
 
 	if (v == 0)
 		return;
-	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
 
-	c = ROUNDDOWN(v, PGSIZE);
-
-	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
-		c += PGSIZE;
-		assert(mbegin <= c && c < mend);
+	hdr = block_header(v);
+	if (*hdr == SLAB_MAGIC) {
+		slab_free((struct Slab *) hdr, v);
+		return;
 	}
 
-	/*
-	 * c is just a piece of this page, so dec the ref count
-	 * and maybe free the page.
-	 */
-	ref = (uint32_t*) (c + PGSIZE - 4);
-	if (--(*ref) == 0)
-		sys_page_unmap(0, c);
+	sp = (struct Span *) hdr;
+	sp->sp_magic = 0;
+	pages_free((uint8_t *) sp, sp->sp_npages);
 }
 
+void*
+realloc(void *v, size_t n)
+{
+	uint32_t *hdr;
+	struct Span *sp;
+	size_t oldsize, need;
+	uint8_t *end;
+	void *nv;
+
+	if (v == 0)
+		return malloc(n);
+	if (n == 0) {
+		free(v);
+		return 0;
+	}
+	if (n > mend - mbegin)
+		return 0;
+
+	hdr = block_header(v);
+	if (*hdr == SLAB_MAGIC) {
+		oldsize = classes[((struct Slab *) hdr)->s_class];
+		if (n <= oldsize)
+			return v;
+	} else {
+		sp = (struct Span *) hdr;
+		oldsize = sp->sp_npages * PGSIZE - HDRSIZE;
+		need = span_npages(n);
+		end = (uint8_t *) sp + sp->sp_npages * PGSIZE;
+
+		// Shrink in place, giving the tail pages back
+		if (need <= sp->sp_npages) {
+			if (need < sp->sp_npages) {
+				pages_free(end - (sp->sp_npages - need) * PGSIZE,
+					   sp->sp_npages - need);
+				sp->sp_npages = need;
+			}
+			return v;
+		}
+
+		// Grow in place if the address space right after us is free
+		if (va_take(end, need - sp->sp_npages) == 0) {
+			if (sys_page_alloc_range(0, end,
+						 (need - sp->sp_npages) * PGSIZE,
+						 HEAP_PERM) == 0) {
+				sp->sp_npages = need;
+				return v;
+			}
+			va_free(end, need - sp->sp_npages);
+		}
+	}
+
+	// Otherwise move the block
+	if (!(nv = malloc(n)))
+		return 0;
+	memmove(nv, v, MIN(oldsize, n));
+	free(v);
+	return nv;
+}
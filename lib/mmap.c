@@ -0,0 +1,238 @@
+#include <inc/lib.h>
+
+/*
+ * Memory-mapped files.
+ *
+ * mmap() only reserves address space.  Pages come in through a page
+ * fault hook the first time they are touched:
+ *
+ *  - A read maps the file server's cached copy of the block itself,
+ *    read-only (see fmapblock), so all the readers of a file share one
+ *    copy of it, and later accesses cost nothing.
+ *
+ *  - The first write to a page of a writable mapping replaces it with
+ *    a private copy, like fork's copy-on-write.  For MAP_SHARED
+ *    mappings, msync() and munmap() write the copies that were changed
+ *    back to the file and flush it (file_flush on the server).
+ *
+ * Pages past the end of the file read as zeros and are never written
+ * back: mappings don't change the size of the file.
+ */
+
+#define MMAPBASE	0xA0000000
+#define MMAPLIM		0xD0000000	// where the fd table starts
+#define NMAPS		32
+
+struct Mapping {
+	uint8_t *m_va;		// start of the mapping, 0 if the slot is free
+	size_t m_len;		// length, a multiple of PGSIZE
+	int m_fdnum;		// our own dup of the file descriptor
+	off_t m_offset;		// file offset of m_va
+	int m_prot;		// PROT_*
+	int m_flags;		// MAP_*
+};
+
+static struct Mapping maps[NMAPS];
+
+static struct Mapping *
+mapping_find(void *va)
+{
+	int i;
+
+	for (i = 0; i < NMAPS; i++)
+		if (maps[i].m_va && maps[i].m_va <= (uint8_t *) va
+		    && (uint8_t *) va < maps[i].m_va + maps[i].m_len)
+			return &maps[i];
+	return 0;
+}
+
+// Find 'len' bytes of free address space, first fit.  Returns 0 if
+// there isn't enough.
+static uint8_t *
+mapping_va(size_t len)
+{
+	uint8_t *va = (uint8_t *) MMAPBASE;
+	int i;
+
+again:
+	if (len > (uint8_t *) MMAPLIM - va)
+		return 0;
+	for (i = 0; i < NMAPS; i++)
+		if (maps[i].m_va && maps[i].m_va < va + len
+		    && va < maps[i].m_va + maps[i].m_len) {
+			va = maps[i].m_va + maps[i].m_len;
+			goto again;
+		}
+	return va;
+}
+
+static bool
+page_present(void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+static int
+mmap_pgfault(struct UTrapframe *utf)
+{
+	uint8_t *va = ROUNDDOWN((uint8_t *) utf->utf_fault_va, PGSIZE);
+	struct Mapping *m;
+	int r;
+
+	if (!(m = mapping_find(va)))
+		return 0;
+	if ((utf->utf_err & FEC_WR) && !(m->m_prot & PROT_WRITE))
+		panic("write to read-only mapping at %08x, eip %08x",
+		      utf->utf_fault_va, utf->utf_eip);
+
+	// First touch: share the file server's copy of the block
+	if (!page_present(va)) {
+		r = fmapblock(m->m_fdnum, m->m_offset + (va - m->m_va), va);
+		if (r < 0)
+			panic("mmap: fmapblock: %e", r);
+		if (r == 0) {
+			// Past the end of the file
+			if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("mmap: sys_page_alloc: %e", r);
+			return 1;
+		}
+	}
+	if (!(utf->utf_err & FEC_WR) || (uvpt[PGNUM(va)] & PTE_W))
+		return 1;
+
+	// First write: make a private copy
+	if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("mmap: sys_page_alloc: %e", r);
+	memmove(PFTEMP, va, PGSIZE);
+	if ((r = sys_page_map(0, PFTEMP, 0, va, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("mmap: sys_page_map: %e", r);
+	sys_page_unmap(0, PFTEMP);
+	return 1;
+}
+
+// Map 'len' bytes of file 'fdnum', starting at 'offset', which must be
+// a multiple of PGSIZE.  'prot' says how the memory may be accessed,
+// and 'flags' whether writes go back to the file (MAP_SHARED) or not
+// (MAP_PRIVATE).  The mapping stays valid after fdnum is closed.
+//
+// Returns the address of the mapping, or 0 on error.
+void *
+mmap(int fdnum, off_t offset, size_t len, int prot, int flags)
+{
+	struct Fd *fd, *dupfd;
+	struct Mapping *m;
+	uint8_t *va;
+	int i, r;
+
+	if (offset < 0 || offset % PGSIZE || len == 0
+	    || !(prot & (PROT_READ|PROT_WRITE))
+	    || (flags != MAP_SHARED && flags != MAP_PRIVATE))
+		return 0;
+	if (fd_lookup(fdnum, &fd) < 0 || fd->fd_dev_id != devfile.dev_id)
+		return 0;
+	// The file must be open for writing if we'll write to it
+	if ((fd->fd_omode & O_ACCMODE) == O_WRONLY
+	    || ((prot & PROT_WRITE) && flags == MAP_SHARED
+		&& (fd->fd_omode & O_ACCMODE) == O_RDONLY))
+		return 0;
+	if (add_pgfault_hook(mmap_pgfault) < 0)
+		return 0;
+
+	len = ROUNDUP(len, PGSIZE);
+	for (i = 0; i < NMAPS && maps[i].m_va; i++)
+		/* do nothing */;
+	if (i == NMAPS || !(va = mapping_va(len)))
+		return 0;
+	m = &maps[i];
+
+	// Keep the file open for as long as it is mapped
+	if (fd_alloc(&dupfd) < 0 || (r = dup(fdnum, fd2num(dupfd))) < 0)
+		return 0;
+
+	m->m_va = va;
+	m->m_len = len;
+	m->m_fdnum = r;
+	m->m_offset = offset;
+	m->m_prot = prot;
+	m->m_flags = flags;
+	return va;
+}
+
+// Write the part of page 'va' of mapping 'm' that is inside the file
+// back to it.  Returns 0 on success, < 0 on error.
+static int
+page_writeback(struct Mapping *m, uint8_t *va)
+{
+	off_t offset = m->m_offset + (va - m->m_va), saved;
+	struct Stat st;
+	struct Fd *fd;
+	int r, n, done;
+
+	if ((r = fstat(m->m_fdnum, &st)) < 0
+	    || (r = fd_lookup(m->m_fdnum, &fd)) < 0)
+		return r;
+	n = MIN(PGSIZE, st.st_size - offset);
+
+	// The seek position is shared with the descriptor we dup'ed
+	saved = fd->fd_offset;
+	seek(m->m_fdnum, offset);
+	for (done = 0, r = 0; done < n; done += r)
+		if ((r = write(m->m_fdnum, va + done, n - done)) <= 0)
+			break;
+	fd->fd_offset = saved;
+	return r < 0 ? r : 0;
+}
+
+// Write the pages of shared mappings in [addr, addr + len) that were
+// changed back to their files, and flush the files.
+// Returns 0 on success, < 0 on error.
+int
+msync(void *addr, size_t len)
+{
+	uint8_t *va, *end = (uint8_t *) addr + len;
+	bool written[NMAPS];
+	struct Mapping *m;
+	int i, r;
+
+	memset(written, 0, sizeof(written));
+	for (va = ROUNDDOWN(addr, PGSIZE); va < end; va += PGSIZE) {
+		if (!(m = mapping_find(va)) || m->m_flags != MAP_SHARED
+		    || !page_present(va) || !(uvpt[PGNUM(va)] & PTE_D))
+			continue;
+		if ((r = page_writeback(m, va)) < 0)
+			return r;
+		// Clear the dirty bit
+		if ((r = sys_page_map(0, va, 0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		written[m - maps] = 1;
+	}
+
+	for (i = 0; i < NMAPS; i++)
+		if (written[i] && (r = fsync(maps[i].m_fdnum)) < 0)
+			return r;
+	return 0;
+}
+
+// Remove the mapping that starts at 'addr', writing it back first if
+// it is shared.  'len' must be its length.
+// Returns 0 on success, < 0 on error.
+int
+munmap(void *addr, size_t len)
+{
+	struct Mapping *m;
+	uint8_t *va;
+	int r;
+
+	if (!(m = mapping_find(addr)) || m->m_va != addr
+	    || ROUNDUP(len, PGSIZE) != m->m_len)
+		return -E_INVAL;
+	if ((r = msync(m->m_va, m->m_len)) < 0)
+		return r;
+
+	for (va = m->m_va; va < m->m_va + m->m_len; va += PGSIZE)
+		if (page_present(va))
+			sys_page_unmap(0, va);
+	close(m->m_fdnum);
+	m->m_va = 0;
+	return 0;
+}
@@ -13,19 +13,24 @@ union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 // may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // Returns 0 if successful, < 0 on failure.
-static int
-nsipc(unsigned type)
+envid_t
+nsipc_env(void)
 {
 	static envid_t nsenv;
 	if (nsenv == 0)
-		nsenv = ipc_find_env(ENV_TYPE_NS);
+		nsenv = ipc_lookup("ns");
+	return nsenv;
+}
 
+static int
+nsipc(unsigned type)
+{
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
 
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+	ipc_send(nsipc_env(), type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
 	return ipc_recv(NULL, NULL, NULL);
 }
 
@@ -121,3 +126,86 @@ nsipc_socket(int domain, int type, int protocol)
 	nsipcbuf.socket.req_protocol = protocol;
 	return nsipc(NSREQ_SOCKET);
 }
+
+// Return the network server's socket readiness page, asking the server
+// to map it the first time.
+const volatile struct Nsready *
+nsipc_ready(void)
+{
+	int r, perm;
+
+	if ((uvpd[PDX(NSREADYVA)] & PTE_P) && (uvpt[PGNUM(NSREADYVA)] & PTE_P))
+		return (const volatile struct Nsready *) NSREADYVA;
+
+	ipc_send(nsipc_env(), NSREQ_READY, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+	if ((r = ipc_recv(NULL, (void *) NSREADYVA, &perm)) < 0)
+		panic("nsipc_ready: %e", r);
+	if (!(perm & PTE_P))
+		panic("nsipc_ready: no page");
+	return (const volatile struct Nsready *) NSREADYVA;
+}
+
+// Block until one of the sockets in fds (whose fd fields hold socket ids)
+// is ready for the requested events, or for 'timeout' ms if it is >= 0.
+// The events themselves are read from the readiness page.
+// Returns > 0 if some socket is ready, 0 on timeout, < 0 on error.
+int
+nsipc_poll(struct pollfd *fds, int nfds, int timeout)
+{
+	int i;
+
+	if (nfds > NSPOLL_MAX)
+		return -E_INVAL;
+	nsipcbuf.poll.req_nfds = nfds;
+	nsipcbuf.poll.req_timeout = timeout;
+	for (i = 0; i < nfds; i++) {
+		nsipcbuf.poll.req_fds[i].s = fds[i].fd;
+		nsipcbuf.poll.req_fds[i].events = fds[i].events;
+	}
+	return nsipc(NSREQ_POLL);
+}
+
+// Map the shared ring of socket s at NSRING(s), page by page.
+// Returns 0 on success, < 0 if the socket can't have a ring.
+int
+nsipc_ring(int s)
+{
+	int i, r, perm;
+
+	if (s < 0 || s >= NSRING_MAX)
+		return -E_INVAL;
+	for (i = 0; i < NSRING_NPAGES; i++) {
+		nsipcbuf.ring.req_s = s;
+		nsipcbuf.ring.req_page = i;
+		ipc_send(nsipc_env(), NSREQ_RING, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+		perm = 0;
+		r = ipc_recv(NULL, (uint8_t *) NSRING(s) + i * PGSIZE, &perm);
+		if (r >= 0 && !(perm & PTE_P))
+			r = -E_INVAL;
+		if (r < 0) {
+			while (--i >= 0)
+				sys_page_unmap(0, (uint8_t *) NSRING(s) + i * PGSIZE);
+			return r;
+		}
+	}
+	return 0;
+}
+
+// Send the first 'len' bytes of page 'pg' on socket s.  The page itself
+// is handed to the network server, so the data is not copied on the way.
+int
+nsipc_sendpage(int s, const void *pg, int len)
+{
+	if (s < 0 || s > 0xff || len < 0 || len > PGSIZE)
+		return -E_INVAL;
+	ipc_send(nsipc_env(), NSSENDPAGE(s, len), (void *) pg, PTE_P|PTE_U);
+	return ipc_recv(NULL, NULL, NULL);
+}
+
+// Tell the network server to look at the ring of socket s again.
+// No reply is sent.
+void
+nsipc_kick(int s)
+{
+	ipc_send(nsipc_env(), NSKICK(s), 0, 0);
+}
@@ -0,0 +1,248 @@
+#include <inc/lib.h>
+#include <inc/elf.h>
+
+/*
+ * Demand paging for spawn().
+ *
+ * spawn() doesn't load the program.  The child starts out with its
+ * stack, the pages of the pager and the pager's pages at PAGERVA, and
+ * its first touch of any other page of the program faults into
+ * _pager_fault, which asks the file server for the block of the
+ * program file behind it:
+ *
+ *  - Text pages map the file server's cached copy of the block itself,
+ *    read-only, so every instance of a program shares one copy.
+ *
+ *  - Data pages, and text pages the file only partly fills, get a page
+ *    of their own with the file's part copied in.  Bss pages are just
+ *    allocated.
+ *
+ * The pager has to work before anything else of the program is there,
+ * so all the code it runs is in the "pager" section, which user.ld puts
+ * at the start of every program -- that is how spawn() knows where the
+ * child's pager is, and which pages to map for it.  That code uses no
+ * data of the program, only the pages at PAGERVA, envs[] and uvpt.
+ *
+ * The Fd page at PAGERFD keeps the program file open for as long as
+ * the child, or a child it forks, is around.
+ */
+
+#define PAGERFD		(PAGERVA + PGSIZE)	// Fd page of the program file
+#define PAGERREQ	(PAGERVA + 2 * PGSIZE)	// request to the file server
+#define PAGERTMP	(PAGERVA + 3 * PGSIZE)	// block being copied
+
+#define MAXSEGS		8
+#define PAGER		__attribute__((section("pager")))
+
+struct PagerSeg {
+	uintptr_t ps_va;	// start, page-aligned
+	size_t ps_memsz;	// size in memory, from ps_va
+	size_t ps_filesz;	// bytes that come from the file, from ps_va
+	off_t ps_offset;	// file offset of ps_va
+	int ps_perm;		// PTE_P|PTE_U, plus PTE_W for data
+};
+
+// At PAGERVA in the child, read-only
+struct Pager {
+	envid_t pg_fsenv;	// the file server
+	int pg_fileid;		// the program file on the file server
+	int pg_nsegs;
+	struct PagerSeg pg_segs[MAXSEGS];
+};
+
+extern char epager[];	// end of the pager's code, see user.ld
+extern void _pager_upcall(void);
+
+static PAGER int32_t
+pager_syscall(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
+	      uint32_t a5)
+{
+	int32_t ret;
+
+	asm volatile("int %1\n"
+		: "=a" (ret)
+		: "i" (T_SYSCALL),
+		  "a" (num),
+		  "d" (a1),
+		  "c" (a2),
+		  "b" (a3),
+		  "D" (a4),
+		  "S" (a5)
+		: "cc", "memory");
+	return ret;
+}
+
+// Send request 'type' with request page 'req' to the file server
+// 'fsenv', and return its reply, mapping the page that comes with it,
+// if any, at 'dstva'.  'self' is the caller's Env.
+//
+// fsipc uses this too.  Nothing on the way from the request to the
+// reply can fault into the pager, which would take the reply for the
+// answer to its own request.
+PAGER int32_t
+fsipc_call(envid_t fsenv, unsigned type, void *req, void *dstva,
+	   const volatile struct Env *self)
+{
+	int r;
+
+	while ((r = pager_syscall(SYS_ipc_try_send, fsenv, type,
+				  (uint32_t) req, PTE_P|PTE_W|PTE_U, 0))
+	       == -E_IPC_NOT_RECV)
+		pager_syscall(SYS_yield, 0, 0, 0, 0, 0);
+	if (r < 0)
+		return r;
+	if ((r = pager_syscall(SYS_ipc_recv_from, (uint32_t) dstva, fsenv,
+			       0, 0, 0)) < 0)
+		return r;
+	return self->env_ipc_value;
+}
+
+static PAGER struct PagerSeg *
+pager_seg(struct Pager *p, uintptr_t va)
+{
+	int i;
+
+	for (i = 0; i < p->pg_nsegs; i++)
+		if (p->pg_segs[i].ps_va <= va
+		    && va - p->pg_segs[i].ps_va < p->pg_segs[i].ps_memsz)
+			return &p->pg_segs[i];
+	return 0;
+}
+
+static PAGER bool
+pager_mapped(uintptr_t va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+// Map the block of the program file at 'offset' at 'va', read-only.
+// Returns the number of bytes of the file in it, 0 past the end of
+// the file, < 0 on error.
+static PAGER int
+pager_mapblock(struct Pager *p, off_t offset, uintptr_t va)
+{
+	struct Fsreq_map *req = (struct Fsreq_map *) PAGERREQ;
+	int r;
+
+	// fork leaves the request page copy-on-write
+	if (!pager_mapped(PAGERREQ) || !(uvpt[PGNUM(PAGERREQ)] & PTE_W))
+		if ((r = pager_syscall(SYS_page_alloc, 0, PAGERREQ,
+				       PTE_P|PTE_U|PTE_W, 0, 0)) < 0)
+			return r;
+	req->req_fileid = p->pg_fileid;
+	req->req_offset = offset;
+	return fsipc_call(p->pg_fsenv, FSREQ_MAP, req, (void *) va,
+			  &envs[ENVX(pager_syscall(SYS_getenvid, 0, 0, 0, 0, 0))]);
+}
+
+// Called by _pager_upcall.  Returns 1 if it loaded the page, 0 if the
+// fault isn't for a page of the program that isn't there yet.
+PAGER int
+_pager_fault(struct UTrapframe *utf)
+{
+	struct Pager *p = (struct Pager *) PAGERVA;
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	struct PagerSeg *s;
+	size_t off, n;
+	void *dst, *src;
+
+	if (!(s = pager_seg(p, va)) || pager_mapped(va))
+		return 0;
+	off = va - s->ps_va;
+
+	// Text the file fills the whole page of: share the cached block
+	if (!(s->ps_perm & PTE_W) && off + PGSIZE <= s->ps_filesz)
+		return pager_mapblock(p, s->ps_offset + off, va) > 0;
+
+	if (pager_syscall(SYS_page_alloc, 0, va, PTE_P|PTE_U|PTE_W, 0, 0) < 0)
+		return 0;
+	if (off < s->ps_filesz) {
+		if (pager_mapblock(p, s->ps_offset + off, PAGERTMP) <= 0)
+			return 0;
+		n = MIN(PGSIZE, s->ps_filesz - off);
+		dst = (void *) va;
+		src = (void *) PAGERTMP;
+		asm volatile("cld; rep movsb"
+			     : "+D" (dst), "+S" (src), "+c" (n) : : "cc", "memory");
+		pager_syscall(SYS_page_unmap, 0, PAGERTMP, 0, 0, 0);
+	}
+	if (!(s->ps_perm & PTE_W)
+	    && pager_syscall(SYS_page_map, 0, va, 0, va, PTE_P|PTE_U) < 0)
+		return 0;
+	return 1;
+}
+
+// Set up 'child' to load the program open as 'fdnum', whose ELF header
+// is 'elf', on demand.  Maps nothing of the program but the pager.
+// Returns 0 on success, -E_NOT_SUPP if the program can't be loaded on
+// demand, which leaves the child untouched, < 0 on other errors.
+int
+pager_setup(envid_t child, int fdnum, struct Elf *elf)
+{
+	struct Proghdr *ph = (struct Proghdr *) ((uint8_t *) elf + elf->e_phoff);
+	struct Pager *p = (struct Pager *) UTEMP;
+	void *tmp = (void *) (UTEMP + PGSIZE);
+	struct PagerSeg *s;
+	struct Fd *fd;
+	uintptr_t va;
+	int i, r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((r = sys_page_alloc(0, p, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+
+	p->pg_fsenv = ipc_lookup("fs");
+	p->pg_fileid = fd->fd_file.id;
+	p->pg_nsegs = 0;
+	for (i = 0; i < elf->e_phnum; i++, ph++) {
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		if (p->pg_nsegs == MAXSEGS) {
+			r = -E_NOT_SUPP;
+			goto out;
+		}
+		s = &p->pg_segs[p->pg_nsegs++];
+		s->ps_va = ROUNDDOWN(ph->p_va, PGSIZE);
+		s->ps_memsz = ph->p_memsz + PGOFF(ph->p_va);
+		s->ps_filesz = ph->p_filesz + PGOFF(ph->p_va);
+		s->ps_offset = ph->p_offset - PGOFF(ph->p_va);
+		s->ps_perm = PTE_P|PTE_U;
+		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+			s->ps_perm |= PTE_W;
+	}
+
+	// The child's pager must be where ours is, in text
+	for (va = UTEXT; va < (uintptr_t) epager; va += PGSIZE)
+		if (!(s = pager_seg(p, va)) || (s->ps_perm & PTE_W)
+		    || va - s->ps_va + PGSIZE > s->ps_filesz) {
+			r = -E_NOT_SUPP;
+			goto out;
+		}
+
+	for (va = UTEXT; va < (uintptr_t) epager; va += PGSIZE) {
+		s = pager_seg(p, va);
+		if ((r = fmapblock(fdnum, s->ps_offset + (va - s->ps_va), tmp)) <= 0) {
+			r = r < 0 ? r : -E_NOT_EXEC;
+			goto out;
+		}
+		r = sys_page_map(0, tmp, child, (void *) va, PTE_P|PTE_U);
+		sys_page_unmap(0, tmp);
+		if (r < 0)
+			goto out;
+	}
+
+	if ((r = sys_page_map(0, p, child, (void *) PAGERVA, PTE_P|PTE_U)) < 0
+	    || (r = sys_page_map(0, fd, child, (void *) PAGERFD,
+				 PTE_P|PTE_U|PTE_SHARE)) < 0
+	    || (r = sys_page_alloc(child, (void *) (UXSTACKTOP - PGSIZE),
+				   PTE_P|PTE_U|PTE_W)) < 0)
+		goto out;
+	r = sys_env_set_pgfault_upcall(child, (void *) _pager_upcall);
+
+out:
+	sys_page_unmap(0, p);
+	return r;
+}
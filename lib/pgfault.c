@@ -13,6 +13,67 @@ extern void _pgfault_upcall(void);
 // Pointer to currently installed C-language pgfault handler.
 void (*_pgfault_handler)(struct UTrapframe *utf);
 
+// Hooks for faults in address ranges that library code manages itself,
+// such as mmap()ed files.  They are tried before _pgfault_handler, and
+// return 1 if they took care of the fault, 0 if it isn't theirs.
+#define NHOOKS		4
+static int (*hooks[NHOOKS])(struct UTrapframe *utf);
+
+static bool upcall_set;
+
+static void
+pgfault_upcall_init(void)
+{
+	envid_t envid;
+
+	if (upcall_set)
+		return;
+	// Programs spawn() loads on demand start out with an upcall and
+	// exception stack already: the pager's, which passes the faults
+	// that aren't its own on to _pgfault_upcall.
+	upcall_set = 1;
+	if (thisenv && thisenv->env_pgfault_upcall)
+		return;
+	envid = sys_getenvid();
+	sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE), PTE_U | PTE_W);
+	sys_env_set_pgfault_upcall(envid, (void *) _pgfault_upcall);
+}
+
+// Called by _pgfault_upcall
+void
+_pgfault_dispatch(struct UTrapframe *utf)
+{
+	int i;
+
+	for (i = 0; i < NHOOKS && hooks[i]; i++)
+		if (hooks[i](utf))
+			return;
+	if (!_pgfault_handler)
+		panic("unhandled page fault at va %08x, eip %08x, err %x",
+		      utf->utf_fault_va, utf->utf_eip, utf->utf_err);
+	_pgfault_handler(utf);
+}
+
+// Add a hook to be tried on every page fault, before the handler set
+// with set_pgfault_handler.
+// Returns 0 on success, -E_NO_MEM if there are too many hooks.
+int
+add_pgfault_hook(int (*hook)(struct UTrapframe *utf))
+{
+	int i;
+
+	for (i = 0; i < NHOOKS; i++) {
+		if (hooks[i] == hook)
+			return 0;
+		if (!hooks[i]) {
+			hooks[i] = hook;
+			pgfault_upcall_init();
+			return 0;
+		}
+	}
+	return -E_NO_MEM;
+}
+
 //
 // Set the page fault handler function.
 // If there isn't one yet, _pgfault_handler will be 0.
@@ -24,14 +85,10 @@ void (*_pgfault_handler)(struct UTrapframe *utf);
 void
 set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
 {
-	int r;
-
 	if (_pgfault_handler == 0) {
 		// First time through!
 		// LAB 4: Your code here.
-		envid_t envid = sys_getenvid();
-		sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE), PTE_U | PTE_W);
-		sys_env_set_pgfault_upcall(envid, (void *) _pgfault_upcall);
+		pgfault_upcall_init();
 	}
 
 	// Save handler pointer for assembly to call.
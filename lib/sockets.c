@@ -1,10 +1,14 @@
 #include <inc/lib.h>
 #include <lwip/sockets.h>
 
+// Where sendfile maps file blocks, between NSREADYVA and NSRINGVA
+#define SENDFILEVA	0xE4300000
+
 static ssize_t devsock_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devsock_write(struct Fd *fd, const void *buf, size_t n);
 static int devsock_close(struct Fd *fd);
 static int devsock_stat(struct Fd *fd, struct Stat *stat);
+static int devsock_poll(struct Fd *fd, int events);
 
 struct Dev devsock =
 {
@@ -14,6 +18,7 @@ struct Dev devsock =
 	.dev_write =	devsock_write,
 	.dev_close =	devsock_close,
 	.dev_stat =	devsock_stat,
+	.dev_poll =	devsock_poll,
 };
 
 static int
@@ -44,9 +49,22 @@ alloc_sockfd(int sockid)
 	sfd->fd_dev_id = devsock.dev_id;
 	sfd->fd_omode = O_RDWR;
 	sfd->fd_sock.sockid = sockid;
+	sfd->fd_sock.ring = 0;
 	return fd2num(sfd);
 }
 
+// Switch a connected socket over to its shared ring.  Sockets the
+// server can't give a ring to keep using one IPC per call.
+static void
+sockring_setup(int fdnum)
+{
+	struct Fd *sfd;
+
+	if (fd_lookup(fdnum, &sfd) == 0
+	    && nsipc_ring(sfd->fd_sock.sockid) == 0)
+		sfd->fd_sock.ring = 1;
+}
+
 int
 accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
@@ -55,7 +73,9 @@ accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 		return r;
 	if ((r = nsipc_accept(r, addr, addrlen)) < 0)
 		return r;
-	return alloc_sockfd(r);
+	if ((r = alloc_sockfd(r)) >= 0)
+		sockring_setup(r);
+	return r;
 }
 
 int
@@ -76,13 +96,190 @@ shutdown(int s, int how)
 	return nsipc_shutdown(r, how);
 }
 
+//
+// Shared socket rings (see inc/ns.h).
+//
+
+// Take the completions the network server posted for this ring.
+static void
+ring_reap(int s, struct Nsring *ring)
+{
+	uint32_t head, tail, i;
+	struct Nscqe *e;
+
+	tail = ring->nr_cq_tail;
+	head = ring->nr_cq_head;
+	if (tail == head)
+		return;
+	__sync_synchronize();
+
+	for (i = tail; i != head; i++) {
+		e = &ring->nr_cq[i % NSCQ_SIZE];
+		if (e->cq_op == NSOP_SEND && e->cq_res < 0 && !ring->nr_txerr)
+			ring->nr_txerr = e->cq_res;
+		if (e->cq_op == NSOP_RECV) {
+			ring->nr_rxerr = e->cq_res;
+			ring->nr_rxdone = 1;
+		}
+	}
+
+	// Completions only set sticky state, so if another env sharing
+	// the socket reaped them at the same time, it doesn't matter who
+	// wins.  The server holds completions back while the queue is full.
+	if (__sync_bool_compare_and_swap(&ring->nr_cq_tail, tail, head)
+	    && head - tail == NSCQ_SIZE)
+		nsipc_kick(s);
+}
+
+// Kick the server if it is sleeping on ring buffer 'b'.
+static void
+ring_doorbell(int s, struct Nsring_buf *b)
+{
+	__sync_synchronize();
+	if (b->nb_idle && __sync_bool_compare_and_swap(&b->nb_idle, 1, 0))
+		nsipc_kick(s);
+}
+
+// Sleep until the server moves ring buffer 'b' on from 'head' and 'tail',
+// or posts a completion.
+static void
+ring_wait(struct Nsring *ring, struct Nsring_buf *b, uint32_t head,
+	  uint32_t tail)
+{
+	envid_t me = thisenv->env_id;
+
+	// Somebody sharing the socket already sleeps on it, so poll
+	if (!__sync_bool_compare_and_swap(&b->nb_waiter, 0, me)) {
+		sys_yield();
+		return;
+	}
+
+	// Check again now that the server knows we are waiting.  If we
+	// can't take our name back, the server is about to wake us up.
+	if ((b->nb_head != head || b->nb_tail != tail
+	     || ring->nr_cq_head != ring->nr_cq_tail)
+	    && __sync_bool_compare_and_swap(&b->nb_waiter, me, 0))
+		return;
+
+	// Once the server has taken our name, it keeps trying its wakeup
+	// until we receive it (see ring_notify in net/serv.c), so this
+	// can't miss it.  Only take it from the server: anybody else
+	// sending to us stays in its ipc_send until we are done here.
+	sys_ipc_recv_from((void *) KERNBASE, nsipc_env());
+	__sync_bool_compare_and_swap(&b->nb_waiter, me, 0);
+}
+
+static ssize_t
+ring_read(int s, struct Nsring *ring, void *buf, size_t n)
+{
+	struct Nsring_buf *b = &ring->nr_rx;
+	uint32_t head, tail, m, tot;
+
+	while (1) {
+		head = b->nb_head;
+		tail = b->nb_tail;
+		if (head != tail)
+			break;
+		ring_reap(s, ring);
+		if (ring->nr_rxdone) {
+			// Completions come after the data they follow
+			if (b->nb_head != tail)
+				continue;
+			return ring->nr_rxerr;
+		}
+		ring_wait(ring, b, head, tail);
+	}
+
+	__sync_synchronize();
+	n = MIN(n, head - tail);
+	for (tot = 0; tot < n; tot += m) {
+		m = MIN(n - tot, NSRING_DATA - (tail + tot) % NSRING_DATA);
+		memmove((uint8_t *) buf + tot,
+			&ring->nr_rxbuf[(tail + tot) % NSRING_DATA], m);
+	}
+	__sync_synchronize();
+	b->nb_tail = tail + n;
+	ring_doorbell(s, b);
+	return n;
+}
+
+static ssize_t
+ring_write(int s, struct Nsring *ring, const void *buf, size_t n)
+{
+	struct Nsring_buf *b = &ring->nr_tx;
+	uint32_t head, tail, m, tot;
+
+	for (tot = 0; tot < n; ) {
+		ring_reap(s, ring);
+		if (ring->nr_txerr)
+			return tot ? tot : ring->nr_txerr;
+
+		head = b->nb_head;
+		tail = b->nb_tail;
+		if (head - tail == NSRING_DATA) {
+			ring_wait(ring, b, head, tail);
+			continue;
+		}
+
+		m = MIN(n - tot, NSRING_DATA - (head - tail));
+		m = MIN(m, NSRING_DATA - head % NSRING_DATA);
+		memmove(&ring->nr_txbuf[head % NSRING_DATA],
+			(const uint8_t *) buf + tot, m);
+		__sync_synchronize();
+		b->nb_head = head + m;
+		ring_doorbell(s, b);
+		tot += m;
+	}
+	return n;
+}
+
+// Wait until the server took everything we queued.
+static void
+ring_drain(int s, struct Nsring *ring)
+{
+	struct Nsring_buf *b = &ring->nr_tx;
+	uint32_t head, tail;
+
+	while (1) {
+		ring_reap(s, ring);
+		head = b->nb_head;
+		tail = b->nb_tail;
+		if (head == tail || ring->nr_txerr)
+			return;
+		ring_wait(ring, b, head, tail);
+	}
+}
+
+static int
+ring_poll(int s, struct Nsring *ring)
+{
+	int events = 0;
+
+	ring_reap(s, ring);
+	if (ring->nr_rx.nb_head != ring->nr_rx.nb_tail || ring->nr_rxdone)
+		events |= POLLIN;
+	if (ring->nr_tx.nb_head - ring->nr_tx.nb_tail < NSRING_DATA)
+		events |= POLLOUT;
+	if (ring->nr_txerr)
+		events |= POLLERR;
+	return events;
+}
+
 static int
 devsock_close(struct Fd *fd)
 {
-	if (pageref(fd) == 1)
-		return nsipc_close(fd->fd_sock.sockid);
-	else
+	int s = fd->fd_sock.sockid, i, r;
+
+	if (pageref(fd) != 1)
 		return 0;
+	if (!fd->fd_sock.ring)
+		return nsipc_close(s);
+
+	ring_drain(s, NSRING(s));
+	r = nsipc_close(s);
+	for (i = 0; i < NSRING_NPAGES; i++)
+		sys_page_unmap(0, (uint8_t *) NSRING(s) + i * PGSIZE);
+	return r;
 }
 
 int
@@ -91,7 +288,9 @@ connect(int s, const struct sockaddr *name, socklen_t namelen)
 	int r;
 	if ((r = fd2sockid(s)) < 0)
 		return r;
-	return nsipc_connect(r, name, namelen);
+	if ((r = nsipc_connect(r, name, namelen)) >= 0)
+		sockring_setup(s);
+	return r;
 }
 
 int
@@ -106,13 +305,58 @@ listen(int s, int backlog)
 static ssize_t
 devsock_read(struct Fd *fd, void *buf, size_t n)
 {
-	return nsipc_recv(fd->fd_sock.sockid, buf, n, 0);
+	int s = fd->fd_sock.sockid;
+
+	if (fd->fd_sock.ring)
+		return ring_read(s, NSRING(s), buf, n);
+	return nsipc_recv(s, buf, n, 0);
 }
 
 static ssize_t
 devsock_write(struct Fd *fd, const void *buf, size_t n)
 {
-	return nsipc_send(fd->fd_sock.sockid, buf, n, 0);
+	int s = fd->fd_sock.sockid;
+
+	if (fd->fd_sock.ring)
+		return ring_write(s, NSRING(s), buf, n);
+	return nsipc_send(s, buf, n, 0);
+}
+
+// Send 'count' bytes of the file open as 'filefd', starting at 'offset',
+// on socket 'sockfd'.  Whole blocks are mapped from the file server's
+// block cache and handed on to the network server, so their data never
+// passes through our own buffers.  Returns the number of bytes sent, or
+// < 0 if nothing could be sent.
+ssize_t
+sendfile(int sockfd, int filefd, off_t offset, size_t count)
+{
+	struct Fd *sfd;
+	size_t tot;
+	int r, s;
+
+	if ((r = fd_lookup(sockfd, &sfd)) < 0)
+		return r;
+	if (sfd->fd_dev_id != devsock.dev_id)
+		return -E_NOT_SUPP;
+	s = sfd->fd_sock.sockid;
+
+	for (tot = 0; tot < count; tot += r, offset += r) {
+		if ((r = fmapblock(filefd, offset, (void *) SENDFILEVA)) <= 0)
+			break;
+		r = MIN(r, count - tot);
+
+		if (offset % PGSIZE == 0) {
+			// Data still queued in the ring must go out first
+			if (sfd->fd_sock.ring)
+				ring_drain(s, NSRING(s));
+			r = nsipc_sendpage(s, (void *) SENDFILEVA, r);
+		} else
+			r = write(sockfd, (char *) SENDFILEVA + offset % PGSIZE, r);
+		if (r <= 0)
+			break;
+	}
+	sys_page_unmap(0, (void *) SENDFILEVA);
+	return tot ? tot : r;
 }
 
 static int
@@ -122,6 +366,41 @@ devsock_stat(struct Fd *fd, struct Stat *stat)
 	return 0;
 }
 
+// The network server keeps the readiness of every socket up to date in
+// a page we can read, so there is no need to ask it.
+static int
+devsock_poll(struct Fd *fd, int events)
+{
+	int s = fd->fd_sock.sockid;
+
+	if (s < 0 || s >= NSREADY_MAX)
+		return POLLNVAL;
+	if (fd->fd_sock.ring)
+		return ring_poll(s, NSRING(s));
+	return nsipc_ready()->nr_state[s];
+}
+
+// Block in the network server until one of the sockets in 'fds' is
+// ready, or for 'timeout' ms if it is >= 0.  Entries that aren't sockets
+// are ignored.  Returns > 0 if a socket may be ready, 0 on timeout.
+int
+socket_poll_wait(struct pollfd *fds, int nfds, int timeout)
+{
+	static struct pollfd sfds[NSPOLL_MAX];
+	int i, n, s;
+
+	for (i = n = 0; i < nfds; i++) {
+		if (fds[i].fd < 0 || (s = fd2sockid(fds[i].fd)) < 0)
+			continue;
+		if (n == NSPOLL_MAX)
+			return -E_INVAL;
+		sfds[n].fd = s;
+		sfds[n].events = fds[i].events;
+		n++;
+	}
+	return nsipc_poll(sfds, n, timeout);
+}
+
 int
 socket(int domain, int type, int protocol)
 {
@@ -27,6 +27,7 @@ spawn(const char *prog, const char **argv)
 	struct Elf *elf;
 	struct Proghdr *ph;
 	int perm;
+	bool lazy;
 
 	// This code follows this procedure:
 	//
@@ -84,6 +85,11 @@ spawn(const char *prog, const char **argv)
 	//     correct initial eip and esp values in the child.
 	//
 	//   - Start the child process running with sys_env_set_status().
+	//
+	// Nowadays the segments are only mapped like this if the program
+	// can't be loaded on demand by the pager (see pager.c), which is
+	// what normally happens: the child starts with nothing of the
+	// program but the pager, and faults the rest in as it goes.
 
 	if ((r = open(prog, O_RDONLY)) < 0)
 		return r;
@@ -110,9 +116,13 @@ spawn(const char *prog, const char **argv)
 	if ((r = init_stack(child, argv, &child_tf.tf_esp)) < 0)
 		return r;
 
-	// Set up program segments as defined in ELF header.
+	// Leave the program segments to the pager, or else set them up
+	// as defined in ELF header.
+	if ((r = pager_setup(child, fd, elf)) < 0 && r != -E_NOT_SUPP)
+		goto error;
+	lazy = (r == 0);
 	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
-	for (i = 0; i < elf->e_phnum; i++, ph++) {
+	for (i = 0; !lazy && i < elf->e_phnum; i++, ph++) {
 		if (ph->p_type != ELF_PROG_LOAD)
 			continue;
 		perm = PTE_P | PTE_U;
@@ -304,10 +314,22 @@ copy_shared_pages(envid_t child)
 	// Loop through all the pte's of parent's pgdir in user space
         uint32_t pn;
         for (pn = UTEXT/PGSIZE; pn < UTOP/PGSIZE; pn++) {
+		// Skip over our own pager's pages: the child has its own
+		if (PAGERVA/PGSIZE <= pn && pn < PAGERVA/PGSIZE + PAGER_NPAGES)
+			continue;
+
 		// Check if page table of this page number is allocated, using UVPD
 		if (uvpd[pn/NPTENTRIES] & PTE_P) {
-			// Retrieve the pte using UVPT, since we are in user space
-			pte_t pte = uvpt[pn];
+			// Retrieve the pte using UVPT, since we are in user space.
+			// A 4MB page has no page table: share it whole, using
+			// its PDE.
+			pte_t pte;
+			if (uvpd[pn/NPTENTRIES] & PTE_PS) {
+				if (pn % NPTENTRIES != 0)
+					continue;
+				pte = uvpd[pn/NPTENTRIES];
+			} else
+				pte = uvpt[pn];
 
 			// If PTE_SHARE is enable, share this page with the child
 			// by mapping it on the child in the same address and
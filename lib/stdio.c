@@ -0,0 +1,455 @@
+// Buffered streams on top of file descriptors, like C's stdio.
+//
+// Reading a file a byte or a line at a time with read() costs a file
+// server IPC for every call.  A stream reads ahead a whole buffer
+// (a page by default, which is the most one FSREQ_READ returns) and
+// hands it out from there, and it collects what is written until the
+// buffer fills up (or, for line-buffered streams, a line is done) and
+// writes it out with one write().
+//
+// What is still in a stream's buffer when the environment exits is
+// written out, but fork() copies the buffers: fflush a stream before
+// forking, or the child may write the same output again.
+
+#include <inc/lib.h>
+
+enum {
+	S_READ = 1 << 0,	// Opened for reading
+	S_WRITE = 1 << 1,	// Opened for writing
+	S_READING = 1 << 2,	// s_buf holds read-ahead data
+	S_WRITING = 1 << 3,	// s_buf holds data not written yet
+	S_EOF = 1 << 4,		// Reached the end of the file
+	S_MYBUF = 1 << 5,	// s_buf came from malloc
+};
+
+struct Stream {
+	int s_fd;		// File descriptor, -1 if the stream is free
+	int s_flags;		// S_*
+	int s_bufmode;		// _IOFBF, _IOLBF, _IONBF, or -1 to decide
+	int s_error;		// First error, 0 if none
+	char *s_buf;		// Buffer, allocated on first use if NULL
+	size_t s_bufsize;
+	size_t s_pos;		// Next byte in s_buf to read or write
+	size_t s_len;		// Bytes of read-ahead in s_buf
+	char s_ch;		// The buffer of an unbuffered stream
+};
+
+#define FOPEN_MAX	16
+
+static struct Stream streams[FOPEN_MAX] = {
+	{ 0, S_READ, _IOFBF },
+	{ 1, S_WRITE, -1 },	// Line-buffered if it is the console
+	{ 2, S_WRITE, _IONBF },
+	[3 ... FOPEN_MAX - 1] = { -1 }
+};
+
+FILE *stdin = &streams[0];
+FILE *stdout = &streams[1];
+FILE *stderr = &streams[2];
+
+// Set the stream's buffer up, if it has none yet.
+// Returns 0 on success, < 0 on error.
+static int
+stream_buffer(FILE *f)
+{
+	if (f->s_buf)
+		return 0;
+	if (f->s_bufmode < 0)
+		f->s_bufmode = iscons(f->s_fd) > 0 ? _IOLBF : _IOFBF;
+	if (f->s_bufmode == _IONBF) {
+		f->s_buf = &f->s_ch;
+		f->s_bufsize = 1;
+		return 0;
+	}
+	if (!f->s_bufsize)
+		f->s_bufsize = BUFSIZ;
+	if (!(f->s_buf = malloc(f->s_bufsize)))
+		return f->s_error = -E_NO_MEM;
+	f->s_flags |= S_MYBUF;
+	return 0;
+}
+
+// Write all 'n' bytes at 'buf' to the stream's file descriptor.
+// Returns 0 on success, < 0 on error.
+static int
+stream_write(FILE *f, const char *buf, size_t n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = write(f->s_fd, buf, n)) <= 0) {
+			if (!f->s_error)
+				f->s_error = r < 0 ? r : -E_NO_DISK;
+			return f->s_error;
+		}
+		buf += r;
+		n -= r;
+	}
+	return 0;
+}
+
+// Write out what is in the buffer of a stream that is writing.
+// Returns 0 on success, < 0 on error.
+static int
+stream_drain(FILE *f)
+{
+	size_t n = f->s_pos;
+
+	f->s_pos = 0;
+	return stream_write(f, f->s_buf, n);
+}
+
+// Get the stream ready to read from.
+// Returns 0 on success, < 0 on error.
+static int
+stream_reading(FILE *f)
+{
+	int r;
+
+	if (!(f->s_flags & S_READ))
+		return -E_INVAL;
+	if (f->s_flags & S_READING)
+		return 0;
+	if ((r = fflush(f)) < 0 || (r = stream_buffer(f)) < 0)
+		return r;
+	f->s_flags |= S_READING;
+	return 0;
+}
+
+// Get the stream ready to write to.
+// Returns 0 on success, < 0 on error.
+static int
+stream_writing(FILE *f)
+{
+	int r;
+
+	if (!(f->s_flags & S_WRITE))
+		return -E_INVAL;
+	if (f->s_flags & S_WRITING)
+		return 0;
+	if ((r = fflush(f)) < 0 || (r = stream_buffer(f)) < 0)
+		return r;
+	f->s_flags |= S_WRITING;
+	return 0;
+}
+
+// Read ahead into the empty buffer of a stream that is reading.
+// Returns the number of bytes read, 0 at the end of the file, or < 0 on
+// error.
+static ssize_t
+stream_fill(FILE *f)
+{
+	ssize_t r;
+
+	if (f->s_flags & S_EOF)
+		return 0;
+	if ((r = read(f->s_fd, f->s_buf, f->s_bufsize)) < 0)
+		return f->s_error = r;
+	if (r == 0)
+		f->s_flags |= S_EOF;
+	f->s_pos = 0;
+	f->s_len = r;
+	return r;
+}
+
+// Open a stream on 'fd'.  'mode' is "r", "w" or "a" for reading,
+// writing or appending, with a '+' for both reading and writing; the
+// file descriptor must be open that way already.
+// Returns NULL if 'mode' is bad or FOPEN_MAX streams are open.
+FILE *
+fdopen(int fd, const char *mode)
+{
+	FILE *f;
+	int flags;
+
+	if (mode[0] == 'r')
+		flags = S_READ;
+	else if (mode[0] == 'w' || mode[0] == 'a')
+		flags = S_WRITE;
+	else
+		return NULL;
+	if (mode[1] == '+')
+		flags = S_READ | S_WRITE;
+
+	for (f = streams; f < streams + FOPEN_MAX; f++)
+		if (f->s_fd < 0)
+			break;
+	if (f == streams + FOPEN_MAX)
+		return NULL;
+	memset(f, 0, sizeof(*f));
+	f->s_fd = fd;
+	f->s_flags = flags;
+	f->s_bufmode = -1;
+	return f;
+}
+
+// Open the file 'path' as a stream, with 'mode' as for fdopen: "w"
+// creates the file or truncates it, and "a" creates it or writes at its
+// end.  Returns NULL if the file can't be opened.
+FILE *
+fopen(const char *path, const char *mode)
+{
+	struct Stat st;
+	FILE *f;
+	int fd, omode;
+
+	if (mode[0] == 'r')
+		omode = O_RDONLY;
+	else if (mode[0] == 'w')
+		omode = O_WRONLY | O_CREAT | O_TRUNC;
+	else if (mode[0] == 'a')
+		omode = O_WRONLY | O_CREAT;
+	else
+		return NULL;
+	if (mode[1] == '+')
+		omode = (omode & ~O_ACCMODE) | O_RDWR;
+
+	if ((fd = open(path, omode)) < 0)
+		return NULL;
+	if (mode[0] == 'a' && (fstat(fd, &st) < 0 || seek(fd, st.st_size) < 0))
+		goto fail;
+	if ((f = fdopen(fd, mode)))
+		return f;
+fail:
+	close(fd);
+	return NULL;
+}
+
+// Set the buffering of 'f' before it is first used: _IOFBF writes out
+// whole buffers, _IOLBF also writes out every line, and _IONBF writes
+// everything out right away.  'buf', if not NULL, is the 'size'-byte
+// buffer to use; otherwise one of 'size' bytes (BUFSIZ if 0) is
+// allocated.  Returns 0 on success, -E_INVAL if 'f' was used already.
+int
+setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+	if (f->s_buf)
+		return -E_INVAL;
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF)
+		return -E_INVAL;
+	f->s_bufmode = mode;
+	f->s_buf = size ? buf : NULL;
+	f->s_bufsize = size;
+	return 0;
+}
+
+// Write out what 'f' has buffered.  If it was reading, drop what it
+// read ahead, and seek its file descriptor back to where the reader got
+// to.  With 'f' NULL, flush all streams that are writing.
+// Returns 0 on success, < 0 on error.
+int
+fflush(FILE *f)
+{
+	struct Fd *fd;
+	int r = 0;
+
+	if (!f) {
+		for (f = streams; f < streams + FOPEN_MAX; f++)
+			if (f->s_fd >= 0 && (f->s_flags & S_WRITING)
+			    && fflush(f) < 0)
+				r = f->s_error;
+		return r;
+	}
+	if (f->s_flags & S_WRITING)
+		r = stream_drain(f);
+	else if ((f->s_flags & S_READING) && f->s_len > f->s_pos
+		 && (r = fd_lookup(f->s_fd, &fd)) == 0)
+		r = seek(f->s_fd, fd->fd_offset - (f->s_len - f->s_pos));
+	f->s_flags &= ~(S_READING | S_WRITING | S_EOF);
+	f->s_pos = f->s_len = 0;
+	return r;
+}
+
+// Flush 'f', close its file descriptor and free the stream.
+// Returns 0 on success, or the first error 'f' had.
+int
+fclose(FILE *f)
+{
+	int r = (f->s_flags & S_WRITING) ? stream_drain(f) : 0;
+
+	if (!r)
+		r = f->s_error;
+	close(f->s_fd);
+	if (f->s_flags & S_MYBUF)
+		free(f->s_buf);
+	memset(f, 0, sizeof(*f));
+	f->s_fd = -1;
+	return r;
+}
+
+// Returns whether a read from 'f' got to the end of the file.
+int
+feof(FILE *f)
+{
+	return (f->s_flags & S_EOF) && f->s_pos == f->s_len;
+}
+
+// Returns the first error 'f' had, 0 if none.
+int
+ferror(FILE *f)
+{
+	return f->s_error;
+}
+
+// Read 'n' items of 'size' bytes from 'f' into 'buf'.
+// Returns the number of whole items read: fewer than 'n' at the end of
+// the file or on error (see feof and ferror).
+size_t
+fread(void *buf, size_t size, size_t n, FILE *f)
+{
+	size_t want = size * n, got = 0, m;
+	ssize_t r;
+
+	if (!want || stream_reading(f) < 0)
+		return 0;
+	while (got < want) {
+		if (f->s_pos == f->s_len) {
+			// Reads of a whole buffer or more skip the buffer
+			if (want - got >= f->s_bufsize && !(f->s_flags & S_EOF)) {
+				r = read(f->s_fd, (char *) buf + got, want - got);
+				if (r < 0)
+					f->s_error = r;
+				else if (r == 0)
+					f->s_flags |= S_EOF;
+				else {
+					got += r;
+					continue;
+				}
+				break;
+			}
+			if (stream_fill(f) <= 0)
+				break;
+		}
+		m = MIN(want - got, f->s_len - f->s_pos);
+		memmove((char *) buf + got, f->s_buf + f->s_pos, m);
+		f->s_pos += m;
+		got += m;
+	}
+	return got / size;
+}
+
+// Write 'n' items of 'size' bytes from 'buf' to 'f'.
+// Returns the number of items written, fewer than 'n' on error.
+size_t
+fwrite(const void *buf, size_t size, size_t n, FILE *f)
+{
+	const char *p = buf;
+	size_t want = size * n, done = 0, m;
+
+	if (!want || stream_writing(f) < 0)
+		return 0;
+	while (done < want) {
+		// Writes of a whole buffer or more skip the buffer, and so
+		// do all writes on an unbuffered stream (its "buffer" is one
+		// byte), rather than going out a byte at a time
+		if (f->s_pos == 0 && f->s_bufmode != _IOLBF
+		    && want - done >= f->s_bufsize) {
+			if (stream_write(f, p + done, want - done) < 0)
+				break;
+			done = want;
+			break;
+		}
+		m = MIN(want - done, f->s_bufsize - f->s_pos);
+		memmove(f->s_buf + f->s_pos, p + done, m);
+		f->s_pos += m;
+		done += m;
+		if ((f->s_pos == f->s_bufsize
+		     || (f->s_bufmode == _IOLBF
+			 && memfind(p + done - m, '\n', m) != p + done))
+		    && stream_drain(f) < 0)
+			break;
+	}
+	return done / size;
+}
+
+// Read a character from 'f'.
+// Returns it, or EOF at the end of the file or on error.
+int
+fgetc(FILE *f)
+{
+	if (!(f->s_flags & S_READING) && stream_reading(f) < 0)
+		return EOF;
+	if (f->s_pos == f->s_len && stream_fill(f) <= 0)
+		return EOF;
+	return (unsigned char) f->s_buf[f->s_pos++];
+}
+
+// Write the character 'c' to 'f'.
+// Returns it, or EOF on error.
+int
+fputc(int c, FILE *f)
+{
+	char ch = c;
+
+	return fwrite(&ch, 1, 1, f) == 1 ? (unsigned char) c : EOF;
+}
+
+// Read a line from 'f' into 's', newline included, but at most
+// 'size' - 1 characters of it, and null-terminate it.
+// Returns 's', or NULL if nothing could be read.
+char *
+fgets(char *s, int size, FILE *f)
+{
+	char *nl;
+	int i = 0, m;
+
+	if (size <= 0 || stream_reading(f) < 0)
+		return NULL;
+	while (i < size - 1) {
+		if (f->s_pos == f->s_len && stream_fill(f) <= 0)
+			break;
+		m = MIN(size - 1 - i, (int) (f->s_len - f->s_pos));
+		nl = memfind(f->s_buf + f->s_pos, '\n', m);
+		if (nl < f->s_buf + f->s_pos + m)
+			m = nl - (f->s_buf + f->s_pos) + 1;
+		memmove(s + i, f->s_buf + f->s_pos, m);
+		f->s_pos += m;
+		i += m;
+		if (s[i - 1] == '\n')
+			break;
+	}
+	if (i == 0)
+		return NULL;
+	s[i] = '\0';
+	return s;
+}
+
+// Write the string 's' to 'f'.
+// Returns 0 on success, EOF on error.
+int
+fputs(const char *s, FILE *f)
+{
+	size_t n = strlen(s);
+
+	return fwrite(s, 1, n, f) == n ? 0 : EOF;
+}
+
+static void
+putch(int ch, void *thunk)
+{
+	FILE *f = thunk;
+
+	fputc(ch, f);
+}
+
+// Like vfprintf, but for streams: formats the output into the buffer
+// of 'f'.  Returns 0 on success, or the first error 'f' had.
+int
+vsfprintf(FILE *f, const char *fmt, va_list ap)
+{
+	vprintfmt(putch, f, fmt, ap);
+	return f->s_error;
+}
+
+int
+sfprintf(FILE *f, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	va_start(ap, fmt);
+	r = vsfprintf(f, fmt, ap);
+	va_end(ap);
+
+	return r;
+}
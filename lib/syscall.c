@@ -19,17 +19,43 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// The last clause tells the assembler that this can
 	// potentially change the condition codes and arbitrary
 	// memory locations.
-
-	asm volatile("int %1\n"
-		: "=a" (ret)
-		: "i" (T_SYSCALL),
-		  "a" (num),
-		  "d" (a1),
-		  "c" (a2),
-		  "b" (a3),
-		  "D" (a4),
-		  "S" (a5)
-		: "cc", "memory");
+	//
+	// If the kernel set SYSENTER up, calls with no fifth parameter
+	// take it instead, which is a lot faster than a trap.  SYSEXIT
+	// comes back to the address in SI with the stack pointer in BP,
+	// and leaves CX and DX changed, so those four are saved on the
+	// stack around it (see sysenter_handler in kern/trapentry.S).
+
+	if (kstats.ks_sysenter && !a5)
+		asm volatile("pushl %%ebp\n\t"
+			     "pushl %%esi\n\t"
+			     "pushl %%edx\n\t"
+			     "pushl %%ecx\n\t"
+			     "movl %%esp, %%ebp\n\t"
+			     "leal 1f, %%esi\n\t"
+			     "sysenter\n"
+			     "1:\tpopl %%ecx\n\t"
+			     "popl %%edx\n\t"
+			     "popl %%esi\n\t"
+			     "popl %%ebp\n"
+			: "=a" (ret)
+			: "a" (num),
+			  "d" (a1),
+			  "c" (a2),
+			  "b" (a3),
+			  "D" (a4)
+			: "cc", "memory");
+	else
+		asm volatile("int %1\n"
+			: "=a" (ret)
+			: "i" (T_SYSCALL),
+			  "a" (num),
+			  "d" (a1),
+			  "c" (a2),
+			  "b" (a3),
+			  "D" (a4),
+			  "S" (a5)
+			: "cc", "memory");
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -40,6 +66,13 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 void
 sys_cputs(const char *s, size_t len)
 {
+	const char *p;
+
+	// Touch the string first: in a program spawn() loads on demand
+	// it may be on a page that isn't loaded yet, which the kernel
+	// would take for a bad pointer.
+	for (p = ROUNDDOWN(s, PGSIZE); p < s + len; p += PGSIZE)
+		(void) *(volatile const char *) MAX(p, s);
 	syscall(SYS_cputs, 0, (uint32_t)s, len, 0, 0, 0);
 }
 
@@ -67,12 +100,31 @@ sys_yield(void)
 	syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_env_set_kern_cow(envid_t envid, bool enable)
+{
+	return syscall(SYS_env_set_kern_cow, 1, envid, enable, 0, 0, 0);
+}
+
+envid_t
+sys_sfork(void *eip, void *esp, void *uxstacktop)
+{
+	return syscall(SYS_sfork, 0, (uint32_t) eip, (uint32_t) esp,
+		       (uint32_t) uxstacktop, 0, 0);
+}
+
 int
 sys_page_alloc(envid_t envid, void *va, int perm)
 {
 	return syscall(SYS_page_alloc, 1, envid, (uint32_t) va, perm, 0, 0);
 }
 
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_page_alloc_range, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
 int
 sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
 {
@@ -117,24 +169,71 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_until(void *dstva, uint64_t deadline)
+{
+	return syscall(SYS_ipc_recv_until, 1, (uint32_t) dstva,
+		       (uint32_t) deadline, (uint32_t) (deadline >> 32), 0, 0);
+}
+
+int
+sys_ipc_recv_from(void *dstva, envid_t from)
+{
+	return syscall(SYS_ipc_recv_from, 1, (uint32_t) dstva, from, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+uint64_t
+sys_time_nsec(void)
+{
+	uint64_t t;
+
+	syscall(SYS_time_nsec, 0, (uint32_t) &t, 0, 0, 0, 0);
+	return t;
+}
+
+int
+sys_sleep_until(uint64_t deadline)
+{
+	return syscall(SYS_sleep_until, 0, (uint32_t) deadline,
+		       (uint32_t) (deadline >> 32), 0, 0, 0);
+}
+
+int
+sys_trace(uint32_t mask, int drain)
+{
+	return syscall(SYS_trace, 0, mask, drain, 0, 0, 0);
+}
+
+int
+sys_service_register(const char *name)
+{
+	return syscall(SYS_service_register, 0, (uint32_t) name, strlen(name), 0, 0, 0);
+}
+
+envid_t
+sys_service_lookup(const char *name)
+{
+	return syscall(SYS_service_lookup, 0, (uint32_t) name, strlen(name), 0, 0, 0);
+}
+
 int
-sys_transmit_packet(void *buf, size_t size)
+sys_transmit_packet(void *buf, size_t size, struct nic_csum *csum)
 {
 	return syscall(SYS_transmit_packet, 1,
-		(uint32_t) buf, (uint32_t) size, 0, 0, 0);
+		(uint32_t) buf, (uint32_t) size, (uint32_t) csum, 0, 0);
 }
 
 int
-sys_receive_packet(void *buf, size_t *size_store)
+sys_receive_packet(void *buf, size_t *size_store, struct nic_csum *csum_store)
 {
 	return syscall(SYS_receive_packet, 1,
-		(uint32_t) buf, (uint32_t) size_store, 0, 0, 0);
+		(uint32_t) buf, (uint32_t) size_store, (uint32_t) csum_store, 0, 0);
 }
 
 int
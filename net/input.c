@@ -15,10 +15,8 @@ input(envid_t ns_envid)
 	// another packet in to the same physical page.
 	cprintf("NS INPUT ENV is on!\n");
 
-	// Get Network Server envid
-	// TODO:check why envid_t nsenv = ipc_find_env(ENV_TYPE_NS) doesnt work (returns 0)
-	// and unhardcode this
-	envid_t nsenv = 4097; // HARDCODED!
+	// Network Server envid
+	envid_t nsenv = ns_envid;
 
 	// Allocate some pages to receive page
 	char *bufs[10];
@@ -38,7 +36,7 @@ input(envid_t ns_envid)
 		union Nsipc *nsipc = (union Nsipc *) bufs[current_buffer];
 		char *packet_buf = (nsipc->pkt).jp_data;
 		size_t size = -1; // Could pass the jp_len instead
-		sys_receive_packet(packet_buf, &size);
+		sys_receive_packet(packet_buf, &size, &(nsipc->pkt).jp_csum);
 
 		// If it receives a packet, the size won't be -1 anymore
 		if (size != -1) {
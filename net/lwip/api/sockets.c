@@ -76,6 +76,14 @@ struct lwip_socket {
   int err;
 };
 
+/** Report changes in the readiness of a socket (JOS, see lwipopts.h) */
+#ifndef LWIP_SOCKET_READY
+#define LWIP_SOCKET_READY(s, readable, writable)
+#endif
+#define sock_ready(s, sock) \
+  LWIP_SOCKET_READY(s, (sock)->conn && ((sock)->lastdata || (sock)->rcvevent), \
+                    (sock)->conn && (sock)->sendevent)
+
 /** Description for a task waiting in select */
 struct lwip_select_cb {
   /** Pointer to the next waiting task */
@@ -228,6 +236,7 @@ alloc_socket(struct netconn *newconn)
       sockets[i].sendevent  = 1; /* TCP send buf is empty */
       sockets[i].flags      = 0;
       sockets[i].err        = 0;
+      sock_ready(i, &sockets[i]);
       sys_sem_signal(socksem);
       return i;
     }
@@ -303,6 +312,7 @@ lwip_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
    */
   nsock->rcvevent += -1 - newconn->socket;
   newconn->socket = newsock;
+  sock_ready(newsock, nsock);
   sys_sem_signal(socksem);
 
   LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_accept(%d) returning new sock=%d addr=", s, newsock));
@@ -371,6 +381,7 @@ lwip_close(int s)
   sock->lastoffset = 0;
   sock->conn       = NULL;
   sock_set_errno(sock, 0);
+  sock_ready(s, sock);
   sys_sem_signal(socksem);
   return 0;
 }
@@ -545,6 +556,9 @@ lwip_recvfrom(int s, void *mem, int len, unsigned int flags,
     }
   } while (!done);
 
+  /* lastdata may have changed */
+  sock_ready(s, sock);
+
   /* Check to see from where the data was.*/
   if (from && fromlen) {
     struct sockaddr_in sin;
@@ -1047,6 +1061,7 @@ event_callback(struct netconn *conn, enum netconn_evt evt, u16_t len)
       LWIP_ASSERT("unknown event", 0);
       break;
   }
+  sock_ready(s, sock);
   sys_sem_signal(selectsem);
 
   /* Now decide if anyone is waiting for this socket */
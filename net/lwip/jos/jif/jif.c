@@ -51,6 +51,118 @@ struct jif {
     envid_t envid;
 };
 
+/*
+ * Checksum offload.
+ *
+ * lwIP is built without software checksums (see lwipopts.h).  On output
+ * the E1000 fills them in: we tell it where they are, and seed the
+ * TCP/UDP checksum field with the sum of the pseudo header, which the
+ * hardware does not cover.  On input, we check in software whatever the
+ * hardware did not verify.
+ */
+
+#define ETH_HLEN	14
+#define ETHTYPE_IPV4	0x0800
+
+static u32_t
+csum_add(u32_t sum, const u8_t *data, int len)
+{
+    for (; len > 1; len -= 2, data += 2)
+	sum += (data[0] << 8) | data[1];
+    if (len)
+	sum += data[0] << 8;
+    return sum;
+}
+
+static u16_t
+csum_fold(u32_t sum)
+{
+    while (sum >> 16)
+	sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+// Sum of the TCP/UDP pseudo header of the IP packet at 'ip'
+static u32_t
+csum_pseudo(const u8_t *ip, int proto, int l4len)
+{
+    return csum_add(0, ip + 12, 8) + proto + l4len;
+}
+
+// Find the headers of an unfragmented IPv4 TCP or UDP packet.  Returns
+// the IP protocol, 0 if the packet has no L4 checksum we know of, or
+// -1 if it isn't IPv4 at all.
+static int
+pkt_headers(const u8_t *pkt, int len, int *ihl, int *l4len)
+{
+    const u8_t *ip = pkt + ETH_HLEN;
+
+    if (len < ETH_HLEN + 20 || ((pkt[12] << 8) | pkt[13]) != ETHTYPE_IPV4)
+	return -1;
+    *ihl = (ip[0] & 0xf) * 4;
+    *l4len = ((ip[2] << 8) | ip[3]) - *ihl;
+    if (*ihl < 20 || ETH_HLEN + *ihl + *l4len > len || *l4len < 0)
+	return -1;
+    // Fragments: the checksum covers the whole reassembled datagram
+    if (((ip[6] << 8) | ip[7]) & 0x3fff)
+	return 0;
+    if (ip[9] == IP_PROTO_TCP && *l4len >= 20)
+	return IP_PROTO_TCP;
+    if (ip[9] == IP_PROTO_UDP && *l4len >= 8)
+	return IP_PROTO_UDP;
+    return 0;
+}
+
+static void
+tx_csum(u8_t *pkt, int len, struct nic_csum *csum)
+{
+    int proto, ihl, l4len, off;
+    u16_t seed;
+
+    memset(csum, 0, sizeof(*csum));
+    if ((proto = pkt_headers(pkt, len, &ihl, &l4len)) < 0)
+	return;
+
+    csum->nc_flags = NIC_CSUM_IP;
+    csum->nc_ipstart = ETH_HLEN;
+    csum->nc_l4start = ETH_HLEN + ihl;
+    if (proto == 0)
+	return;
+
+    // UDP may go without a checksum, which is what lwIP left us
+    off = csum->nc_l4start + (proto == IP_PROTO_TCP ? 16 : 6);
+    seed = csum_fold(csum_pseudo(pkt + ETH_HLEN, proto, l4len));
+    pkt[off] = seed >> 8;
+    pkt[off + 1] = seed;
+    csum->nc_flags |= NIC_CSUM_L4;
+    if (proto == IP_PROTO_TCP)
+	csum->nc_flags |= NIC_CSUM_TCP;
+    csum->nc_l4sum = off;
+}
+
+// Returns 0 if the checksums of the received packet are good
+static int
+rx_csum_check(const u8_t *pkt, int len, struct nic_csum *csum)
+{
+    const u8_t *ip = pkt + ETH_HLEN, *l4;
+    int proto, ihl, l4len;
+
+    if ((proto = pkt_headers(pkt, len, &ihl, &l4len)) < 0)
+	return 0;
+    if (!(csum->nc_flags & NIC_CSUM_IP)
+	&& csum_fold(csum_add(0, ip, ihl)) != 0xffff)
+	return -1;
+    if (proto == 0 || (csum->nc_flags & NIC_CSUM_L4))
+	return 0;
+
+    l4 = ip + ihl;
+    if (proto == IP_PROTO_UDP && l4[6] == 0 && l4[7] == 0)
+	return 0;
+    if (csum_fold(csum_add(csum_pseudo(ip, proto, l4len), l4, l4len)) != 0xffff)
+	return -1;
+    return 0;
+}
+
 static void
 low_level_init(struct netif *netif)
 {
@@ -98,6 +210,7 @@ low_level_output(struct netif *netif, struct pbuf *p)
     }
 
     pkt->jp_len = txsize;
+    tx_csum((u8_t *) txbuf, txsize, &pkt->jp_csum);
 
     ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
     sys_page_unmap(0, (void *)pkt);
@@ -118,6 +231,11 @@ low_level_input(void *va)
     struct jif_pkt *pkt = (struct jif_pkt *)va;
     s16_t len = pkt->jp_len;
 
+    if (rx_csum_check((u8_t *) pkt->jp_data, len, &pkt->jp_csum) < 0) {
+	LWIP_DEBUGF(NETIF_DEBUG, ("jif: dropping packet with bad checksum\n"));
+	return 0;
+    }
+
     struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
     if (p == 0)
 	return 0;
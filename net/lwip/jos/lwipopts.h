@@ -10,6 +10,12 @@ void *memcpy(void *dst, const void *src, size_t n);
 
 //#define NO_SYS 1
 
+// The network server publishes the readiness of every socket for poll(),
+// see net/serv.c.  sockets.c reports changes through this hook.
+void ns_sock_ready(int s, int readable, int writable);
+#define LWIP_SOCKET_READY(s, readable, writable) \
+	ns_sock_ready(s, readable, writable)
+
 #define LWIP_STATS		0
 #define LWIP_STATS_DISPLAY	0
 #define LWIP_DHCP		1
@@ -17,6 +23,15 @@ void *memcpy(void *dst, const void *src, size_t n);
 //#define SYS_LIGHTWEIGHT_PROT	1
 #define LWIP_PROVIDE_ERRNO      1
 
+// The E1000 inserts the checksums of outgoing packets, and jif checks
+// those of incoming packets that the E1000 did not verify.
+#define CHECKSUM_GEN_IP		0
+#define CHECKSUM_GEN_UDP	0
+#define CHECKSUM_GEN_TCP	0
+#define CHECKSUM_CHECK_IP	0
+#define CHECKSUM_CHECK_UDP	0
+#define CHECKSUM_CHECK_TCP	0
+
 // Various tuning knobs, see:
 // http://lists.gnu.org/archive/html/lwip-users/2006-11/msg00007.html
 
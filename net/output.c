@@ -27,6 +27,7 @@ output(envid_t ns_envid)
 			// Unpack request
 			int size = (nsipc->pkt).jp_len;
 			char *buf = (nsipc->pkt).jp_data;
+			struct nic_csum *csum = &(nsipc->pkt).jp_csum;
 
 			/* Debugging */
 			//cprintf("NS OUTPUT ENV: Request to transmit pkt received"
@@ -34,7 +35,7 @@ output(envid_t ns_envid)
 
 			// Transmit the packet
 			int r;
-			if ((r = sys_transmit_packet(buf, size)) < 0)
+			if ((r = sys_transmit_packet(buf, size, csum)) < 0)
 				panic("sys_transmit_packet: %e", r);
 		} else {
 			panic("NS OUTPUT ENV: Invalid request received!");
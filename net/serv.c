@@ -43,6 +43,9 @@ static struct timer_thread t_arp;
 static struct timer_thread t_tcpf;
 static struct timer_thread t_tcps;
 
+// Readiness of every socket, shared read-only with clients
+static struct Nsready *nsready = (struct Nsready *) NSREADYVA;
+
 static envid_t timer_envid;
 static envid_t input_envid;
 static envid_t output_envid;
@@ -122,6 +125,320 @@ start_timer(struct timer_thread *t, void (*func)(void), const char *name, int ms
 		panic("cannot create timer thread: %s", e2s(r));
 }
 
+// Server side of the shared ring of a socket
+struct ring_state {
+	bool rs_active;		// The ring is mapped and being served
+	bool rs_closing;	// Tells the ring threads to exit
+	uint32_t rs_nthreads;	// Ring threads still running
+	uint32_t rs_rxgen;	// Bumped to wake up the receive thread
+	bool rs_rxended;	// The receive thread saw the end of the stream
+
+	// Completions that did not fit in the completion queue yet
+	uint32_t rs_sent;
+	int rs_txerr;
+	bool rs_rxdone;
+	int rs_rxres;
+};
+
+static struct ring_state rings[NSRING_MAX];
+
+static void
+sock_changed(void)
+{
+	nsready->nr_gen++;
+	thread_wakeup(&nsready->nr_gen);
+}
+
+// Called by lwIP's sockets.c whenever the readiness of socket 's' may
+// have changed.  Publish it in nsready, and wake up the poll requests
+// waiting for a change.
+void
+ns_sock_ready(int s, int readable, int writable)
+{
+	uint8_t state = (readable ? POLLIN : 0) | (writable ? POLLOUT : 0);
+
+	// A ring's receive thread waits for new data through here
+	if (s >= 0 && s < NSRING_MAX && rings[s].rs_active && readable) {
+		rings[s].rs_rxgen++;
+		thread_wakeup(&rings[s].rs_rxgen);
+	}
+
+	if (s < 0 || s >= NSREADY_MAX || nsready->nr_state[s] == state)
+		return;
+	nsready->nr_state[s] = state;
+	sock_changed();
+}
+
+//
+// Shared socket rings.
+//
+
+// Wake up the client sleeping on ring buffer 'b', if any.  Unlike
+// ipc_send, this doesn't panic: a client that is gone (-E_BAD_ENV)
+// needs no wakeup.  One that isn't in its receive yet (-E_IPC_NOT_RECV)
+// is about to be (see ring_wait in lib/sockets.c), so keep trying, but
+// let the other threads run meanwhile.
+static void
+ring_notify(struct Nsring_buf *b)
+{
+	envid_t waiter;
+
+	__sync_synchronize();
+	waiter = b->nb_waiter;
+	if (!waiter || !__sync_bool_compare_and_swap(&b->nb_waiter, waiter, 0))
+		return;
+	while (sys_ipc_try_send(waiter, NSRING_WAKEUP, (void *) KERNBASE, 0)
+	       == -E_IPC_NOT_RECV) {
+		thread_yield();
+		sys_yield();
+	}
+}
+
+static bool
+ring_post(struct Nsring *ring, int op, int res)
+{
+	struct Nscqe *e;
+
+	if (ring->nr_cq_head - ring->nr_cq_tail == NSCQ_SIZE)
+		return 0;
+	e = &ring->nr_cq[ring->nr_cq_head % NSCQ_SIZE];
+	e->cq_op = op;
+	e->cq_res = res;
+	__sync_synchronize();
+	ring->nr_cq_head++;
+	return 1;
+}
+
+// Move the pending completions of socket 's' to its completion queue,
+// as far as there is room.  Sends are merged into one completion.
+static void
+ring_flush(int s)
+{
+	struct ring_state *rs = &rings[s];
+	struct Nsring *ring = NSRING(s);
+	uint32_t head = ring->nr_cq_head;
+
+	if (rs->rs_sent && ring_post(ring, NSOP_SEND, rs->rs_sent))
+		rs->rs_sent = 0;
+	if (!rs->rs_sent && rs->rs_txerr
+	    && ring_post(ring, NSOP_SEND, rs->rs_txerr))
+		rs->rs_txerr = 0;
+	if (!rs->rs_sent && !rs->rs_txerr && rs->rs_rxdone
+	    && ring_post(ring, NSOP_RECV, rs->rs_rxres))
+		rs->rs_rxdone = 0;
+
+	if (ring->nr_cq_head != head) {
+		ring_notify(&ring->nr_tx);
+		ring_notify(&ring->nr_rx);
+	}
+}
+
+static void
+ring_complete(int s, int op, int res)
+{
+	struct ring_state *rs = &rings[s];
+
+	if (op == NSOP_SEND && res >= 0)
+		rs->rs_sent += res;
+	else if (op == NSOP_SEND)
+		rs->rs_txerr = res;
+	else {
+		rs->rs_rxdone = 1;
+		rs->rs_rxres = res;
+		rs->rs_rxended = 1;
+	}
+	ring_flush(s);
+	sock_changed();
+}
+
+// Drain the data the client queued into TCP, in as few lwip_send calls
+// as the ring allows.
+static void
+ring_tx_thread(uint32_t s)
+{
+	struct ring_state *rs = &rings[s];
+	struct Nsring_buf *b = &NSRING(s)->nr_tx;
+	uint32_t head, tail, n;
+	int r;
+
+	while (!rs->rs_closing) {
+		head = b->nb_head;
+		tail = b->nb_tail;
+		if (head == tail) {
+			// Ask the client for a kick once there is data
+			b->nb_idle = 1;
+			__sync_synchronize();
+			if (b->nb_head == tail && !rs->rs_closing)
+				thread_wait(&b->nb_head, tail, ~0);
+			b->nb_idle = 0;
+			continue;
+		}
+
+		n = MIN(head - tail, NSRING_DATA - tail % NSRING_DATA);
+		r = lwip_send(s, &NSRING(s)->nr_txbuf[tail % NSRING_DATA], n, 0);
+		if (r < 0) {
+			ring_complete(s, NSOP_SEND, r);
+			break;
+		}
+		b->nb_tail = tail + r;
+		ring_complete(s, NSOP_SEND, r);
+		ring_notify(b);
+	}
+
+	rs->rs_nthreads--;
+	thread_wakeup(&rs->rs_nthreads);
+}
+
+// Move received data into the ring as it arrives, until the stream ends.
+static void
+ring_rx_thread(uint32_t s)
+{
+	struct ring_state *rs = &rings[s];
+	struct Nsring_buf *b = &NSRING(s)->nr_rx;
+	uint32_t gen, head, tail, n;
+	int r;
+
+	while (!rs->rs_closing) {
+		gen = rs->rs_rxgen;
+		head = b->nb_head;
+		tail = b->nb_tail;
+		if (head - tail == NSRING_DATA) {
+			// Ask the client for a kick once there is room
+			b->nb_idle = 1;
+			__sync_synchronize();
+			if (b->nb_tail == tail && !rs->rs_closing)
+				thread_wait(&rs->rs_rxgen, gen, ~0);
+			b->nb_idle = 0;
+			continue;
+		}
+
+		// Never block inside lwIP, so that closing the socket
+		// can always stop this thread first.
+		n = MIN(NSRING_DATA - (head - tail),
+			NSRING_DATA - head % NSRING_DATA);
+		r = lwip_recv(s, &NSRING(s)->nr_rxbuf[head % NSRING_DATA], n,
+			      MSG_DONTWAIT);
+		if (r < 0 && errno == EWOULDBLOCK) {
+			thread_wait(&rs->rs_rxgen, gen, ~0);
+			continue;
+		}
+		if (r <= 0) {
+			ring_complete(s, NSOP_RECV, r);
+			break;
+		}
+		__sync_synchronize();
+		b->nb_head = head + r;
+		ring_notify(b);
+		sock_changed();
+	}
+
+	rs->rs_nthreads--;
+	thread_wakeup(&rs->rs_nthreads);
+}
+
+// Handle an NSREQ_RING: set up the ring of a socket when its first page
+// is asked for, and return the address of the requested page.
+static int
+serve_ring(struct Nsreq_ring *req, void **page)
+{
+	struct ring_state *rs;
+	int s = req->req_s, type, i, r;
+	socklen_t len = sizeof(type);
+
+	static_assert(sizeof(struct Nsring) == NSRING_NPAGES * PGSIZE);
+
+	if (s < 0 || s >= NSRING_MAX || req->req_page < 0
+	    || req->req_page >= NSRING_NPAGES)
+		return -E_INVAL;
+	rs = &rings[s];
+	*page = (uint8_t *) NSRING(s) + req->req_page * PGSIZE;
+	if (rs->rs_active)
+		return 0;
+	if (req->req_page != 0)
+		return -E_INVAL;
+
+	// Byte rings only make sense for stream sockets
+	if (lwip_getsockopt(s, SOL_SOCKET, SO_TYPE, &type, &len) < 0
+	    || type != SOCK_STREAM)
+		return -E_NOT_SUPP;
+
+	for (i = 0; i < NSRING_NPAGES; i++)
+		if ((r = sys_page_alloc(0, (uint8_t *) NSRING(s) + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			goto fail;
+
+	memset(rs, 0, sizeof(*rs));
+	rs->rs_active = 1;
+	if ((r = thread_create(0, "ring tx", ring_tx_thread, s)) < 0)
+		goto fail;
+	rs->rs_nthreads++;
+	if ((r = thread_create(0, "ring rx", ring_rx_thread, s)) < 0) {
+		// Make the send thread go away again
+		rs->rs_closing = 1;
+		while (rs->rs_nthreads)
+			thread_wait(&rs->rs_nthreads, rs->rs_nthreads, ~0);
+		goto fail;
+	}
+	rs->rs_nthreads++;
+	return 0;
+
+fail:
+	rs->rs_active = 0;
+	for (i = 0; i < NSRING_NPAGES; i++)
+		sys_page_unmap(0, (uint8_t *) NSRING(s) + i * PGSIZE);
+	return r;
+}
+
+// The client of socket 's' made room in, or added to, its ring.
+static void
+ring_kick(int s)
+{
+	struct ring_state *rs;
+
+	if (s < 0 || s >= NSRING_MAX || !(rs = &rings[s])->rs_active)
+		return;
+	ring_flush(s);
+	thread_wakeup(&NSRING(s)->nr_tx.nb_head);
+	rs->rs_rxgen++;
+	thread_wakeup(&rs->rs_rxgen);
+}
+
+// Stop serving the ring of socket 's' before the socket is closed.
+static void
+ring_stop(int s)
+{
+	struct ring_state *rs;
+	int i;
+
+	if (s < 0 || s >= NSRING_MAX || !(rs = &rings[s])->rs_active)
+		return;
+
+	rs->rs_closing = 1;
+	thread_wakeup(&NSRING(s)->nr_tx.nb_head);
+	rs->rs_rxgen++;
+	thread_wakeup(&rs->rs_rxgen);
+	while (rs->rs_nthreads)
+		thread_wait(&rs->rs_nthreads, rs->rs_nthreads, ~0);
+
+	rs->rs_active = 0;
+	for (i = 0; i < NSRING_NPAGES; i++)
+		sys_page_unmap(0, (uint8_t *) NSRING(s) + i * PGSIZE);
+}
+
+// The poll events of a socket that has a ring, seen from the client.
+static int
+ring_events(int s)
+{
+	struct Nsring *ring = NSRING(s);
+	int events = 0;
+
+	if (ring->nr_rx.nb_head != ring->nr_rx.nb_tail || rings[s].rs_rxended)
+		events |= POLLIN;
+	if (ring->nr_tx.nb_head - ring->nr_tx.nb_tail < NSRING_DATA)
+		events |= POLLOUT;
+	return events;
+}
+
 static void
 tcpip_init_done(void *arg)
 {
@@ -134,6 +451,11 @@ void
 serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 {
 	int r;
+
+	// Sockets report their readiness as soon as they are created
+	if ((r = sys_page_alloc(0, nsready, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("cannot allocate readiness page: %e", r);
+
 	lwip_core_lock();
 
 	uint32_t done = 0;
@@ -177,6 +499,37 @@ process_timer(envid_t envid) {
 	ipc_send(envid, to, 0, 0);
 }
 
+// Wait until one of the requested sockets is ready, or the request
+// times out.  The client reads the readiness itself from nsready.
+static int
+serve_poll(struct Nsreq_poll *req)
+{
+	uint32_t gen, deadline = ~0;
+	int i, s;
+
+	if (req->req_nfds < 0 || req->req_nfds > NSPOLL_MAX)
+		return -E_INVAL;
+	if (req->req_timeout >= 0)
+		deadline = sys_time_msec() + req->req_timeout;
+
+	while (1) {
+		gen = nsready->nr_gen;
+		for (i = 0; i < req->req_nfds; i++) {
+			s = req->req_fds[i].s;
+			if (s >= 0 && s < NSRING_MAX && rings[s].rs_active
+			    && (ring_events(s) & req->req_fds[i].events))
+				return 1;
+			if (s >= 0 && s < NSREADY_MAX
+			    && !(s < NSRING_MAX && rings[s].rs_active)
+			    && (nsready->nr_state[s] & req->req_fds[i].events))
+				return 1;
+		}
+		if (sys_time_msec() >= deadline)
+			return 0;
+		thread_wait(&nsready->nr_gen, gen, deadline);
+	}
+}
+
 struct st_args {
 	int32_t reqno;
 	uint32_t whom;
@@ -189,7 +542,7 @@ serve_thread(uint32_t a) {
 	union Nsipc *req = args->req;
 	int r;
 
-	switch (args->reqno) {
+	switch (NSREQ_TYPE(args->reqno)) {
 	case NSREQ_ACCEPT:
 	{
 		struct Nsret_accept ret;
@@ -207,6 +560,7 @@ serve_thread(uint32_t a) {
 		r = lwip_shutdown(req->shutdown.req_s, req->shutdown.req_how);
 		break;
 	case NSREQ_CLOSE:
+		ring_stop(req->close.req_s);
 		r = lwip_close(req->close.req_s);
 		break;
 	case NSREQ_CONNECT:
@@ -226,10 +580,18 @@ serve_thread(uint32_t a) {
 		r = lwip_send(req->send.req_s, &req->send.req_buf,
 			      req->send.req_size, req->send.req_flags);
 		break;
+	case NSREQ_SENDPAGE:
+		// The request page is the data, shared by the file server
+		r = lwip_send(NSREQ_SOCK(args->reqno), req,
+			      MIN(NSREQ_LEN(args->reqno), PGSIZE), 0);
+		break;
 	case NSREQ_SOCKET:
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
 		break;
+	case NSREQ_POLL:
+		r = serve_poll(&req->poll);
+		break;
 	case NSREQ_INPUT:
 		jif_input(&nif, (void *)&req->pkt);
 		r = 0;
@@ -281,6 +643,11 @@ serve(void) {
 			put_buffer(va);
 			continue;
 		}
+		if (NSREQ_TYPE(reqno) == NSREQ_KICK) {
+			ring_kick(NSREQ_SOCK(reqno));
+			put_buffer(va);
+			continue;
+		}
 
 		// All remaining requests must contain an argument page
 		if (!(perm & PTE_P)) {
@@ -288,6 +655,25 @@ serve(void) {
 			continue; // just leave it hanging...
 		}
 
+		// The readiness page is handed out right away
+		if (reqno == NSREQ_READY) {
+			ipc_send(whom, 0, nsready, PTE_P|PTE_U);
+			put_buffer(va);
+			sys_page_unmap(0, va);
+			continue;
+		}
+
+		// So are the pages of socket rings
+		if (reqno == NSREQ_RING) {
+			void *page = 0;
+			int r = serve_ring(&((union Nsipc *) va)->ring, &page);
+			ipc_send(whom, r, r < 0 ? 0 : page,
+				 PTE_P|PTE_U|PTE_W|PTE_SHARE);
+			put_buffer(va);
+			sys_page_unmap(0, va);
+			continue;
+		}
+
 		// Since some lwIP socket calls will block, create a thread and
 		// process the rest of the request in the thread.
 		struct st_args *args = malloc(sizeof(struct st_args));
@@ -0,0 +1,100 @@
+#!/usr/bin/env python
+
+# Turn the output of the kernel monitor's 'prof dump' command into the
+# "folded" call chains that flamegraph.pl draws flame graphs from:
+#
+#	make run-benchfile-nox INIT_CFLAGS=-DPROF_HZ=1000 | tee prof.out
+#	K> prof dump
+#	./prof2flame.py -u obj/user/benchfile prof.out | flamegraph.pl > prof.svg
+#
+# Kernel addresses are looked up in obj/kern/kernel.  User addresses are
+# looked up in the program given for their environment with -u ENVID=FILE,
+# or else the one given with plain -u FILE, or are left as numbers.
+
+from __future__ import print_function
+
+import os, re, sys, subprocess
+from optparse import OptionParser
+
+parser = OptionParser(usage="usage: %prog [options] [file...]")
+parser.add_option("-k", "--kernel", default="obj/kern/kernel",
+                  help="kernel image [default: %default]")
+parser.add_option("-u", "--user", action="append", default=[],
+                  metavar="[ENVID=]FILE",
+                  help="user program for environment ENVID, or for all")
+parser.add_option("--addr2line",
+                  default=os.environ.get("GCCPREFIX", "") + "addr2line",
+                  help="addr2line to use [default: %default]")
+(options, args) = parser.parse_args()
+
+PROF_LINE = re.compile(r"^PROF (\d+) ([0-9a-f]{8}) ([ku]) (\d+)((?: [0-9a-f]{8})+)\s*$")
+
+# Read the samples, adding up the CPUs'
+stacks = {}
+files = [open(a) for a in args] if args else [sys.stdin]
+for f in files:
+    for line in f:
+        m = PROF_LINE.match(line)
+        if not m:
+            continue
+        env, mode, count = m.group(2), m.group(3), int(m.group(4))
+        eips = tuple(int(x, 16) for x in m.group(5).split())
+        key = (env, mode, eips)
+        stacks[key] = stacks.get(key, 0) + count
+if not stacks:
+    sys.exit("no 'prof dump' output found")
+
+# Which file to look each address up in
+users = {}
+for u in options.user:
+    env, _, path = u.rpartition("=")
+    users[env.lower().zfill(8) if env else None] = path
+
+def binary(env, mode):
+    if mode == "k":
+        return options.kernel
+    return users.get(env, users.get(None))
+
+# Callers are looked up at their return address minus one, which is
+# still inside the call instruction
+def lookup_addr(eips, i):
+    return eips[i] - 1 if i > 0 else eips[i]
+
+wanted = {}
+for (env, mode, eips), count in stacks.items():
+    path = binary(env, mode)
+    if path:
+        for i in range(len(eips)):
+            wanted.setdefault(path, set()).add(lookup_addr(eips, i))
+
+names = {}
+for path, addrs in wanted.items():
+    addrs = sorted(addrs)
+    try:
+        out = subprocess.check_output(
+            [options.addr2line, "-f", "-e", path] + ["%x" % a for a in addrs])
+    except (OSError, subprocess.CalledProcessError) as e:
+        sys.exit("%s: %s" % (options.addr2line, e))
+    lines = out.decode().splitlines()
+    # Two lines per address: the function, then file:line
+    for a, fn in zip(addrs, lines[0::2]):
+        if fn != "??":
+            names[(path, a)] = fn
+
+def frame(path, a):
+    return names.get((path, a), "%08x" % a)
+
+# Print the call chains outermost first, as flamegraph.pl wants them
+folded = {}
+for (env, mode, eips), count in stacks.items():
+    path = binary(env, mode)
+    if mode == "k" and env == "00000000":
+        root = ["idle"]
+    else:
+        root = ["env " + env] + (["[kernel]"] if mode == "k" else [])
+    fns = [frame(path, lookup_addr(eips, i)) for i in range(len(eips))]
+    key = ";".join(root + fns[::-1])
+    folded[key] = folded.get(key, 0) + count
+
+for key in sorted(folded):
+    print("%s %d" % (key, folded[key]))
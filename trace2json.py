@@ -0,0 +1,164 @@
+#!/usr/bin/env python
+
+# Turn the kernel trace written out over the serial port (by 'trace -d',
+# or 'trace dump' in the kernel monitor) into a timeline in the Chrome
+# trace event format, to load into chrome://tracing or Perfetto:
+#
+#	make run-icode-nox INIT_CFLAGS=-DTRACE_MASK=TRACE_ALL | tee trace.out
+#	$ trace -d
+#	./trace2json.py trace.out > trace.json
+#
+# Each CPU is a row, showing which environment it ran when, with its
+# system calls and page faults inside, and interrupts and IPCs as
+# instants.  An arrow goes from each IPC send to the receiver running.
+
+from __future__ import print_function
+
+import re, sys, json, struct
+
+# inc/trace.h
+TR_ENV_RUN, TR_IDLE, TR_SYSCALL, TR_SYSCALL_RET, TR_IPC_SEND, TR_IPC_RECV, \
+    TR_PGFAULT, TR_PGFAULT_DONE, TR_IRQ = range(1, 10)
+TRACEREC = struct.Struct("<QBBHiII")
+
+# inc/syscall.h
+SYSCALLS = ["cputs", "cgetc", "getenvid", "env_destroy", "page_alloc",
+            "page_map", "page_unmap", "exofork", "env_set_status",
+            "env_set_trapframe", "env_set_pgfault_upcall", "yield",
+            "ipc_try_send", "ipc_recv", "time_msec", "transmit_packet",
+            "receive_packet", "get_mac_address", "page_alloc_range",
+            "env_set_kern_cow", "sfork", "time_nsec", "sleep_until",
+            "ipc_recv_until", "ipc_recv_from", "trace",
+            "service_register", "service_lookup"]
+
+def syscall_name(n):
+    return SYSCALLS[n] if n < len(SYSCALLS) else "syscall %d" % n
+
+def read_records(f):
+    hz, recs = None, []
+    for line in f:
+        line = line.strip()
+        m = re.match(r"TRACE BEGIN (\d+)$", line)
+        if m:
+            hz = int(m.group(1))
+            continue
+        m = re.match(r"TRACE LOST (\d+) (\d+)$", line)
+        if m:
+            print("CPU %s lost %s events" % m.groups(), file=sys.stderr)
+            continue
+        m = re.match(r"TRACE ([0-9a-f]{%d})$" % (2 * TRACEREC.size), line)
+        if m:
+            recs.append(TRACEREC.unpack(bytearray.fromhex(m.group(1))))
+    return hz, recs
+
+class Timeline(object):
+    def __init__(self, hz, start):
+        self.hz, self.start = hz, start
+        self.events = []
+        self.running = {}	# cpu -> (name, start ts)
+        self.inside = {}	# cpu -> [(name, start ts, args)]
+        self.flows = {}		# envid -> flow id of a send to it
+        self.nflows = 0
+
+    def ts(self, tsc):
+        return (tsc - self.start) * 1e6 / self.hz
+
+    def slice(self, cpu, name, start, end, args=None, cat="env"):
+        ev = {"ph": "X", "pid": 0, "tid": cpu, "name": name, "cat": cat,
+              "ts": start, "dur": max(end - start, 0)}
+        if args:
+            ev["args"] = args
+        self.events.append(ev)
+
+    def instant(self, cpu, name, ts, args):
+        self.events.append({"ph": "i", "s": "t", "pid": 0, "tid": cpu,
+                            "name": name, "ts": ts, "args": args})
+
+    def begin(self, cpu, name, ts, args):
+        self.inside.setdefault(cpu, []).append((name, ts, args))
+
+    def end(self, cpu, name, ts, args):
+        stack = self.inside.get(cpu, [])
+        while stack:
+            n, start, a = stack.pop()
+            if n == name:
+                a.update(args)
+                self.slice(cpu, n, start, ts, a, "kernel")
+                return
+
+    def switch(self, cpu, name, ts):
+        # Whatever was going on stopped (the environment blocked)
+        for n, start, a in self.inside.pop(cpu, []):
+            a["blocked"] = True
+            self.slice(cpu, n, start, ts, a, "kernel")
+        if cpu in self.running:
+            n, start = self.running.pop(cpu)
+            self.slice(cpu, n, start, ts)
+        if name:
+            self.running[cpu] = (name, ts)
+
+    def add(self, rec):
+        tsc, type, cpu, _, env, a0, a1 = rec
+        ts = self.ts(tsc)
+        if type == TR_ENV_RUN:
+            self.switch(cpu, "env %08x" % env, ts)
+            if env in self.flows:
+                self.events.append({"ph": "f", "bp": "e", "pid": 0,
+                                    "tid": cpu, "name": "ipc", "cat": "ipc",
+                                    "id": self.flows.pop(env), "ts": ts})
+        elif type == TR_IDLE:
+            if self.running.get(cpu, ("",))[0] != "idle":
+                self.switch(cpu, "idle", ts)
+        elif type == TR_SYSCALL:
+            self.begin(cpu, syscall_name(a0), ts, {"a1": "%08x" % a1})
+        elif type == TR_SYSCALL_RET:
+            self.end(cpu, syscall_name(a0), ts,
+                     {"ret": struct.unpack("<i", struct.pack("<I", a1))[0]})
+        elif type == TR_PGFAULT:
+            self.begin(cpu, "page fault", ts,
+                       {"va": "%08x" % a0, "eip": "%08x" % a1})
+        elif type == TR_PGFAULT_DONE:
+            self.end(cpu, "page fault", ts, {})
+        elif type == TR_IPC_SEND:
+            ok = a1 == 0
+            self.instant(cpu, "ipc send" if ok else "ipc send (not receiving)",
+                         ts, {"to": "%08x" % a0})
+            if ok:
+                self.nflows += 1
+                self.flows[struct.unpack("<i", struct.pack("<I", a0))[0]] = self.nflows
+                self.events.append({"ph": "s", "pid": 0, "tid": cpu,
+                                    "name": "ipc", "cat": "ipc",
+                                    "id": self.nflows, "ts": ts})
+        elif type == TR_IPC_RECV:
+            self.instant(cpu, "ipc recv", ts,
+                         {"from": "%08x" % a0 if a0 else "anyone"})
+        elif type == TR_IRQ:
+            self.instant(cpu, "irq %d" % a0, ts, {"eip": "%08x" % a1})
+
+    def finish(self, ts):
+        for cpu in list(self.running):
+            self.switch(cpu, None, ts)
+        for cpu in sorted(set(e["tid"] for e in self.events)):
+            self.events.append({"ph": "M", "pid": 0, "tid": cpu,
+                                "name": "thread_name",
+                                "args": {"name": "CPU %d" % cpu}})
+        self.events.append({"ph": "M", "pid": 0, "name": "process_name",
+                            "args": {"name": "JOS"}})
+
+def main():
+    if len(sys.argv) > 2:
+        sys.exit("usage: %s [serial output]" % sys.argv[0])
+    f = open(sys.argv[1]) if len(sys.argv) == 2 else sys.stdin
+    hz, recs = read_records(f)
+    if not hz or not recs:
+        sys.exit("no trace found")
+    recs.sort(key=lambda r: r[0])
+    t = Timeline(hz, recs[0][0])
+    for rec in recs:
+        t.add(rec)
+    t.finish(t.ts(recs[-1][0]))
+    json.dump({"traceEvents": t.events, "displayTimeUnit": "ns"},
+              sys.stdout, indent=0)
+    print()
+
+main()
@@ -0,0 +1,71 @@
+// File creation benchmark.  Every file created is a metadata update
+// the file server commits to its journal before replying, so with
+// several clients at once, group commit should let them share commits.
+// Reports files created per second with 1 client, then with several.
+//
+//	make run-benchcreate-nox
+// It takes the number of clients as argument when run from the shell
+// (default 4).
+
+#include <inc/lib.h>
+
+#define NFILES		32		// per client
+#define MAXCLIENTS	8
+
+static char buf[100];
+
+static void
+client(int id)
+{
+	char name[MAXNAMELEN];
+	int i, fd, r;
+
+	for (i = 0; i < NFILES; i++) {
+		snprintf(name, sizeof name, "/bench-%d-%d", id, i);
+		if ((fd = open(name, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+			panic("open %s: %e", name, fd);
+		if ((r = write(fd, buf, sizeof buf)) != sizeof buf)
+			panic("write %s: %e", name, r);
+		close(fd);
+	}
+}
+
+static void
+run(int nclients)
+{
+	envid_t envs[MAXCLIENTS];
+	uint32_t msec;
+	int i;
+
+	msec = sys_time_msec();
+	for (i = 0; i < nclients; i++) {
+		if ((envs[i] = fork()) < 0)
+			panic("fork: %e", envs[i]);
+		if (envs[i] == 0) {
+			client(i);
+			exit();
+		}
+	}
+	for (i = 0; i < nclients; i++)
+		wait(envs[i]);
+	msec = sys_time_msec() - msec;
+
+	cprintf("benchcreate: %d clients  %4d files in %5u ms  %5u files/s\n",
+		nclients, nclients * NFILES, msec,
+		msec ? nclients * NFILES * 1000 / msec : 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int nclients = 4;
+
+	if (argc > 1)
+		nclients = strtol(argv[1], 0, 0);
+	if (nclients < 1 || nclients > MAXCLIENTS)
+		panic("usage: benchcreate [nclients], 1 to %d", MAXCLIENTS);
+
+	memset(buf, 'x', sizeof buf);
+	run(1);
+	run(nclients);
+}
@@ -0,0 +1,67 @@
+// Context switch benchmark.  Reports cycles per switch for
+//
+//  - sys_yield with nothing else to run, which goes back to the same
+//    environment and so needs no address space switch at all, and
+//
+//  - IPC ping-pong between two environments, which is what every file
+//    server and network server request does.
+//
+// Compare the numbers across kernels; with one CPU both environments
+// of the ping-pong take turns on it.
+//
+//	make run-benchctxsw-nox CPUS=1
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS		10000
+
+static void
+pong(void)
+{
+	envid_t who;
+	int32_t v;
+
+	for (;;) {
+		v = ipc_recv(&who, 0, 0);
+		ipc_send(who, v + 1, 0, 0);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, cycles;
+	envid_t child;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++)
+		sys_yield();
+	cycles = read_tsc() - start;
+	cprintf("benchctxsw: yield to self  %6u cycles\n",
+		(uint32_t) (cycles / NROUNDS));
+	bench_report("ctxsw.yield", cycles / NROUNDS, "cycles");
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0)
+		pong();
+
+	// The first round trip faults in the child's pages
+	ipc_send(child, 0, 0, 0);
+	ipc_recv(0, 0, 0);
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		ipc_send(child, i, 0, 0);
+		if (ipc_recv(0, 0, 0) != i + 1)
+			panic("bad reply");
+	}
+	cycles = read_tsc() - start;
+	cprintf("benchctxsw: ipc ping-pong  %6u cycles per switch\n",
+		(uint32_t) (cycles / (2 * NROUNDS)));
+	bench_report("ctxsw.ipc", cycles / (2 * NROUNDS), "cycles");
+
+	sys_env_destroy(child);
+}
@@ -0,0 +1,48 @@
+// File benchmark: write a FILESIZE file PGSIZE at a time and sync it,
+// then read it back, which comes from the block cache.  Reports KB/s
+// each way.
+
+#include <inc/lib.h>
+
+#define FILENAME	"/benchfile"
+#define FILESIZE	(256 * 1024)
+
+static char buf[PGSIZE];
+
+static uint32_t
+kbps(uint32_t msec)
+{
+	return (FILESIZE / 1024) * 1000 / MAX(msec, 1);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t wmsec, rmsec;
+	int fd, r, n;
+
+	memset(buf, 'b', sizeof buf);
+	if ((fd = open(FILENAME, O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", FILENAME, fd);
+
+	wmsec = sys_time_msec();
+	for (n = 0; n < FILESIZE; n += sizeof buf)
+		if ((r = write(fd, buf, sizeof buf)) != sizeof buf)
+			panic("write: %e", r);
+	if ((r = fsync(fd)) < 0)
+		panic("fsync: %e", r);
+	wmsec = sys_time_msec() - wmsec;
+
+	seek(fd, 0);
+	rmsec = sys_time_msec();
+	for (n = 0; n < FILESIZE; n += sizeof buf)
+		if ((r = readn(fd, buf, sizeof buf)) != sizeof buf)
+			panic("read: %e", r);
+	rmsec = sys_time_msec() - rmsec;
+	close(fd);
+
+	cprintf("benchfile: %u KB written in %u ms, read in %u ms\n",
+		FILESIZE / 1024, wmsec, rmsec);
+	bench_report("file.write", kbps(wmsec), "KB/s");
+	bench_report("file.read", kbps(rmsec), "KB/s");
+}
@@ -0,0 +1,34 @@
+// fork benchmark.  Reports the cycles it takes for fork() to return in
+// the parent, and until the child, which exits right away, has been
+// waited for.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NRUNS		32
+
+static uint32_t forked[NRUNS], waited[NRUNS];
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t child;
+	int i;
+
+	for (i = 0; i < NRUNS; i++) {
+		start = read_tsc();
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0)
+			exit();
+		forked[i] = read_tsc() - start;
+		wait(child);
+		waited[i] = read_tsc() - start;
+	}
+
+	cprintf("benchfork: fork %u cycles, fork to wait %u cycles\n",
+		bench_median(forked, NRUNS), bench_median(waited, NRUNS));
+	bench_report("fork.fork", bench_median(forked, NRUNS), "cycles");
+	bench_report("fork.wait", bench_median(waited, NRUNS), "cycles");
+}
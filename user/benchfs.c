@@ -0,0 +1,190 @@
+// File server benchmark with several clients at once.
+// "Hot" clients keep reading a small file that is in the block cache,
+// first alone, then while "cold" clients read every other file on the
+// disk, which has to come from the disk.  Reports the latency of the
+// hot reads in cycles, so you can see how much the cold reads slow
+// them down, and the throughput of the cold reads.
+//
+// Blocks stay cached once read, so run it right after boot:
+//	make run-benchfs-nox
+// It takes the number of hot and cold clients as arguments when run
+// from the shell (defaults 2 and 2), but only the first run is cold.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define HOTFILE		"/motd"
+#define MAXCLIENTS	4
+#define NHOTREADS	500		// per hot client, when alone
+#define MAXSAMPLES	1024		// latencies kept per hot client
+#define MAXFILES	64
+
+// Shared with the clients
+struct Results {
+	volatile uint32_t cold_left;	// cold clients still reading
+	uint32_t cold_bytes[MAXCLIENTS];
+	uint32_t nreads[MAXCLIENTS];
+	uint32_t samples[MAXCLIENTS][MAXSAMPLES];
+};
+
+#define RESULTS		((struct Results *) 0x40000000)
+
+static char files[MAXFILES][MAXNAMELEN + 1];
+static int nfiles;
+static char buf[PGSIZE];
+static uint32_t all[MAXCLIENTS * MAXSAMPLES];
+
+// Find the files the cold clients will read
+static void
+list_files(void)
+{
+	struct File f;
+	int fd, n;
+
+	if ((fd = open("/", O_RDONLY)) < 0)
+		panic("open /: %e", fd);
+	while ((n = readn(fd, &f, sizeof f)) == sizeof f) {
+		if (f.f_name[0] == '\0' || f.f_type != FTYPE_REG
+		    || f.f_size == 0 || strcmp(f.f_name, HOTFILE + 1) == 0)
+			continue;
+		if (nfiles == MAXFILES)
+			break;
+		strcpy(files[nfiles++], f.f_name);
+	}
+	close(fd);
+}
+
+// Read the hot file over and over, 'n' times or, if n is 0, as long
+// as cold clients are running.
+static void
+hot_client(int id, uint32_t n)
+{
+	struct Results *res = RESULTS;
+	uint64_t start;
+	uint32_t i;
+	int fd, r;
+
+	if ((fd = open(HOTFILE, O_RDONLY)) < 0)
+		panic("open %s: %e", HOTFILE, fd);
+	for (i = 0; n ? i < n : res->cold_left > 0; i++) {
+		start = read_tsc();
+		if ((r = seek(fd, 0)) < 0 || (r = read(fd, buf, sizeof buf)) <= 0)
+			panic("read %s: %e", HOTFILE, r);
+		if (i < MAXSAMPLES)
+			res->samples[id][i] = read_tsc() - start;
+	}
+	res->nreads[id] = MIN(i, MAXSAMPLES);
+	close(fd);
+}
+
+// Read every ncold'th file, starting with file 'id'
+static void
+cold_client(int id, int ncold)
+{
+	struct Results *res = RESULTS;
+	int i, fd, n;
+
+	for (i = id; i < nfiles; i += ncold) {
+		if ((fd = open(files[i], O_RDONLY)) < 0)
+			panic("open %s: %e", files[i], fd);
+		while ((n = read(fd, buf, sizeof buf)) > 0)
+			res->cold_bytes[id] += n;
+		if (n < 0)
+			panic("read %s: %e", files[i], n);
+		close(fd);
+	}
+	__sync_fetch_and_sub(&res->cold_left, 1);
+}
+
+static void
+sort(uint32_t *v, int n)
+{
+	int gap, i, j;
+	uint32_t x;
+
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++) {
+			x = v[i];
+			for (j = i; j >= gap && v[j - gap] > x; j -= gap)
+				v[j] = v[j - gap];
+			v[j] = x;
+		}
+}
+
+static void
+report(const char *name, int nhot)
+{
+	struct Results *res = RESULTS;
+	int i, n = 0;
+
+	for (i = 0; i < nhot; i++) {
+		memmove(all + n, res->samples[i], res->nreads[i] * sizeof(uint32_t));
+		n += res->nreads[i];
+	}
+	if (n == 0)
+		return;
+	sort(all, n);
+	cprintf("benchfs: %-16s %5d reads  p50 %8u  p99 %8u  max %8u cycles\n",
+		name, n, all[n / 2], all[n * 99 / 100], all[n - 1]);
+}
+
+// Run nhot hot clients, reading 'n' times each, and ncold cold clients
+static void
+run(int nhot, uint32_t n, int ncold)
+{
+	envid_t envs[2 * MAXCLIENTS];
+	int i, nenvs = 0;
+
+	RESULTS->cold_left = ncold;
+	for (i = 0; i < ncold + nhot; i++) {
+		if ((envs[nenvs] = fork()) < 0)
+			panic("fork: %e", envs[nenvs]);
+		if (envs[nenvs] == 0) {
+			if (i < ncold)
+				cold_client(i, ncold);
+			else
+				hot_client(i - ncold, n);
+			exit();
+		}
+		nenvs++;
+	}
+	for (i = 0; i < nenvs; i++)
+		wait(envs[i]);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Results *res = RESULTS;
+	int nhot = 2, ncold = 2, i, r;
+	uint32_t msec, bytes = 0;
+
+	if (argc > 1)
+		nhot = strtol(argv[1], 0, 0);
+	if (argc > 2)
+		ncold = strtol(argv[2], 0, 0);
+	if (nhot < 1 || nhot > MAXCLIENTS || ncold < 1 || ncold > MAXCLIENTS)
+		panic("usage: benchfs [nhot [ncold]], 1 to %d each", MAXCLIENTS);
+
+	for (i = 0; i < ROUNDUP(sizeof(struct Results), PGSIZE); i += PGSIZE)
+		if ((r = sys_page_alloc(0, (char *) res + i,
+					PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			panic("sys_page_alloc: %e", r);
+
+	list_files();
+	// Warm up the hot file, and whatever it takes to open files
+	hot_client(0, 1);
+
+	run(nhot, NHOTREADS, 0);
+	report("hot alone", nhot);
+
+	msec = sys_time_msec();
+	run(nhot, 0, ncold);
+	msec = sys_time_msec() - msec;
+	report("hot with cold", nhot);
+
+	for (i = 0; i < ncold; i++)
+		bytes += res->cold_bytes[i];
+	cprintf("benchfs: cold reads       %5d files %6u KB in %u ms\n",
+		nfiles, bytes / 1024, msec);
+}
@@ -0,0 +1,52 @@
+// IPC wakeup latency benchmark.
+// Bounces a message between two environments and reports the round trip
+// time in cycles.  Run it with CPUS=2 or more: each side blocks in
+// ipc_recv, so its CPU goes idle, and every message has to wake it up.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS		1000
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t start, cycles, total = 0, min = ~0ULL, max = 0;
+	unsigned msec;
+	uint32_t i;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+
+	// Child: echo every value back
+	if (who == 0) {
+		while (1) {
+			i = ipc_recv(&who, 0, 0);
+			ipc_send(who, i, 0, 0);
+			if (i == NROUNDS - 1)
+				return;
+		}
+	}
+
+	msec = sys_time_msec();
+	for (i = 0; i < NROUNDS; i++) {
+		start = read_tsc();
+		ipc_send(who, i, 0, 0);
+		if (ipc_recv(0, 0, 0) != i)
+			panic("benchipc: bad reply");
+		cycles = read_tsc() - start;
+
+		total += cycles;
+		if (cycles < min)
+			min = cycles;
+		if (cycles > max)
+			max = cycles;
+	}
+	msec = sys_time_msec() - msec;
+
+	cprintf("benchipc: %u round trips in %u ms\n", NROUNDS, msec);
+	cprintf("benchipc: round trip cycles avg %u min %u max %u\n",
+		(uint32_t) (total / NROUNDS), (uint32_t) min, (uint32_t) max);
+	bench_report("ipc.roundtrip", total / NROUNDS, "cycles");
+}
@@ -0,0 +1,118 @@
+// Allocation-heavy malloc benchmark.
+// Reports the average number of cycles per operation for a few
+// typical allocation patterns.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NSLOTS		512
+#define NROUNDS		20
+
+static void *slots[NSLOTS];
+static uint32_t seed = 1;
+
+static uint32_t
+rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+static void
+report(const char *name, uint64_t cycles, uint32_t nops)
+{
+	cprintf("benchmalloc: %-24s %8u ops %10u cycles/op\n",
+		name, nops, (uint32_t) (cycles / nops));
+}
+
+// malloc immediately followed by free, always the same size
+static void
+bench_pairs(void)
+{
+	uint64_t start;
+	void *v;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NSLOTS * NROUNDS; i++) {
+		if (!(v = malloc(64)))
+			panic("malloc failed");
+		free(v);
+	}
+	report("alloc/free pairs", read_tsc() - start, NSLOTS * NROUNDS);
+}
+
+// Keep NSLOTS small objects of mixed sizes live, replacing a random
+// one at each step, like a long-running server does
+static void
+bench_mixed(void)
+{
+	uint64_t start;
+	int i, j;
+
+	start = read_tsc();
+	for (i = 0; i < NSLOTS * NROUNDS; i++) {
+		j = rand() % NSLOTS;
+		free(slots[j]);
+		if (!(slots[j] = malloc(8 + rand() % 2000)))
+			panic("malloc failed");
+	}
+	report("mixed small objects", read_tsc() - start, NSLOTS * NROUNDS);
+
+	for (j = 0; j < NSLOTS; j++) {
+		free(slots[j]);
+		slots[j] = 0;
+	}
+}
+
+// Allocate and free multi-page buffers
+static void
+bench_large(void)
+{
+	uint64_t start;
+	int i, j;
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		for (j = 0; j < 16; j++)
+			if (!(slots[j] = malloc((1 + rand() % 16) * PGSIZE)))
+				panic("malloc failed");
+		for (j = 0; j < 16; j++) {
+			free(slots[j]);
+			slots[j] = 0;
+		}
+	}
+	report("large allocations", read_tsc() - start, NROUNDS * 16);
+}
+
+// Grow a buffer the way a string builder would
+static void
+bench_realloc(void)
+{
+	uint64_t start;
+	char *buf = 0;
+	size_t n;
+	uint32_t nops = 0;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		for (n = 16; n <= 256 * 1024; n += n / 2, nops++) {
+			if (!(buf = realloc(buf, n)))
+				panic("realloc failed");
+			buf[n - 1] = 0;
+		}
+		free(buf);
+		buf = 0;
+	}
+	report("realloc growth", read_tsc() - start, nops);
+}
+
+void
+umain(int argc, char **argv)
+{
+	bench_pairs();
+	bench_mixed();
+	bench_large();
+	bench_realloc();
+}
@@ -0,0 +1,50 @@
+// open/stat benchmark: cycles per open and close of a file, per stat,
+// and per open of a file that doesn't exist.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NRUNS		200
+#define FILENAME	"/motd"
+
+static uint32_t samples[NRUNS];
+
+void
+umain(int argc, char **argv)
+{
+	struct Stat st;
+	uint32_t open_cycles, stat_cycles, miss_cycles;
+	uint64_t start;
+	int i, fd, r;
+
+	for (i = 0; i < NRUNS; i++) {
+		start = read_tsc();
+		if ((fd = open(FILENAME, O_RDONLY)) < 0)
+			panic("open %s: %e", FILENAME, fd);
+		close(fd);
+		samples[i] = read_tsc() - start;
+	}
+	open_cycles = bench_median(samples, NRUNS);
+
+	for (i = 0; i < NRUNS; i++) {
+		start = read_tsc();
+		if ((r = stat(FILENAME, &st)) < 0)
+			panic("stat %s: %e", FILENAME, r);
+		samples[i] = read_tsc() - start;
+	}
+	stat_cycles = bench_median(samples, NRUNS);
+
+	for (i = 0; i < NRUNS; i++) {
+		start = read_tsc();
+		if ((fd = open("/no-such-file", O_RDONLY)) != -E_NOT_FOUND)
+			panic("open /no-such-file: %e", fd);
+		samples[i] = read_tsc() - start;
+	}
+	miss_cycles = bench_median(samples, NRUNS);
+
+	cprintf("benchopen: open+close %u cycles, stat %u, missing file %u\n",
+		open_cycles, stat_cycles, miss_cycles);
+	bench_report("open.open", open_cycles, "cycles");
+	bench_report("open.stat", stat_cycles, "cycles");
+	bench_report("open.miss", miss_cycles, "cycles");
+}
@@ -0,0 +1,61 @@
+// Page fault benchmark: cycles per page fault handled at user level.
+//
+//  - zero: the handler maps a fresh page where the fault was, as for
+//    memory allocated on demand.
+//  - cow: writes to pages fork() left copy-on-write, handled by fork's
+//    handler, which copies the page.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES		256
+#define REGION		((char *) 0x40000000)
+
+static void
+handler(struct UTrapframe *utf)
+{
+	void *addr = ROUNDDOWN((void *) utf->utf_fault_va, PGSIZE);
+	int r;
+
+	if ((r = sys_page_alloc(0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+}
+
+static uint32_t
+touch(char val)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		REGION[i * PGSIZE] = val;
+	return (uint32_t) (read_tsc() - start) / NPAGES;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t zero, cow;
+	envid_t child;
+
+	set_pgfault_handler(handler);
+	zero = touch(1);
+
+	// The child holds on to the pages until we have written them all,
+	// so every write has to copy
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		ipc_recv(0, 0, 0);
+		exit();
+	}
+	cow = touch(2);
+	ipc_send(child, 0, 0, 0);
+	wait(child);
+
+	cprintf("benchpgfault: %u cycles per demand-zero fault, "
+		"%u per copy-on-write fault\n", zero, cow);
+	bench_report("pgfault.zero", zero, "cycles");
+	bench_report("pgfault.cow", cow, "cycles");
+}
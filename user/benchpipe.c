@@ -0,0 +1,43 @@
+// Pipe throughput benchmark: a child writes TOTAL bytes through a pipe,
+// PGSIZE at a time, and we read them.  The pipe only buffers a few
+// bytes, so this is mostly switching between the two.
+
+#include <inc/lib.h>
+
+#define TOTAL		(256 * 1024)
+
+static char buf[PGSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t msec, got = 0;
+	int p[2], r, n;
+	envid_t child;
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		close(p[0]);
+		for (n = 0; n < TOTAL; n += sizeof buf)
+			if ((r = write(p[1], buf, sizeof buf)) != sizeof buf)
+				panic("write: %e", r);
+		exit();
+	}
+	close(p[1]);
+
+	msec = sys_time_msec();
+	while ((r = read(p[0], buf, sizeof buf)) > 0)
+		got += r;
+	msec = sys_time_msec() - msec;
+	if (r < 0 || got != TOTAL)
+		panic("read %u bytes: %e", got, r);
+	close(p[0]);
+	wait(child);
+
+	cprintf("benchpipe: %u KB in %u ms\n", TOTAL / 1024, msec);
+	bench_report("pipe.throughput", (TOTAL / 1024) * 1000 / MAX(msec, 1),
+		     "KB/s");
+}
@@ -0,0 +1,75 @@
+// Spawn benchmark.  Spawns itself over and over, and reports how many
+// cycles it takes from calling spawn() until spawn() returns, until
+// the child reaches umain, and until it has exited.
+//
+// The program carries a big initialized array it never touches, which
+// a loader that reads all of the program up front has to read anyway,
+// and one that loads pages on demand doesn't.
+//
+//	make run-benchspawn-nox
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NRUNS		20
+#define BALLAST		(128 * 1024)
+
+// Not static, so it isn't optimized away
+char benchspawn_ballast[BALLAST] = { 1 };
+
+// Shared with the children
+struct Results {
+	volatile uint64_t started;	// when the child got to umain
+};
+
+#define RESULTS		((struct Results *) 0x40000000)
+
+extern char end[];
+
+static uint32_t returned[NRUNS], started[NRUNS], exited[NRUNS];
+
+static void
+report(const char *what, const char *name, uint32_t *v)
+{
+	uint32_t p50 = bench_median(v, NRUNS);
+
+	cprintf("benchspawn: %-16s p50 %9u  max %9u cycles\n",
+		what, p50, v[NRUNS - 1]);
+	bench_report(name, p50, "cycles");
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Results *res = RESULTS;
+	uint64_t start;
+	envid_t child;
+	int i, r;
+
+	if (argc > 1 && strcmp(argv[1], "child") == 0) {
+		res->started = read_tsc();
+		return;
+	}
+
+	if ((r = sys_page_alloc(0, res, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	for (i = 0; i < NRUNS; i++) {
+		res->started = 0;
+		start = read_tsc();
+		if ((child = spawnl("/benchspawn", "benchspawn", "child", 0)) < 0)
+			panic("spawn /benchspawn: %e", child);
+		returned[i] = read_tsc() - start;
+		wait(child);
+		exited[i] = read_tsc() - start;
+		if (!res->started)
+			panic("child didn't run");
+		started[i] = res->started - start;
+	}
+
+	cprintf("benchspawn: %d KB program, %d runs\n",
+		(int) (ROUNDUP((uintptr_t) end, PGSIZE) - UTEXT) / 1024, NRUNS);
+	report("spawn returned", "spawn.return", returned);
+	report("child started", "spawn.start", started);
+	report("child exited", "spawn.exit", exited);
+}
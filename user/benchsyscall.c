@@ -0,0 +1,57 @@
+// Null system call benchmark: cycles per sys_getenvid, about the
+// cheapest system call there is, so mostly the cost of getting into
+// the kernel and back.  That is with SYSENTER, if the kernel has it,
+// and also through the T_SYSCALL gate, for comparison.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NBATCHES	32
+#define BATCH		1000
+
+static uint32_t samples[NBATCHES];
+
+// sys_getenvid, always through the T_SYSCALL gate
+static envid_t
+getenvid_gate(void)
+{
+	envid_t ret;
+
+	asm volatile("int %1\n"
+		: "=a" (ret)
+		: "i" (T_SYSCALL), "a" (SYS_getenvid)
+		: "cc", "memory");
+	return ret;
+}
+
+// Returns the median cycles per call of 'call'
+static uint32_t
+measure(envid_t (*call)(void))
+{
+	uint64_t start;
+	int i, j;
+
+	for (i = 0; i < NBATCHES; i++) {
+		start = read_tsc();
+		for (j = 0; j < BATCH; j++)
+			call();
+		samples[i] = (uint32_t) (read_tsc() - start) / BATCH;
+	}
+	return bench_median(samples, NBATCHES);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t cycles;
+
+	cycles = measure(sys_getenvid);
+	cprintf("benchsyscall: %u cycles per null system call%s\n", cycles,
+		kstats.ks_sysenter ? " (sysenter)" : "");
+	bench_report("syscall.null", cycles, "cycles");
+
+	cycles = measure(getenvid_gate);
+	cprintf("benchsyscall: %u cycles per null system call (gate)\n",
+		cycles);
+	bench_report("syscall.null.gate", cycles, "cycles");
+}
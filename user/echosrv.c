@@ -6,6 +6,10 @@
 
 #define BUFFSIZE 32
 #define MAXPENDING 5    // Max connection requests
+#define MAXCLIENTS 16   // Clients served at the same time
+
+// The listening socket, then one entry per client
+static struct pollfd fds[1 + MAXCLIENTS];
 
 static void
 die(char *m)
@@ -14,36 +18,26 @@ die(char *m)
 	exit();
 }
 
-void
+// Echo back whatever is waiting on a client socket.
+// Returns 0 once the client is gone.
+static int
 handle_client(int sock)
 {
 	char buffer[BUFFSIZE];
-	int received = -1;
-	// Receive message
-	if ((received = read(sock, buffer, BUFFSIZE)) < 0)
-		die("Failed to receive initial bytes from client");
+	int received;
 
-	// Send bytes and check for more incoming data in loop
-	while (received > 0) {
-		// Send back received data
-		if (write(sock, buffer, received) != received)
-			die("Failed to send bytes to client");
-
-		// Check for more data
-		if ((received = read(sock, buffer, BUFFSIZE)) < 0)
-			die("Failed to receive additional bytes from client");
-	}
-	close(sock);
+	if ((received = read(sock, buffer, BUFFSIZE)) < 0)
+		die("Failed to receive bytes from client");
+	if (received > 0 && write(sock, buffer, received) != received)
+		die("Failed to send bytes to client");
+	return received;
 }
 
 void
 umain(int argc, char **argv)
 {
-	int serversock, clientsock;
+	int serversock, clientsock, i;
 	struct sockaddr_in echoserver, echoclient;
-	char buffer[BUFFSIZE];
-	unsigned int echolen;
-	int received = 0;
 
 	// Create the TCP socket
 	if ((serversock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
@@ -71,17 +65,45 @@ umain(int argc, char **argv)
 
 	cprintf("bound\n");
 
+	// Serve all the clients from a single event loop
+	fds[0].fd = serversock;
+	fds[0].events = POLLIN;
+	for (i = 1; i <= MAXCLIENTS; i++)
+		fds[i].fd = -1;
+
 	// Run until canceled
 	while (1) {
+		if (poll(fds, 1 + MAXCLIENTS, -1) < 0)
+			die("Failed to poll sockets");
+
+		for (i = 1; i <= MAXCLIENTS; i++) {
+			if (fds[i].fd < 0 || !fds[i].revents)
+				continue;
+			if (handle_client(fds[i].fd) == 0) {
+				close(fds[i].fd);
+				fds[i].fd = -1;
+			}
+		}
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
 		unsigned int clientlen = sizeof(echoclient);
-		// Wait for client connection
+		// Accept the waiting client connection
 		if ((clientsock =
 		     accept(serversock, (struct sockaddr *) &echoclient,
 			    &clientlen)) < 0) {
 			die("Failed to accept client connection");
 		}
 		cprintf("Client connected: %s\n", inet_ntoa(echoclient.sin_addr));
-		handle_client(clientsock);
+		for (i = 1; i <= MAXCLIENTS && fds[i].fd >= 0; i++)
+			;
+		if (i > MAXCLIENTS) {
+			cprintf("Too many clients\n");
+			close(clientsock);
+			continue;
+		}
+		fds[i].fd = clientsock;
+		fds[i].events = POLLIN;
 	}
 
 	close(serversock);
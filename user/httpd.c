@@ -3,18 +3,28 @@
 #include <lwip/inet.h>
 
 #define PORT 80
-#define VERSION "0.1"
-#define HTTP_VERSION "1.0"
+#define VERSION "0.2"
+#define HTTP_VERSION "1.1"
 
 #define E_BAD_REQ	1000
 
-#define BUFFSIZE 512
-#define MAXPENDING 5	// Max connection requests
+#define BUFFSIZE 2048	// Largest request header we accept
+#define MAXPENDING 16	// Max connection requests
+#define NWORKERS 4	// Processes serving connections at the same time
+#define KEEPALIVE_MS 5000	// How long an idle connection is kept open
 
 struct http_request {
 	int sock;
 	char *url;
 	char *version;
+	int keep_alive;		// Keep the connection open after responding
+};
+
+// Request bytes received on a connection but not handled yet
+struct http_conn {
+	int sock;
+	int len;
+	char buf[BUFFSIZE + 1];
 };
 
 struct responce_header {
@@ -73,23 +83,25 @@ send_header(struct http_request *req, int code)
 	return 0;
 }
 
+// The file goes from the file server to the network server without
+// being copied into our buffers, see sendfile.
 static int
-send_data(struct http_request *req, int fd)
+send_data(struct http_request *req, int fd, off_t size)
 {
-	// LAB 6: Your code here.
-	// File size is limited by BUFFSIZE
-	char buf[BUFFSIZE];
-	int n;
-	if ((n =read(fd, &buf, BUFFSIZE)) < 0)
-		panic("send_data: Failed to read file");
-
-	/* Debugging */
-	// cprintf("send_data: bytes read = %d\n", n);
+	if (sendfile(req->sock, fd, 0, size) != size)
+		return -1;
+	return 0;
+}
 
-	if (write(req->sock, &buf, n) != n) {
-		die("Failed to send bytes to client");
-	}
+static int
+send_connection(struct http_request *req)
+{
+	const char *hdr = req->keep_alive ? "Connection: keep-alive\r\n"
+					  : "Connection: close\r\n";
+	int len = strlen(hdr);
 
+	if (write(req->sock, hdr, len) != len)
+		return -1;
 	return 0;
 }
 
@@ -149,6 +161,44 @@ send_header_fin(struct http_request *req)
 	return 0;
 }
 
+// Compare the first n characters of s1 and s2, ignoring case
+static int
+strncasecmp(const char *s1, const char *s2, size_t n)
+{
+	char c1, c2;
+
+	for (; n > 0; n--, s1++, s2++) {
+		c1 = (*s1 >= 'A' && *s1 <= 'Z') ? *s1 - 'A' + 'a' : *s1;
+		c2 = (*s2 >= 'A' && *s2 <= 'Z') ? *s2 - 'A' + 'a' : *s2;
+		if (c1 != c2 || !c1)
+			return c1 - c2;
+	}
+	return 0;
+}
+
+// HTTP/1.1 keeps connections open unless asked not to, older versions
+// only when asked to.
+static int
+http_keep_alive(const char *version, const char *headers)
+{
+	const char *line, *v;
+	int keep = strncmp(version, "HTTP/1.1", 8) == 0;
+
+	for (line = headers; line && *line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (strncasecmp(line, "Connection:", 11) != 0)
+			continue;
+		for (v = line + 11; *v == ' '; v++)
+			;
+		if (strncasecmp(v, "close", 5) == 0)
+			keep = 0;
+		else if (strncasecmp(v, "keep-alive", 10) == 0)
+			keep = 1;
+	}
+	return keep;
+}
+
 // given a request, this function creates a struct http_request
 static int
 http_request_parse(struct http_request *req, char *request)
@@ -180,7 +230,7 @@ http_request_parse(struct http_request *req, char *request)
 	request++;
 
 	version = request;
-	while (*request && *request != '\n')
+	while (*request && *request != '\r' && *request != '\n')
 		request++;
 	version_len = request - version;
 
@@ -188,6 +238,8 @@ http_request_parse(struct http_request *req, char *request)
 	memmove(req->version, version, version_len);
 	req->version[version_len] = '\0';
 
+	req->keep_alive = http_keep_alive(req->version, request);
+
 	// no entity parsing
 
 	return 0;
@@ -196,8 +248,8 @@ http_request_parse(struct http_request *req, char *request)
 static int
 send_error(struct http_request *req, int code)
 {
-	char buf[512];
-	int r;
+	char body[128], buf[512];
+	int r, n;
 
 	struct error_messages *e = errors;
 	while (e->code != 0 && e->msg != 0) {
@@ -209,13 +261,18 @@ send_error(struct http_request *req, int code)
 	if (e->code == 0)
 		return -1;
 
+	n = snprintf(body, 128, "<html><body><p>%d - %s</p></body></html>\r\n",
+		     e->code, e->msg);
 	r = snprintf(buf, 512, "HTTP/" HTTP_VERSION" %d %s\r\n"
 			       "Server: jhttpd/" VERSION "\r\n"
-			       "Connection: close"
+			       "Connection: %s\r\n"
 			       "Content-type: text/html\r\n"
+			       "Content-Length: %d\r\n"
 			       "\r\n"
-			       "<html><body><p>%d - %s</p></body></html>\r\n",
-			       e->code, e->msg, e->code, e->msg);
+			       "%s",
+			       e->code, e->msg,
+			       req->keep_alive ? "keep-alive" : "close",
+			       n, body);
 
 	if (write(req->sock, buf, r) != r)
 		return -1;
@@ -275,36 +332,96 @@ send_file(struct http_request *req)
 	if ((r = send_content_type(req)) < 0)
 		goto end;
 
+	if ((r = send_connection(req)) < 0)
+		goto end;
+
 	if ((r = send_header_fin(req)) < 0)
 		goto end;
 
-	r = send_data(req, fd);
+	r = send_data(req, fd, file_size);
 
 end:
 	close(fd);
 	return r;
 }
 
+// Find the blank line that ends the request header in buf[0..len),
+// and return the address right after it, or 0 if it isn't there yet.
+static char *
+header_end(char *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != '\n')
+			continue;
+		if (i + 1 < len && buf[i + 1] == '\n')
+			return buf + i + 2;
+		if (i + 2 < len && buf[i + 1] == '\r' && buf[i + 2] == '\n')
+			return buf + i + 3;
+	}
+	return 0;
+}
+
+// Wait for a whole request header on 'conn'.  Returns its length,
+// including the blank line that ends it, or 0 if the client closed the
+// connection or stayed idle for too long.
+static int
+read_request(struct http_conn *conn)
+{
+	struct pollfd pfd;
+	char *end;
+	int n;
+
+	while (1) {
+		conn->buf[conn->len] = '\0';
+		if ((end = header_end(conn->buf, conn->len)) != 0)
+			return end - conn->buf;
+		if (conn->len == BUFFSIZE)
+			return -E_BAD_REQ;
+
+		pfd.fd = conn->sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, KEEPALIVE_MS) <= 0)
+			return 0;
+		if ((n = read(conn->sock, conn->buf + conn->len,
+			      BUFFSIZE - conn->len)) <= 0)
+			return 0;
+		conn->len += n;
+	}
+}
+
 static void
 handle_client(int sock)
 {
+	static struct http_conn conn;
 	struct http_request con_d;
-	int r;
-	char buffer[BUFFSIZE];
-	int received = -1;
+	int r, hdrlen;
+	char saved;
 	struct http_request *req = &con_d;
 
+	conn.sock = sock;
+	conn.len = 0;
+
+	// Serve requests until the client or a request asks us to stop
 	while (1)
 	{
-		// Receive message
-		if ((received = read(sock, buffer, BUFFSIZE)) < 0)
-			panic("failed to read");
-
-		memset(req, 0, sizeof(req));
-
+		memset(req, 0, sizeof(*req));
 		req->sock = sock;
 
-		r = http_request_parse(req, buffer);
+		// Receive message
+		if ((hdrlen = read_request(&conn)) == 0)
+			break;
+		if (hdrlen < 0) {
+			send_error(req, 400);
+			break;
+		}
+
+		// Only look at this request, not at the next one
+		saved = conn.buf[hdrlen];
+		conn.buf[hdrlen] = '\0';
+		r = http_request_parse(req, conn.buf);
+		conn.buf[hdrlen] = saved;
 		if (r == -E_BAD_REQ)
 			send_error(req, 400);
 		else if (r < 0)
@@ -313,9 +430,12 @@ handle_client(int sock)
 			send_file(req);
 
 		req_free(req);
+		if (r < 0 || !req->keep_alive)
+			break;
 
-		// no keep alive
-		break;
+		// Keep what the client already sent of its next request
+		conn.len -= hdrlen;
+		memmove(conn.buf, conn.buf + hdrlen, conn.len);
 	}
 
 	close(sock);
@@ -324,7 +444,7 @@ handle_client(int sock)
 void
 umain(int argc, char **argv)
 {
-	int serversock, clientsock;
+	int serversock, clientsock, i, r;
 	struct sockaddr_in server, client;
 
 	binaryname = "jhttpd";
@@ -350,7 +470,15 @@ umain(int argc, char **argv)
 	if (listen(serversock, MAXPENDING) < 0)
 		die("Failed to listen on server socket");
 
-	cprintf("Waiting for http connections...\n");
+	// Every worker accepts connections on the same listening socket
+	for (i = 1; i < NWORKERS; i++)
+		if ((r = fork()) < 0)
+			die("Failed to fork worker");
+		else if (r == 0)
+			break;
+
+	if (i == NWORKERS)
+		cprintf("Waiting for http connections...\n");
 
 	while (1) {
 		unsigned int clientlen = sizeof(client);
@@ -4,44 +4,42 @@ int bol = 1;
 int line = 0;
 
 void
-num(int f, const char *s)
+num(FILE *f, const char *s)
 {
-	long n;
-	int r;
-	char c;
+	int c;
 
-	while ((n = read(f, &c, 1)) > 0) {
+	while ((c = fgetc(f)) != EOF) {
 		if (bol) {
-			printf("%5d ", ++line);
+			sfprintf(stdout, "%5d ", ++line);
 			bol = 0;
 		}
-		if ((r = write(1, &c, 1)) != 1)
-			panic("write error copying %s: %e", s, r);
+		if (fputc(c, stdout) == EOF)
+			panic("write error copying %s: %e", s, ferror(stdout));
 		if (c == '\n')
 			bol = 1;
 	}
-	if (n < 0)
-		panic("error reading %s: %e", s, n);
+	if (ferror(f))
+		panic("error reading %s: %e", s, ferror(f));
 }
 
 void
 umain(int argc, char **argv)
 {
-	int f, i;
+	FILE *f;
+	int i;
 
 	binaryname = "num";
 	if (argc == 1)
-		num(0, "<stdin>");
+		num(stdin, "<stdin>");
 	else
 		for (i = 1; i < argc; i++) {
-			f = open(argv[i], O_RDONLY);
-			if (f < 0)
-				panic("can't open %s: %e", argv[i], f);
+			f = fopen(argv[i], "r");
+			if (!f)
+				panic("can't open %s", argv[i]);
 			else {
 				num(f, argv[i]);
-				close(f);
+				fclose(f);
 			}
 		}
 	exit();
 }
-
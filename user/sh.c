@@ -1,6 +1,6 @@
 #include <inc/lib.h>
 
-#define BUFSIZ 1024		/* Find the buffer overrun bug! */
+#define ARGBUFSIZ 1024		/* Find the buffer overrun bug! */
 int debug = 0;
 
 
@@ -21,7 +21,7 @@ int gettoken(char *s, char **token);
 void
 runcmd(char* s)
 {
-	char *argv[MAXARGS], *t, argv0buf[BUFSIZ];
+	char *argv[MAXARGS], *t, argv0buf[ARGBUFSIZ];
 	int argc, c, i, r, p[2], fd, pipe_child;
 
 	pipe_child = 0;
@@ -13,7 +13,7 @@ xopen(const char *path, int mode)
 	strcpy(fsipcbuf.open.req_path, path);
 	fsipcbuf.open.req_omode = mode;
 
-	fsenv = ipc_find_env(ENV_TYPE_FS);
+	fsenv = ipc_lookup("fs");
 	ipc_send(fsenv, FSREQ_OPEN, &fsipcbuf, PTE_P | PTE_W | PTE_U);
 	return ipc_recv(NULL, FVA, NULL);
 }
@@ -0,0 +1,64 @@
+// Test kernel-handled copy-on-write faults.
+// The parent opts in, forks, and both sides then write to the same
+// pages.  Each must see only its own writes.
+
+#include <inc/lib.h>
+
+#define NPAGES	16
+
+static char buf[NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+fill(char c)
+{
+	int i;
+
+	for (i = 0; i < NPAGES; i++)
+		buf[i * PGSIZE] = c;
+}
+
+static void
+check(char c, const char *who)
+{
+	int i;
+
+	for (i = 0; i < NPAGES; i++)
+		if (buf[i * PGSIZE] != c)
+			panic("%s: page %d is '%c', expected '%c'",
+			      who, i, buf[i * PGSIZE], c);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int r;
+
+	if ((r = sys_env_set_kern_cow(0, 1)) < 0)
+		panic("sys_env_set_kern_cow: %e", r);
+
+	fill('p');
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+
+	if (child == 0) {
+		check('p', "child");
+		fill('c');
+		check('c', "child");
+		// The grandchild inherits the setting
+		if ((child = fork()) == 0) {
+			fill('g');
+			check('g', "grandchild");
+			exit();
+		}
+		wait(child);
+		check('c', "child");
+		exit();
+	}
+
+	wait(child);
+	check('p', "parent");
+	fill('q');
+	check('q', "parent");
+	cprintf("kernel cow OK\n");
+}
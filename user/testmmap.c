@@ -0,0 +1,87 @@
+// Test mmap() of files: read-only, private and shared mappings.
+
+#include <inc/lib.h>
+
+#define NPAGES		3
+#define FILENAME	"/mmapfile"
+
+static char buf[PGSIZE];
+
+static char
+pattern(int i)
+{
+	return 'a' + i % 23;
+}
+
+// Check that [p, p + n) holds the pattern, starting at file offset 'off'
+static void
+check(const char *what, const char *p, int off, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (p[i] != pattern(off + i))
+			panic("%s: byte %d is %02x, not %02x", what, off + i,
+			      p[i], pattern(off + i));
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, i, r, size = NPAGES * PGSIZE - 100;
+	char *p, *q;
+
+	// A file whose last page is only partly used
+	if ((fd = open(FILENAME, O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", FILENAME, fd);
+	for (i = 0; i < size; i++) {
+		buf[i % PGSIZE] = pattern(i);
+		if (i % PGSIZE == PGSIZE - 1 || i == size - 1)
+			if ((r = write(fd, buf, i % PGSIZE + 1)) != i % PGSIZE + 1)
+				panic("write: %e", r);
+	}
+
+	// Read-only mapping: every byte matches, and the end is zero
+	if (!(p = mmap(fd, 0, NPAGES * PGSIZE, PROT_READ, MAP_SHARED)))
+		panic("mmap read-only failed");
+	check("read-only mapping", p, 0, size);
+	for (i = size; i < NPAGES * PGSIZE; i++)
+		if (p[i] != 0)
+			panic("byte %d past the end of the file is %02x", i, p[i]);
+	// Random access after the first touch doesn't fault any more
+	check("second read", p + PGSIZE + 17, PGSIZE + 17, 100);
+	cprintf("read-only mmap is good\n");
+
+	// Private mapping of the second page: writes don't reach the file
+	if (!(q = mmap(fd, PGSIZE, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE)))
+		panic("mmap private failed");
+	check("private mapping", q, PGSIZE, PGSIZE);
+	memset(q, 'X', 10);
+	if ((r = munmap(q, PGSIZE)) < 0)
+		panic("munmap private: %e", r);
+	check("file after private write", p + PGSIZE, PGSIZE, PGSIZE);
+	cprintf("private mmap is good\n");
+
+	// Shared mapping: writes reach the file once synced, and the file
+	// stays open after close
+	if (!(q = mmap(fd, 0, NPAGES * PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED)))
+		panic("mmap shared failed");
+	close(fd);
+	memset(q + PGSIZE + 5, 'Y', 10);
+	if ((r = munmap(q, NPAGES * PGSIZE)) < 0)
+		panic("munmap shared: %e", r);
+	if ((r = munmap(p, NPAGES * PGSIZE)) < 0)
+		panic("munmap read-only: %e", r);
+
+	if ((fd = open(FILENAME, O_RDONLY)) < 0)
+		panic("open %s: %e", FILENAME, fd);
+	if ((r = seek(fd, PGSIZE)) < 0 || (r = readn(fd, buf, PGSIZE)) != PGSIZE)
+		panic("read back: %e", r);
+	check("read back", buf, PGSIZE, 5);
+	for (i = 5; i < 15; i++)
+		if (buf[i] != 'Y')
+			panic("shared write to byte %d was lost", PGSIZE + i);
+	check("read back", buf + 15, PGSIZE + 15, PGSIZE - 15);
+	close(fd);
+	cprintf("shared mmap is good\n");
+}
@@ -0,0 +1,56 @@
+// Test poll() on pipes.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	struct pollfd fds[2];
+	int p[2], r, i;
+	char c;
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+
+	fds[0].fd = p[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = p[1];
+	fds[1].events = POLLOUT;
+
+	// Empty pipe: only the write end is ready
+	if ((r = poll(fds, 2, 0)) != 1 || fds[0].revents || fds[1].revents != POLLOUT)
+		panic("poll on empty pipe: %d %x %x", r, fds[0].revents, fds[1].revents);
+
+	// Nothing to read: time out
+	if ((r = poll(fds, 1, 50)) != 0)
+		panic("poll didn't time out: %d", r);
+
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0) {
+		close(p[0]);
+		for (i = 0; i < 10; i++)
+			sys_yield();
+		write(p[1], "x", 1);
+		close(p[1]);
+		exit();
+	}
+	close(p[1]);
+
+	// Wait for the child's byte
+	if ((r = poll(fds, 1, -1)) != 1 || !(fds[0].revents & POLLIN))
+		panic("poll for data: %d %x", r, fds[0].revents);
+	if (read(p[0], &c, 1) != 1 || c != 'x')
+		panic("read after poll");
+
+	// Then for the child to close its end
+	if ((r = poll(fds, 1, -1)) != 1 || !(fds[0].revents & POLLHUP))
+		panic("poll for hangup: %d %x", r, fds[0].revents);
+
+	// Closed fds are reported invalid
+	close(p[0]);
+	if ((r = poll(fds, 1, 0)) != 1 || fds[0].revents != POLLNVAL)
+		panic("poll on closed fd: %d %x", r, fds[0].revents);
+
+	cprintf("testpoll OK\n");
+}
@@ -0,0 +1,30 @@
+// Test sys_sleep_until: sleep for increasing periods and report how
+// late we woke up.  Waking up early is a bug.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t deadline, now, late, maxlate = 0;
+	uint32_t usec;
+
+	for (usec = 100; usec <= 100000; usec *= 10) {
+		deadline = sys_time_nsec() + usec * 1000ULL;
+		sys_sleep_until(deadline);
+		now = sys_time_nsec();
+		if (now < deadline)
+			panic("woke up %u ns early", (uint32_t) (deadline - now));
+		late = now - deadline;
+		if (late > maxlate)
+			maxlate = late;
+		cprintf("slept %6u us, woke up %u us late\n",
+			usec, (uint32_t) (late / 1000));
+	}
+
+	// A deadline in the past returns right away
+	if (sys_sleep_until(1) != 0)
+		panic("sys_sleep_until in the past failed");
+
+	cprintf("testsleep OK, at most %u us late\n", (uint32_t) (maxlate / 1000));
+}
@@ -0,0 +1,78 @@
+// Test 4MB pages: sys_page_alloc with PTE_PS, mapping them, fork's
+// copy-on-write and unmapping.
+
+#include <inc/lib.h>
+
+#define VA	((uint32_t *) 0x40000000)
+#define VA2	((uint32_t *) 0x40400000)
+
+#define WORDS_PER_PAGE	(PGSIZE / sizeof(uint32_t))
+
+// Check that every 4KB page of the 4MB page at 'p' starts with its
+// number, except 'page', which starts with 'val'.
+static void
+check(const char *what, uint32_t *p, int page, uint32_t val)
+{
+	int i;
+
+	for (i = 0; i < NPTENTRIES; i++)
+		if (p[i * WORDS_PER_PAGE] != (i == page ? val : i))
+			panic("%s: page %d holds %x", what, i,
+			      p[i * WORDS_PER_PAGE]);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, VA + WORDS_PER_PAGE,
+				PTE_P|PTE_U|PTE_W|PTE_PS)) != -E_INVAL)
+		panic("sys_page_alloc of a misaligned 4MB page: %e", r);
+	if ((r = sys_page_alloc(0, VA, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (!(uvpd[PDX(VA)] & PTE_PS))
+		panic("not a 4MB page");
+	for (i = 0; i < NPTENTRIES; i++)
+		VA[i * WORDS_PER_PAGE] = i;
+	check("alloc", VA, -1, 0);
+	cprintf("4MB page alloc is good\n");
+
+	// It can only be mapped whole
+	if ((r = sys_page_map(0, VA + WORDS_PER_PAGE, 0, VA2,
+			      PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("sys_page_map of part of a 4MB page: %e", r);
+	if ((r = sys_page_map(0, VA, 0, VA2, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_map: %e", r);
+	VA2[7 * WORDS_PER_PAGE] = 0x77;
+	check("map", VA, 7, 0x77);
+	VA[7 * WORDS_PER_PAGE] = 7;
+	sys_page_unmap(0, VA2);
+	if (uvpd[PDX(VA2)] & PTE_P)
+		panic("4MB page still mapped at VA2");
+	cprintf("4MB page map is good\n");
+
+	// Copy-on-write
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		check("child before write", VA, -1, 0);
+		VA[3 * WORDS_PER_PAGE] = 0xdead;
+		check("child after write", VA, 3, 0xdead);
+		exit();
+	}
+	wait(child);
+	check("parent after child", VA, -1, 0);
+	VA[5 * WORDS_PER_PAGE] = 0xbeef;
+	check("parent after write", VA, 5, 0xbeef);
+	if (!(uvpd[PDX(VA)] & PTE_PS) || (uvpd[PDX(VA)] & PTE_COW))
+		panic("4MB page not writable after fork");
+	cprintf("4MB page fork is good\n");
+
+	// Unmapping any of it unmaps all of it
+	sys_page_unmap(0, VA + 5 * WORDS_PER_PAGE);
+	if (uvpd[PDX(VA)] & PTE_P)
+		panic("4MB page still mapped");
+	cprintf("4MB page unmap is good\n");
+}
@@ -0,0 +1,58 @@
+// Test single-stepping into a SYSENTER system call.  SYSENTER leaves
+// TF set, so the kernel takes a debug trap on its first instruction;
+// it must carry on with the system call, not panic, and the
+// environment must get its single-step trap right after coming back.
+
+#include <inc/lib.h>
+
+extern char sysenter_step_ret[];
+
+// sys_getenvid by hand, with TF set just for the SYSENTER
+static void
+step_into_syscall(void)
+{
+	asm volatile("pushl %%ebp\n\t"
+		     "movl %%esp, %%ebp\n\t"
+		     "leal sysenter_step_ret, %%esi\n\t"
+		     "pushfl\n\t"
+		     "orl %1, (%%esp)\n\t"
+		     "popfl\n\t"
+		     "sysenter\n"
+		     ".globl sysenter_step_ret\n"
+		     "sysenter_step_ret:\n\t"
+		     "popl %%ebp\n"
+		: : "a" (SYS_getenvid), "i" (FL_TF)
+		: "ecx", "edx", "esi", "cc", "memory");
+	panic("no single-step trap after the system call");
+}
+
+void
+umain(int argc, char **argv)
+{
+	const volatile struct Env *e;
+	envid_t child;
+
+	if (!kstats.ks_sysenter) {
+		cprintf("testsysenterstep: no SYSENTER, nothing to test\n");
+		return;
+	}
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		// The kernel destroys us for the debug trap
+		step_into_syscall();
+		return;
+	}
+
+	wait(child);
+	e = &envs[ENVX(child)];
+	if (e->env_tf.tf_trapno != T_DEBUG)
+		panic("child ended with trap %d, not a debug trap",
+		      e->env_tf.tf_trapno);
+	if ((char *) e->env_tf.tf_eip < sysenter_step_ret ||
+	    (char *) e->env_tf.tf_eip > sysenter_step_ret + 1)
+		panic("debug trap at %08x, not after the system call",
+		      e->env_tf.tf_eip);
+	cprintf("testsysenterstep OK\n");
+}
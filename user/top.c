@@ -0,0 +1,225 @@
+// Show what the environments are doing: every few seconds, each one's
+// share of a CPU, system calls, IPC and page faults since the last
+// time, and how long the kernel takes for each system call so far.
+//
+// It only reads 'envs' and 'kstats', which the kernel maps read-only
+// into every environment, so all it costs is the printing.
+//
+//	top [-d seconds] [-n count]
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+static const char *syscall_names[NSYSCALLS] = {
+	[SYS_cputs] = "cputs",
+	[SYS_cgetc] = "cgetc",
+	[SYS_getenvid] = "getenvid",
+	[SYS_env_destroy] = "env_destroy",
+	[SYS_page_alloc] = "page_alloc",
+	[SYS_page_map] = "page_map",
+	[SYS_page_unmap] = "page_unmap",
+	[SYS_exofork] = "exofork",
+	[SYS_env_set_status] = "env_set_status",
+	[SYS_env_set_trapframe] = "env_set_trapframe",
+	[SYS_env_set_pgfault_upcall] = "env_set_pgfault_upcall",
+	[SYS_yield] = "yield",
+	[SYS_ipc_try_send] = "ipc_try_send",
+	[SYS_ipc_recv] = "ipc_recv",
+	[SYS_time_msec] = "time_msec",
+	[SYS_transmit_packet] = "transmit_packet",
+	[SYS_receive_packet] = "receive_packet",
+	[SYS_get_mac_address] = "get_mac_address",
+	[SYS_page_alloc_range] = "page_alloc_range",
+	[SYS_env_set_kern_cow] = "env_set_kern_cow",
+	[SYS_sfork] = "sfork",
+	[SYS_time_nsec] = "time_nsec",
+	[SYS_sleep_until] = "sleep_until",
+	[SYS_ipc_recv_until] = "ipc_recv_until",
+	[SYS_ipc_recv_from] = "ipc_recv_from",
+	[SYS_trace] = "trace",
+	[SYS_service_register] = "service_register",
+	[SYS_service_lookup] = "service_lookup",
+};
+
+// What an environment's counters were last time
+struct Snapshot {
+	envid_t id;
+	uint64_t cycles;
+	uint32_t syscalls;
+	uint32_t ipc_sent;
+	uint32_t ipc_recvd;
+	uint32_t ipc_not_recv;
+	uint32_t pgfaults;
+};
+
+static struct Snapshot *last;	// One for each of envs[]
+
+static void
+usage(void)
+{
+	printf("usage: top [-d seconds] [-n count]\n");
+	exit();
+}
+
+static char
+status_char(unsigned status)
+{
+	switch (status) {
+	case ENV_RUNNING:
+		return 'R';
+	case ENV_RUNNABLE:
+		return 'r';
+	case ENV_NOT_RUNNABLE:
+		return 'S';
+	case ENV_DYING:
+		return 'D';
+	}
+	return '?';
+}
+
+// 'n' per 'cycles' TSC ticks, as a rate per second
+static uint32_t
+per_sec(uint32_t n, uint64_t cycles)
+{
+	return n * kstats.ks_tsc_hz / cycles;
+}
+
+static long
+number(struct Argstate *args)
+{
+	const char *s = argvalue(args);
+	long n = 0;
+
+	if (!s || (n = strtol(s, 0, 10)) <= 0)
+		usage();
+	return n;
+}
+
+// Show the environments' counters over the last 'elapsed' cycles, and
+// remember them for next time.  Just remember them if 'elapsed' is 0.
+static void
+show_envs(uint64_t elapsed)
+{
+	const volatile struct Env *e;
+	struct Snapshot now, *s;
+	uint32_t tenths;
+	int i, j;
+
+	if (elapsed)
+		printf("   envid   parent s   cpu%%  sysc/s  sent/s  recv/s  busy/s  flt/s  pages\n");
+	for (i = 0; i < kstats.ks_nenv; i++) {
+		e = &envs[i];
+		s = &last[i];
+		if (e->env_status == ENV_FREE) {
+			s->id = 0;
+			continue;
+		}
+
+		now.id = e->env_id;
+		now.cycles = e->env_stats.es_cycles;
+		now.syscalls = 0;
+		for (j = 0; j < NSYSCALLS; j++)
+			now.syscalls += e->env_stats.es_syscalls[j];
+		now.ipc_sent = e->env_stats.es_ipc_sent;
+		now.ipc_recvd = e->env_stats.es_ipc_recvd;
+		now.ipc_not_recv = e->env_stats.es_ipc_not_recv;
+		now.pgfaults = e->env_stats.es_pgfaults;
+		// A new environment in this slot starts from zero
+		if (s->id != now.id)
+			memset(s, 0, sizeof(*s));
+
+		if (!elapsed) {
+			*s = now;
+			continue;
+		}
+		tenths = (now.cycles - s->cycles) * 1000 / elapsed;
+		printf("%08x %08x %c %4d.%d %7d %7d %7d %7d %6d %6d\n",
+		       e->env_id, e->env_parent_id, status_char(e->env_status),
+		       tenths / 10, tenths % 10,
+		       per_sec(now.syscalls - s->syscalls, elapsed),
+		       per_sec(now.ipc_sent - s->ipc_sent, elapsed),
+		       per_sec(now.ipc_recvd - s->ipc_recvd, elapsed),
+		       per_sec(now.ipc_not_recv - s->ipc_not_recv, elapsed),
+		       per_sec(now.pgfaults - s->pgfaults, elapsed),
+		       e->env_stats.es_pages);
+		*s = now;
+	}
+}
+
+// Upper bound, in cycles, of the bucket that holds the 'pct' percentile
+static uint64_t
+percentile(const volatile struct Histogram *h, int pct)
+{
+	uint32_t want = (h->h_count * (uint64_t) pct + 99) / 100, seen = 0;
+	int i;
+
+	for (i = 0; i < NHISTBUCKETS - 1; i++)
+		if ((seen += h->h_buckets[i]) >= want)
+			break;
+	return 2ULL << i;
+}
+
+static void
+show_histogram(const char *name, const volatile struct Histogram *h)
+{
+	if (!h->h_count)
+		return;
+	printf("%-22s %9d %9d %9lld %9lld\n", name, h->h_count,
+	       (uint32_t) (h->h_cycles / h->h_count),
+	       percentile(h, 50), percentile(h, 99));
+}
+
+static void
+show_syscalls(void)
+{
+	char num[16];
+	int i;
+
+	printf("%-22s %9s %9s %9s %9s  (cycles)\n",
+	       "system call", "count", "mean", "p50 <", "p99 <");
+	for (i = 0; i < NSYSCALLS; i++) {
+		if (!syscall_names[i])
+			snprintf(num, sizeof(num), "%d", i);
+		show_histogram(syscall_names[i] ? syscall_names[i] : num,
+			       &kstats.ks_syscalls[i]);
+	}
+	show_histogram("page fault", &kstats.ks_pgfaults);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Argstate args;
+	uint64_t then, now;
+	long seconds = 2, count = 0, n;
+	int i;
+
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'd':
+			seconds = number(&args);
+			break;
+		case 'n':
+			count = number(&args);
+			break;
+		default:
+			usage();
+		}
+	if (argc != 1)
+		usage();
+
+	if (!(last = malloc(kstats.ks_nenv * sizeof(*last))))
+		panic("top: out of memory");
+	memset(last, 0, kstats.ks_nenv * sizeof(*last));
+	then = read_tsc();
+	show_envs(0);
+	for (n = 0; !count || n < count; n++) {
+		sys_sleep_until(sys_time_nsec() + seconds * 1000000000ULL);
+		now = read_tsc();
+		printf("\n");
+		show_envs(now - then);
+		show_syscalls();
+		then = now;
+	}
+}
@@ -0,0 +1,63 @@
+// Turn the kernel's event tracing on and off (see inc/trace.h).
+//
+//	trace [-d] [category...]
+//
+// traces the categories given (sched, ipc, syscall, pgfault, irq or all)
+// from now on, or nothing if none are.  With -d it first writes out what
+// was traced so far over the serial port, for trace2json.py:
+//
+//	$ trace sched ipc
+//	$ ls -l
+//	$ trace -d
+
+#include <inc/lib.h>
+
+static const struct {
+	const char *name;
+	uint32_t mask;
+} categories[] = {
+	{ "sched", TRACE_SCHED },
+	{ "ipc", TRACE_IPC },
+	{ "syscall", TRACE_SYSCALL },
+	{ "pgfault", TRACE_PGFAULT },
+	{ "irq", TRACE_IRQ },
+	{ "all", TRACE_ALL },
+};
+#define NCATEGORIES (sizeof(categories) / sizeof(categories[0]))
+
+static void
+usage(void)
+{
+	printf("usage: trace [-d] [sched|ipc|syscall|pgfault|irq|all]...\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Argstate args;
+	uint32_t mask = 0;
+	int drain = 0, i, j, r;
+
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'd':
+			drain = 1;
+			break;
+		default:
+			usage();
+		}
+
+	for (i = 1; i < argc; i++) {
+		for (j = 0; j < NCATEGORIES; j++)
+			if (strcmp(argv[i], categories[j].name) == 0)
+				break;
+		if (j == NCATEGORIES)
+			usage();
+		mask |= categories[j].mask;
+	}
+
+	if ((r = sys_trace(mask, drain)) < 0)
+		panic("sys_trace: %e", r);
+}